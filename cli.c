@@ -4,10 +4,37 @@
  * License: MIT.
  */
 
+/* For `fileno`, `fmemopen`, `posix_fadvise`, and `posix_memalign`. */
+#define _POSIX_C_SOURCE 200809L
+#ifdef __linux__
+/* For `syscall`. */
+#define _DEFAULT_SOURCE
+#endif
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#endif
+
+/* io_uring is optional. Define `HICOLOR_CLI_NO_IO_URING` to leave it out. */
+#if defined(__linux__) && !defined(HICOLOR_CLI_NO_IO_URING) \
+    && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define HICOLOR_CLI_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
+
 #include <png.h>
 #include <zlib.h>
 
@@ -18,479 +45,4970 @@
 #define HICOLOR_CLI_LIB_NAME_FORMAT "%-9s"
 #define HICOLOR_CLI_LIBPNG_COMPRESSION_LEVEL 6
 #define HICOLOR_CLI_NO_MEMORY_EXIT_CODE 255
+#define HICOLOR_CLI_DIFFUSION_SPAN 256
+#define HICOLOR_CLI_MAX_JOBS 256
+#define HICOLOR_CLI_MANIFEST_LINE_MAX 16384
+#define HICOLOR_CLI_HASH_BUFFER_SIZE 65536
+#define HICOLOR_CLI_KEYFRAME_INTERVAL 30
+#define HICOLOR_CLI_IO_BUFFER_SIZE (1 << 20)
+#define HICOLOR_CLI_IO_ALIGNMENT 4096
+#define HICOLOR_CLI_PREFETCH_FILES 64
+#define HICOLOR_CLI_PREFETCH_SIZE 65536
+#define HICOLOR_CLI_ARENA_RGB 0
+#define HICOLOR_CLI_ARENA_ALPHA 1
+#define HICOLOR_CLI_ARENA_ORIGINAL 2
+/* Memory outside the image buffers: the output buffer, libpng, and zlib. */
+#define HICOLOR_CLI_MEMORY_OVERHEAD (2 << 20)
 
 #define HICOLOR_CLI_CMD_ENCODE "encode"
 #define HICOLOR_CLI_CMD_QUANTIZE "quantize"
 #define HICOLOR_CLI_CMD_DECODE "decode"
 #define HICOLOR_CLI_CMD_INFO "info"
+#define HICOLOR_CLI_CMD_COMPARE "compare"
+#define HICOLOR_CLI_CMD_CONVERT "convert"
+#define HICOLOR_CLI_CMD_PACK "pack"
+#define HICOLOR_CLI_CMD_UNPACK "unpack"
 #define HICOLOR_CLI_CMD_VERSION "version"
+#define HICOLOR_CLI_CMD_VERIFY "verify"
 #define HICOLOR_CLI_CMD_HELP "help"
 
-const char* png_error_msg = "no error recorded";
+const char* image_error_msg = "no error recorded";
 
-void libpng_error_handler(
-    png_structp png_ptr,
-    png_const_charp error_msg
-)
+/* Scratch memory for whole images. A batch reuses it from one file to
+ * the next instead of allocating and faulting in new buffers each time.
+ */
+hicolor_context scratch;
+
+/* A Chrome trace-event log for `--trace`. Each span is written as
+ * a complete event when it ends, so a failed run still leaves a usable log.
+ * Thread IDs are small numbers given out in the order threads first log.
+ */
+typedef struct trace_log {
+    FILE* fp;
+    pthread_mutex_t lock;
+    pthread_key_t thread_key;
+    int threads;
+    double origin;
+    bool empty;
+} trace_log;
+
+trace_log trace = {.fp = NULL};
+
+/* Return a monotonic time in microseconds. */
+double trace_clock(void)
 {
-    png_error_msg = error_msg;
-    longjmp(png_jmpbuf(png_ptr), 1);
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
 }
 
-bool load_png(
-    const char* filename,
-    int* width,
-    int* height,
-    hicolor_rgb** rgb_img,
-    uint8_t** alpha
+/* Return the start time for `trace_span` or 0 when not tracing. */
+double trace_begin(void)
+{
+    return trace.fp == NULL ? 0 : trace_clock();
+}
+
+/* The functions below must be called with `trace.lock` held. */
+
+void trace_write_string(
+    const char* str
 )
 {
-    FILE* fp = fopen(filename, "rb");
-    if (!fp) {
-        png_error_msg = "failed to open for reading";
-        return false;
-    }
+    fputc('"', trace.fp);
 
-    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, libpng_error_handler, NULL);
-    if (png == NULL) {
-        png_error_msg = "`png_create_read_struct` returned null";
-        fclose(fp);
-        return false;
+    for (; *str != '\0'; str++) {
+        unsigned char ch = *str;
+        if (ch == '"' || ch == '\\') {
+            fprintf(trace.fp, "\\%c", ch);
+        } else if (ch < 0x20) {
+            fprintf(trace.fp, "\\u%04x", ch);
+        } else {
+            fputc(ch, trace.fp);
+        }
     }
 
-    png_infop info = png_create_info_struct(png);
-    if (info == NULL) {
-        png_error_msg = "`png_create_info_struct` returned null";
-        png_destroy_read_struct(&png, NULL, NULL);
-        fclose(fp);
-        return false;
-    }
+    fputc('"', trace.fp);
+}
 
-    if (setjmp(png_jmpbuf(png))) {
-        /* Do not overwrite `png_error_msg` set by the handler. */
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        return false;
+int trace_thread_id(void)
+{
+    void* id = pthread_getspecific(trace.thread_key);
+    if (id == NULL) {
+        id = (void*) (intptr_t) ++trace.threads;
+        pthread_setspecific(trace.thread_key, id);
     }
 
-    png_init_io(png, fp);
-    png_read_info(png, info);
+    return (int) (intptr_t) id;
+}
 
-    *width = png_get_image_width(png, info);
-    *height = png_get_image_height(png, info);
-    png_byte color_type = png_get_color_type(png, info);
-    png_byte bit_depth = png_get_bit_depth(png, info);
+void trace_start_event(void)
+{
+    fputs(trace.empty ? "\n" : ",\n", trace.fp);
+    trace.empty = false;
+}
 
-    if (bit_depth == 16) {
-        png_set_strip_16(png);
+/* Name the calling thread in the trace. */
+void trace_thread_name(
+    const char* name
+)
+{
+    if (trace.fp == NULL) {
+        return;
     }
 
-    if (color_type == PNG_COLOR_TYPE_PALETTE) {
-        png_set_palette_to_rgb(png);
-    }
+    pthread_mutex_lock(&trace.lock);
+    trace_start_event();
+    fprintf(
+        trace.fp,
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%i,"
+        "\"args\":{\"name\":",
+        trace_thread_id()
+    );
+    trace_write_string(name);
+    fputs("}}", trace.fp);
+    pthread_mutex_unlock(&trace.lock);
+}
 
-    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
-        png_set_expand_gray_1_2_4_to_8(png);
+/* Record a span that started at `start` and ends now.
+ * `file` is shown with the span unless it is NULL.
+ */
+void trace_span(
+    const char* name,
+    const char* file,
+    double start
+)
+{
+    if (trace.fp == NULL) {
+        return;
     }
 
-    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
-        png_set_tRNS_to_alpha(png);
-    }
+    double end = trace_clock();
 
-    if (color_type == PNG_COLOR_TYPE_RGB
-        || color_type == PNG_COLOR_TYPE_GRAY
-        || color_type == PNG_COLOR_TYPE_PALETTE) {
-        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    pthread_mutex_lock(&trace.lock);
+    trace_start_event();
+    fprintf(
+        trace.fp,
+        "{\"name\":\"%s\",\"cat\":\"hicolor\",\"ph\":\"X\",\"pid\":1,"
+        "\"tid\":%i,\"ts\":%.3f,\"dur\":%.3f",
+        name,
+        trace_thread_id(),
+        start - trace.origin,
+        end - start
+    );
+    if (file != NULL) {
+        fputs(",\"args\":{\"file\":", trace.fp);
+        trace_write_string(file);
+        fputc('}', trace.fp);
     }
+    fputc('}', trace.fp);
+    pthread_mutex_unlock(&trace.lock);
+}
 
-    if (color_type == PNG_COLOR_TYPE_GRAY
-        || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
-        png_set_gray_to_rgb(png);
+/* Record the plan for converting `file` and the scratch memory still
+ * held at that point as an instant event.
+ */
+void trace_plan(
+    const char* file,
+    const hicolor_plan* plan
+)
+{
+    if (trace.fp == NULL) {
+        return;
     }
 
-    png_read_update_info(png, info);
+    size_t held = 0;
+    for (int i = 0; i < HICOLOR_CONTEXT_ARENAS; i++) {
+        held += scratch.arenas[i].capacity;
+    }
 
-    *rgb_img = malloc(sizeof(hicolor_rgb) * *width * *height);
-    *alpha = malloc(sizeof(uint8_t) * *width * *height);
+    pthread_mutex_lock(&trace.lock);
+    trace_start_event();
+    fprintf(
+        trace.fp,
+        "{\"name\":\"plan\",\"cat\":\"hicolor\",\"ph\":\"i\",\"s\":\"t\","
+        "\"pid\":1,\"tid\":%i,\"ts\":%.3f,\"args\":{\"file\":",
+        trace_thread_id(),
+        trace_clock() - trace.origin
+    );
+    trace_write_string(file);
+    fprintf(
+        trace.fp,
+        ",\"whole_image\":%s,\"jobs\":%i,\"band_rows\":%i,"
+        "\"memory\":%zu,\"scratch\":%zu}}",
+        plan->whole_image ? "true" : "false",
+        plan->jobs,
+        plan->band_rows,
+        plan->memory,
+        held
+    );
+    pthread_mutex_unlock(&trace.lock);
+}
 
-    if (*rgb_img == NULL || *alpha == NULL) {
-        png_error_msg = "failed to allocate memory for `rgb_img` or `alpha`";
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        return false;
+void trace_close(void)
+{
+    if (trace.fp == NULL) {
+        return;
     }
 
-    png_bytep row = malloc(png_get_rowbytes(png, info));
-    if (row == NULL) {
-        png_error_msg = "failed to allocate memory for `row`";
-        free(*rgb_img);
-        free(*alpha);
-        png_destroy_read_struct(&png, &info, NULL);
-        fclose(fp);
-        return false;
-    }
+    fputs("\n]}\n", trace.fp);
+    fclose(trace.fp);
+    trace.fp = NULL;
 
-    for (int y = 0; y < *height; y++) {
-        png_read_row(png, row, NULL);
+    pthread_key_delete(trace.thread_key);
+    pthread_mutex_destroy(&trace.lock);
+}
 
-        for (int x = 0; x < *width; x++) {
-            png_bytep pixel = &(row[x * 4]);
-            (*rgb_img)[y * (*width) + x].r = pixel[0];
-            (*rgb_img)[y * (*width) + x].g = pixel[1];
-            (*rgb_img)[y * (*width) + x].b = pixel[2];
-            (*alpha)[y * (*width) + x] = pixel[3];
-        }
+/* Start tracing to `filename`. The log is completed at exit. */
+bool trace_open(
+    const char* filename
+)
+{
+    trace.fp = fopen(filename, "w");
+    if (trace.fp == NULL) {
+        return false;
     }
 
-    free(row);
-    png_destroy_read_struct(&png, &info, NULL);
-    fclose(fp);
+    pthread_mutex_init(&trace.lock, NULL);
+    pthread_key_create(&trace.thread_key, NULL);
+    trace.threads = 0;
+    trace.origin = trace_clock();
+    trace.empty = true;
+
+    fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[", trace.fp);
+    atexit(trace_close);
+    trace_thread_name("main");
 
     return true;
 }
 
-bool save_png(
-    const char* filename,
-    int width,
-    int height,
-    const hicolor_rgb* rgb_img,
-    const uint8_t* alpha
+/* Read-ahead of small source files for batches. `--io-uring` reads up to
+ * `HICOLOR_CLI_PREFETCH_FILES` files at a time with io_uring on Linux:
+ * one system call opens all of them, one reads all of them, and one
+ * closes them. Files that are missing, too large, or empty are left
+ * for stdio, which reports errors as usual. Without io_uring, every file
+ * is left for stdio.
+ */
+typedef struct prefetch_file {
+    const char* path;
+    const uint8_t* data;
+    size_t size;
+} prefetch_file;
+
+/* The current source of a batch if it was read ahead. */
+const prefetch_file* prefetched = NULL;
+
+#ifdef HICOLOR_CLI_IO_URING
+/* A minimal io_uring on raw system calls. Requests are queued, then
+ * submitted and waited for together.
+ */
+typedef struct uring {
+    int fd;
+    unsigned entries;
+    unsigned queued;
+    unsigned* sq_tail;
+    unsigned* sq_mask;
+    unsigned* sq_array;
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_size;
+    void* cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+} uring;
+
+void uring_free(
+    uring* ring
 )
 {
-    FILE* fp = fopen(filename, "wb");
-    if (!fp) {
-        png_error_msg = "failed to open for writing";
-        return false;
+    if (ring->sq_ring != MAP_FAILED) {
+        munmap(ring->sq_ring, ring->sq_ring_size);
     }
-
-    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, libpng_error_handler, NULL);
-    if (png == NULL) {
-        png_error_msg = "`png_create_write_struct` returned null";
-        fclose(fp);
-        return false;
+    if (ring->cq_ring != MAP_FAILED) {
+        munmap(ring->cq_ring, ring->cq_ring_size);
     }
-
-    png_infop info = png_create_info_struct(png);
-    if (info == NULL) {
-        png_error_msg = "`png_create_info_struct` returned null";
-        png_destroy_write_struct(&png, NULL);
-        fclose(fp);
-        return false;
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
     }
 
-    if (setjmp(png_jmpbuf(png))) {
-        /* Do not overwrite `png_error_msg` set by the handler. */
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
+    close(ring->fd);
+}
+
+/* Return false if the kernel doesn't support io_uring or forbids it. */
+bool uring_init(
+    uring* ring,
+    unsigned entries
+)
+{
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+
+    ring->fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (ring->fd < 0) {
         return false;
     }
 
-    png_init_io(png, fp);
+    ring->entries = params.sq_entries;
+    ring->queued = 0;
+    ring->sq_ring_size = params.sq_off.array
+                         + params.sq_entries * sizeof(unsigned);
+    ring->cq_ring_size = params.cq_off.cqes
+                         + params.cq_entries * sizeof(struct io_uring_cqe);
+    ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
 
-    png_set_IHDR(
-        png,
-        info,
-        width,
-        height,
-        8,
-        PNG_COLOR_TYPE_RGBA,
-        PNG_INTERLACE_NONE,
-        PNG_COMPRESSION_TYPE_DEFAULT,
-        PNG_FILTER_TYPE_DEFAULT
+    ring->sq_ring = mmap(
+        NULL,
+        ring->sq_ring_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        ring->fd,
+        IORING_OFF_SQ_RING
+    );
+    ring->cq_ring = mmap(
+        NULL,
+        ring->cq_ring_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        ring->fd,
+        IORING_OFF_CQ_RING
+    );
+    ring->sqes = mmap(
+        NULL,
+        ring->sqes_size,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED,
+        ring->fd,
+        IORING_OFF_SQES
     );
-    png_set_compression_level(png, HICOLOR_CLI_LIBPNG_COMPRESSION_LEVEL);
-    png_write_info(png, info);
 
-    png_bytep row = malloc(png_get_rowbytes(png, info));
-    if (row == NULL) {
-        png_error_msg = "failed to allocate memory for `row`";
-        png_destroy_write_struct(&png, &info);
-        fclose(fp);
+    if (ring->sq_ring == MAP_FAILED
+        || ring->cq_ring == MAP_FAILED
+        || ring->sqes == MAP_FAILED) {
+        uring_free(ring);
         return false;
     }
 
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-            png_bytep pixel = &(row[x * 4]);
-            pixel[0] = rgb_img[y * width + x].r;
-            pixel[1] = rgb_img[y * width + x].g;
-            pixel[2] = rgb_img[y * width + x].b;
-            pixel[3] = alpha == NULL ? 255 : alpha[y * width + x];
-        }
+    uint8_t* sq = ring->sq_ring;
+    uint8_t* cq = ring->cq_ring;
+
+    ring->sq_tail = (unsigned*) (sq + params.sq_off.tail);
+    ring->sq_mask = (unsigned*) (sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*) (sq + params.sq_off.array);
+    ring->cq_head = (unsigned*) (cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*) (cq + params.cq_off.tail);
+    ring->cq_mask = (unsigned*) (cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*) (cq + params.cq_off.cqes);
+
+    return true;
+}
 
-        png_write_row(png, row);
+/* Return a cleared submission for request `id`
+ * or NULL if the queue is full.
+ */
+struct io_uring_sqe* uring_queue(
+    uring* ring,
+    uint8_t opcode,
+    int fd,
+    int id
+)
+{
+    if (ring->queued == ring->entries) {
+        return NULL;
     }
 
-    free(row);
-    png_write_end(png, NULL);
-    png_destroy_write_struct(&png, &info);
-    fclose(fp);
+    /* Only this process writes the tail. */
+    unsigned index = (*ring->sq_tail + ring->queued) & *ring->sq_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = id;
+    ring->sq_array[index] = index;
+    ring->queued++;
+
+    return sqe;
+}
+
+/* Submit the queued requests and wait for all of them. Store the result
+ * of request `id` in `results[id]`.
+ */
+bool uring_run(
+    uring* ring,
+    int* results
+)
+{
+    unsigned count = ring->queued;
+    unsigned submitted = 0;
+    unsigned completed = 0;
+
+    __atomic_store_n(ring->sq_tail, *ring->sq_tail + count, __ATOMIC_RELEASE);
+    ring->queued = 0;
+
+    while (completed < count) {
+        long n = syscall(
+            __NR_io_uring_enter,
+            ring->fd,
+            count - submitted,
+            count - completed,
+            IORING_ENTER_GETEVENTS,
+            NULL,
+            0
+        );
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+
+            return false;
+        }
+        submitted += n;
+
+        unsigned head = *ring->cq_head;
+        unsigned tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+        for (; head != tail; head++) {
+            struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_mask];
+            results[cqe->user_data] = cqe->res;
+            completed++;
+        }
+
+        __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
 
     return true;
 }
+#endif
 
-bool check_and_report_error(
-    char* step,
-    hicolor_result res
+typedef struct prefetcher {
+    bool active;
+#ifdef HICOLOR_CLI_IO_URING
+    uring ring;
+    uint8_t* buffers;
+#endif
+    prefetch_file files[HICOLOR_CLI_PREFETCH_FILES];
+    int count;
+} prefetcher;
+
+/* Set up read-ahead if `enable` is true and the system supports it. */
+void prefetcher_init(
+    prefetcher* pf,
+    bool enable
 )
 {
-    if (res == HICOLOR_OK) {
-        return false;
+    pf->active = false;
+    pf->count = 0;
+
+#ifdef HICOLOR_CLI_IO_URING
+    if (!enable) {
+        return;
     }
 
-    fprintf(
-        stderr,
-        HICOLOR_CLI_ERROR "%s: %s\n",
-        step,
-        hicolor_error_message(res)
+    pf->buffers = malloc(
+        HICOLOR_CLI_PREFETCH_FILES * HICOLOR_CLI_PREFETCH_SIZE
     );
+    if (pf->buffers == NULL) {
+        return;
+    }
 
-    return true;
+    if (!uring_init(&pf->ring, HICOLOR_CLI_PREFETCH_FILES)) {
+        free(pf->buffers);
+        return;
+    }
+
+    pf->active = true;
+#else
+    (void) enable;
+#endif
 }
 
-bool check_src_exists(
-    const char* src
+void prefetcher_free(
+    prefetcher* pf
 )
 {
-    if (access(src, F_OK) != 0) {
-        fprintf(
-            stderr,
-            HICOLOR_CLI_ERROR "source image \"%s\" doesn't exist\n",
-            src
-        );
-        return false;
+#ifdef HICOLOR_CLI_IO_URING
+    if (pf->active) {
+        uring_free(&pf->ring);
+        free(pf->buffers);
     }
+#endif
 
-    return true;
+    pf->active = false;
 }
 
-bool png_to_hicolor(
-    hicolor_version version,
-    hicolor_dither dither,
-    const char* src,
-    const char* dest
+#ifdef HICOLOR_CLI_IO_URING
+/* Close the open descriptors among `fds` without the ring. */
+void close_fds(
+    const int* fds,
+    int count
 )
 {
-    hicolor_result res;
+    for (int i = 0; i < count; i++) {
+        if (fds[i] >= 0) {
+            close(fds[i]);
+        }
+    }
+}
 
-    bool exists = check_src_exists(src);
-    if (!exists) {
+/* Open, read, and close the files in three rounds of requests.
+ * On failure, close what was opened without the ring.
+ */
+bool prefetch_uring(
+    prefetcher* pf
+)
+{
+    int fds[HICOLOR_CLI_PREFETCH_FILES];
+    int results[HICOLOR_CLI_PREFETCH_FILES];
+    struct io_uring_sqe* sqe;
+
+    /* Each round queues at most one request per file,
+     * so `uring_queue` can't return NULL below.
+     */
+    assert((unsigned) pf->count <= pf->ring.entries);
+
+    for (int i = 0; i < pf->count; i++) {
+        sqe = uring_queue(&pf->ring, IORING_OP_OPENAT, AT_FDCWD, i);
+        sqe->addr = (uintptr_t) pf->files[i].path;
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        results[i] = -1;
+    }
+
+    if (!uring_run(&pf->ring, results)) {
+        close_fds(results, pf->count);
         return false;
     }
 
-    int width, height;
-    hicolor_rgb* rgb_img = NULL;
-    uint8_t* alpha = NULL;
-    if (!load_png(src, &width, &height, &rgb_img, &alpha)) {
-        fprintf(
-            stderr,
-            HICOLOR_CLI_ERROR "can't load PNG file \"%s\": %s\n",
-            src,
-            png_error_msg
+    for (int i = 0; i < pf->count; i++) {
+        fds[i] = results[i];
+        if (fds[i] < 0) {
+            continue;
+        }
+
+        sqe = uring_queue(&pf->ring, IORING_OP_READ, fds[i], i);
+        sqe->addr = (uintptr_t) (
+            pf->buffers + (size_t) i * HICOLOR_CLI_PREFETCH_SIZE
         );
+        sqe->len = HICOLOR_CLI_PREFETCH_SIZE;
+        sqe->off = 0;
+        results[i] = -1;
+    }
+
+    if (!uring_run(&pf->ring, results)) {
+        close_fds(fds, pf->count);
         return false;
     }
 
-    FILE* hi_file = fopen(dest, "wb");
-    if (hi_file == NULL) {
-        fprintf(
-            stderr,
-            HICOLOR_CLI_ERROR "can't open file \"%s\" for writing\n",
-            dest
-        );
+    for (int i = 0; i < pf->count; i++) {
+        if (fds[i] < 0) {
+            continue;
+        }
+
+        /* A full buffer may be a partial read of a larger file. */
+        if (results[i] > 0 && results[i] < HICOLOR_CLI_PREFETCH_SIZE) {
+            pf->files[i].data = pf->buffers
+                                + (size_t) i * HICOLOR_CLI_PREFETCH_SIZE;
+            pf->files[i].size = results[i];
+        }
+
+        uring_queue(&pf->ring, IORING_OP_CLOSE, fds[i], i);
+        results[i] = -1;
+    }
+
+    /* Skip the descriptors the ring has closed, since another thread
+     * may have reused them.
+     */
+    if (!uring_run(&pf->ring, results)) {
+        for (int i = 0; i < pf->count; i++) {
+            if (results[i] == 0) {
+                fds[i] = -1;
+            }
+        }
+
+        close_fds(fds, pf->count);
+        return false;
+    }
+
+    return true;
+}
+#endif
+
+/* Read ahead up to `HICOLOR_CLI_PREFETCH_FILES` of `paths`
+ * and return how many the batch covers.
+ */
+int prefetch(
+    prefetcher* pf,
+    char** paths,
+    int count
+)
+{
+    if (count > HICOLOR_CLI_PREFETCH_FILES) {
+        count = HICOLOR_CLI_PREFETCH_FILES;
+    }
+
+    pf->count = count;
+    for (int i = 0; i < count; i++) {
+        pf->files[i].path = paths[i];
+        pf->files[i].data = NULL;
+        pf->files[i].size = 0;
+    }
+
+#ifdef HICOLOR_CLI_IO_URING
+    if (pf->active) {
+        double start = trace_begin();
+        bool ok = prefetch_uring(pf);
+        trace_span("prefetch", NULL, start);
+
+        /* A failed ring can't be trusted with the buffers again. */
+        if (!ok) {
+            for (int i = 0; i < count; i++) {
+                pf->files[i].data = NULL;
+            }
+
+            uring_free(&pf->ring);
+            pf->buffers = NULL;
+            pf->active = false;
+        }
+    }
+#endif
+
+    return count;
+}
+
+/* Formats of images other than HiColor. Netpbm covers PPM, PGM, and PAM
+ * for reading. The raw formats are headerless 8-bit RGB and RGBA.
+ */
+typedef enum image_format {
+    IMAGE_AUTO,
+    IMAGE_PNG,
+    IMAGE_PPM,
+    IMAGE_PAM,
+    IMAGE_RGB,
+    IMAGE_RGBA
+} image_format;
+
+/* File extensions and `--format` arguments by format. */
+const char* image_format_extensions[] = {
+    "", "png", "ppm", "pam", "rgb", "rgba"
+};
+
+/* `width` and `height` give the size of raw input. */
+typedef struct image_options {
+    image_format format;
+    int width;
+    int height;
+} image_options;
+
+typedef struct convert_options {
+    hicolor_version version;
+    hicolor_dither dither;
+    int jobs;
+    bool skip_exact;
+    bool pyramid;
+    uint16_t resize_width;
+    uint16_t resize_height;
+    image_options image;
+    size_t max_memory;
+    bool checksum;
+    bool indexed;
+    uint8_t alpha_threshold;
+} convert_options;
+
+void libpng_error_handler(
+    png_structp png_ptr,
+    png_const_charp error_msg
+)
+{
+    image_error_msg = error_msg;
+    longjmp(png_jmpbuf(png_ptr), 1);
+}
+
+const char* image_format_name(
+    image_format format
+)
+{
+    switch (format) {
+    case IMAGE_PPM:
+        return "PPM";
+    case IMAGE_PAM:
+        return "PAM";
+    case IMAGE_RGB:
+        return "raw RGB";
+    case IMAGE_RGBA:
+        return "raw RGBA";
+    default:
+        return "PNG";
+    }
+}
+
+bool str_ends_with(
+    const char* str,
+    const char* suffix
+)
+{
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    if (suffix_len > len) {
+        return false;
+    }
+
+    for (size_t i = 0; i < suffix_len; i++) {
+        char ch = str[len - suffix_len + i];
+        if (ch >= 'A' && ch <= 'Z') {
+            ch += 'a' - 'A';
+        }
+        if (ch != suffix[i]) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Use the format given as an option or else guess it from the extension. */
+image_format image_format_for(
+    const image_options* image,
+    const char* path
+)
+{
+    if (image->format != IMAGE_AUTO) {
+        return image->format;
+    }
+
+    if (str_ends_with(path, ".ppm")
+        || str_ends_with(path, ".pgm")
+        || str_ends_with(path, ".pnm")) {
+        return IMAGE_PPM;
+    }
+    if (str_ends_with(path, ".pam")) {
+        return IMAGE_PAM;
+    }
+    if (str_ends_with(path, ".rgb")) {
+        return IMAGE_RGB;
+    }
+    if (str_ends_with(path, ".rgba")) {
+        return IMAGE_RGBA;
+    }
+
+    return IMAGE_PNG;
+}
+
+void report_load_error(
+    const image_options* image,
+    const char* src
+)
+{
+    fprintf(
+        stderr,
+        HICOLOR_CLI_ERROR "can't load %s file \"%s\": %s\n",
+        image_format_name(image_format_for(image, src)),
+        src,
+        image_error_msg
+    );
+}
+
+void report_save_error(
+    const image_options* image,
+    const char* dest
+)
+{
+    fprintf(
+        stderr,
+        HICOLOR_CLI_ERROR "can't save %s: %s\n",
+        image_format_name(image_format_for(image, dest)),
+        image_error_msg
+    );
+}
+
+/* The reader maps the file into memory when it can and reads it through
+ * a large stdio buffer otherwise. The writer collects the output in a large
+ * aligned buffer and writes it in few large writes.
+ * Rows are always RGBA in `row`.
+ */
+typedef struct image_reader {
+    FILE* fp;
+    const uint8_t* map;
+    size_t map_size;
+    size_t map_pos;
+    image_format format;
+    png_structp png;
+    png_infop info;
+    png_bytep row;
+    uint8_t* file_row;
+    int depth;
+    int maxval;
+    int y;
+    int width;
+    int height;
+    bool quantize;
+    hicolor_metadata meta;
+    hicolor_dither dither;
+    uint8_t alpha_threshold;
+    hicolor_diffuser diffuser;
+} image_reader;
+
+typedef struct image_writer {
+    FILE* fp;
+    uint8_t* buffer;
+    size_t buffered;
+    image_format format;
+    png_structp png;
+    png_infop info;
+    png_bytep row;
+    int width;
+    int height;
+} image_writer;
+
+hicolor_result image_reader_quantize(
+    image_reader* reader,
+    int y,
+    uint8_t channels,
+    uint8_t* data
+)
+{
+    /* Version A quantizes alpha to 1 bit in the same pass. */
+    if (reader->meta.version == HICOLOR_VERSION_A && channels == 4) {
+        return reader->dither == HICOLOR_FLOYD_STEINBERG
+            ? hicolor_diffuse_rgba_row(
+                &reader->diffuser,
+                data,
+                reader->alpha_threshold
+            )
+            : hicolor_quantize_rgba_row(
+                reader->meta,
+                reader->dither,
+                y,
+                data,
+                reader->alpha_threshold
+            );
+    }
+
+    if (reader->dither == HICOLOR_FLOYD_STEINBERG) {
+        return hicolor_diffuse_row(&reader->diffuser, channels, data);
+    }
+
+    return hicolor_quantize_row(
+        reader->meta,
+        reader->dither,
+        y,
+        channels,
+        data
+    );
+}
+
+/* A libpng user transform that quantizes each row as it is decoded,
+ * while the row is still in cache.
+ */
+void image_reader_quantize_row(
+    png_structp png,
+    png_row_infop row_info,
+    png_bytep data
+)
+{
+    image_reader* reader = png_get_user_transform_ptr(png);
+
+    hicolor_result res = image_reader_quantize(
+        reader,
+        png_get_current_row_number(png),
+        row_info->channels,
+        data
+    );
+    if (res != HICOLOR_OK) {
+        png_error(png, hicolor_error_message(res));
+    }
+}
+
+void image_reader_close(
+    image_reader* reader
+)
+{
+    free(reader->row);
+    free(reader->file_row);
+    hicolor_diffuser_free(&reader->diffuser);
+    if (reader->png != NULL) {
+        png_destroy_read_struct(&reader->png, &reader->info, NULL);
+    }
+    /* The batch owns the memory of a file read ahead. */
+    if (reader->fp == NULL) {
+        return;
+    }
+#ifndef _WIN32
+    if (reader->map != NULL) {
+        munmap((void*) reader->map, reader->map_size);
+    }
+#endif
+    fclose(reader->fp);
+}
+
+/* Map the file into memory if possible and tell the kernel it will be
+ * read sequentially. Otherwise give stdio a large buffer.
+ */
+void image_reader_init_input(
+    image_reader* reader
+)
+{
+#ifndef _WIN32
+    int fd = fileno(reader->fp);
+    struct stat st;
+
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+
+        if (map != MAP_FAILED) {
+            posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+            posix_madvise(map, st.st_size, POSIX_MADV_WILLNEED);
+
+            reader->map = map;
+            reader->map_size = st.st_size;
+            reader->map_pos = 0;
+            return;
+        }
+    }
+#endif
+
+    setvbuf(reader->fp, NULL, _IOFBF, HICOLOR_CLI_IO_BUFFER_SIZE);
+}
+
+/* Read `length` bytes from the mapping or the file. */
+bool image_reader_read(
+    image_reader* reader,
+    void* data,
+    size_t length
+)
+{
+    if (reader->map == NULL) {
+        return fread(data, 1, length, reader->fp) == length;
+    }
+
+    if (length > reader->map_size - reader->map_pos) {
+        return false;
+    }
+
+    memcpy(data, reader->map + reader->map_pos, length);
+    reader->map_pos += length;
+
+    return true;
+}
+
+int image_reader_getc(
+    image_reader* reader
+)
+{
+    uint8_t ch;
+    return image_reader_read(reader, &ch, 1) ? ch : EOF;
+}
+
+void png_read_input(
+    png_structp png,
+    png_bytep data,
+    size_t length
+)
+{
+    if (!image_reader_read(png_get_io_ptr(png), data, length)) {
+        /* The same message as libpng's own read function. */
+        png_error(png, "Read Error");
+    }
+}
+
+bool image_reader_open_png(
+    image_reader* reader
+)
+{
+    png_structp png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, libpng_error_handler, NULL);
+    if (png == NULL) {
+        image_error_msg = "`png_create_read_struct` returned null";
+        return false;
+    }
+    reader->png = png;
+
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        image_error_msg = "`png_create_info_struct` returned null";
+        return false;
+    }
+    reader->info = info;
+
+    if (setjmp(png_jmpbuf(png))) {
+        /* Do not overwrite `image_error_msg` set by the handler. */
+        return false;
+    }
+
+    png_set_read_fn(png, reader, png_read_input);
+    png_read_info(png, info);
+
+    reader->width = png_get_image_width(png, info);
+    reader->height = png_get_image_height(png, info);
+    png_byte color_type = png_get_color_type(png, info);
+    png_byte bit_depth = png_get_bit_depth(png, info);
+
+    if (bit_depth == 16) {
+        png_set_strip_16(png);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_palette_to_rgb(png);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_GRAY && bit_depth < 8) {
+        png_set_expand_gray_1_2_4_to_8(png);
+    }
+
+    if (png_get_valid(png, info, PNG_INFO_tRNS)) {
+        png_set_tRNS_to_alpha(png);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_RGB
+        || color_type == PNG_COLOR_TYPE_GRAY
+        || color_type == PNG_COLOR_TYPE_PALETTE) {
+        png_set_filler(png, 0xFF, PNG_FILLER_AFTER);
+    }
+
+    if (color_type == PNG_COLOR_TYPE_GRAY
+        || color_type == PNG_COLOR_TYPE_GRAY_ALPHA) {
+        png_set_gray_to_rgb(png);
+    }
+
+    if (reader->quantize) {
+        png_set_read_user_transform_fn(png, image_reader_quantize_row);
+        png_set_user_transform_info(png, reader, 0, 0);
+    }
+
+    png_read_update_info(png, info);
+
+    return true;
+}
+
+/* Read a whitespace-separated decimal number in a Netpbm header.
+ * Comments start with '#' and run to the end of the line.
+ */
+bool netpbm_read_number(
+    image_reader* reader,
+    int* value
+)
+{
+    int ch = image_reader_getc(reader);
+
+    while (ch == '#' || ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n') {
+        if (ch == '#') {
+            while (ch != '\n' && ch != EOF) {
+                ch = image_reader_getc(reader);
+            }
+        }
+        ch = image_reader_getc(reader);
+    }
+
+    if (ch < '0' || ch > '9') {
+        return false;
+    }
+
+    long number = 0;
+    while (ch >= '0' && ch <= '9') {
+        number = number * 10 + (ch - '0');
+        if (number > INT32_MAX) {
+            return false;
+        }
+        ch = image_reader_getc(reader);
+    }
+
+    /* A single whitespace character ends the number (and the header). */
+    *value = number;
+
+    return ch == ' ' || ch == '\t' || ch == '\r' || ch == '\n';
+}
+
+/* Read a PAM header line by line until "ENDHDR". */
+bool pam_read_header(
+    image_reader* reader
+)
+{
+    char line[256];
+    bool seen[4] = {false, false, false, false};
+
+    while (true) {
+        size_t len = 0;
+        int ch;
+
+        while ((ch = image_reader_getc(reader)) != '\n') {
+            if (ch == EOF) {
+                return false;
+            }
+            if (len < sizeof(line) - 1) {
+                line[len++] = ch;
+            }
+        }
+        line[len] = '\0';
+
+        if (line[0] == '#' || line[0] == '\0') {
+            continue;
+        }
+        if (strcmp(line, "ENDHDR") == 0) {
+            break;
+        }
+
+        const char* keys[] = {"WIDTH ", "HEIGHT ", "DEPTH ", "MAXVAL "};
+        int* values[] = {
+            &reader->width,
+            &reader->height,
+            &reader->depth,
+            &reader->maxval
+        };
+        for (int i = 0; i < 4; i++) {
+            if (strncmp(line, keys[i], strlen(keys[i])) == 0) {
+                *values[i] = atoi(line + strlen(keys[i]));
+                seen[i] = true;
+            }
+        }
+    }
+
+    return seen[0] && seen[1] && seen[2] && seen[3];
+}
+
+bool image_reader_open_netpbm(
+    image_reader* reader
+)
+{
+    uint8_t magic[2];
+    if (!image_reader_read(reader, magic, 2) || magic[0] != 'P') {
+        image_error_msg = "not a Netpbm file";
+        return false;
+    }
+
+    bool ok = false;
+    if (magic[1] == '5' || magic[1] == '6') {
+        reader->depth = magic[1] == '5' ? 1 : 3;
+        ok = netpbm_read_number(reader, &reader->width)
+            && netpbm_read_number(reader, &reader->height)
+            && netpbm_read_number(reader, &reader->maxval);
+    } else if (magic[1] == '7') {
+        ok = image_reader_getc(reader) == '\n' && pam_read_header(reader);
+    } else {
+        image_error_msg = "unsupported Netpbm format (only P5, P6, and P7)";
+        return false;
+    }
+
+    if (!ok
+        || reader->depth < 1
+        || reader->depth > 4
+        || reader->maxval < 1
+        || reader->maxval > 65535) {
+        image_error_msg = "bad Netpbm header";
+        return false;
+    }
+
+    return true;
+}
+
+/* Open an image file for reading row by row. If `quantize` is true,
+ * the rows are quantized with `version` and `dither` as they are read.
+ */
+bool image_reader_open(
+    image_reader* reader,
+    const char* filename,
+    const image_options* image,
+    bool quantize,
+    hicolor_version version,
+    hicolor_dither dither,
+    uint8_t alpha_threshold
+)
+{
+    reader->row = NULL;
+    reader->file_row = NULL;
+    reader->map = NULL;
+    reader->png = NULL;
+    reader->info = NULL;
+    reader->diffuser.errors = NULL;
+    reader->diffuser.next_errors = NULL;
+    reader->format = image_format_for(image, filename);
+    reader->quantize = quantize;
+    reader->dither = dither;
+    reader->alpha_threshold = alpha_threshold;
+    reader->depth = 4;
+    reader->maxval = 255;
+    reader->y = 0;
+
+    double start = trace_begin();
+
+    if (prefetched != NULL
+        && prefetched->data != NULL
+        && strcmp(prefetched->path, filename) == 0) {
+        reader->fp = NULL;
+        reader->map = prefetched->data;
+        reader->map_size = prefetched->size;
+        reader->map_pos = 0;
+    } else {
+        reader->fp = fopen(filename, "rb");
+        if (!reader->fp) {
+            image_error_msg = "failed to open for reading";
+            return false;
+        }
+
+        image_reader_init_input(reader);
+    }
+
+    bool ok;
+    switch (reader->format) {
+    case IMAGE_PPM:
+    case IMAGE_PAM:
+        ok = image_reader_open_netpbm(reader);
+        break;
+    case IMAGE_RGB:
+    case IMAGE_RGBA:
+        reader->depth = reader->format == IMAGE_RGB ? 3 : 4;
+        reader->width = image->width;
+        reader->height = image->height;
+        ok = reader->width > 0;
+        if (!ok) {
+            image_error_msg = "the size of raw images must be given";
+        }
+        break;
+    default:
+        ok = image_reader_open_png(reader);
+    }
+
+    if (ok && (reader->width < 1
+               || reader->width > UINT16_MAX
+               || reader->height < 1
+               || reader->height > UINT16_MAX)) {
+        image_error_msg = "image size must be from 1x1 to 65535x65535";
+        ok = false;
+    }
+
+    if (!ok) {
+        /* Do not overwrite `image_error_msg`. */
+        image_reader_close(reader);
+        return false;
+    }
+
+    reader->meta.version = version;
+    reader->meta.width = reader->width;
+    reader->meta.height = reader->height;
+
+    if (quantize && dither == HICOLOR_FLOYD_STEINBERG) {
+        if (hicolor_diffuser_init(&reader->diffuser, reader->meta)
+            != HICOLOR_OK) {
+            image_error_msg = "failed to allocate memory for error diffusion";
+            image_reader_close(reader);
+            return false;
+        }
+    }
+
+    reader->row = malloc((size_t) reader->width * 4);
+    if (reader->format != IMAGE_PNG) {
+        int sample_size = reader->maxval > 255 ? 2 : 1;
+        reader->file_row =
+            malloc((size_t) reader->width * reader->depth * sample_size);
+    }
+    if (reader->row == NULL
+        || (reader->format != IMAGE_PNG && reader->file_row == NULL)) {
+        image_error_msg = "failed to allocate memory for `row`";
+        image_reader_close(reader);
+        return false;
+    }
+
+    trace_span("open", filename, start);
+
+    return true;
+}
+
+/* Convert a row of Netpbm or raw samples to RGBA. */
+void image_reader_expand_row(
+    image_reader* reader
+)
+{
+    int depth = reader->depth;
+    bool wide = reader->maxval > 255;
+    int maxval = reader->maxval;
+
+    for (int x = 0; x < reader->width; x++) {
+        int samples[4] = {0, 0, 0, 255};
+
+        for (int c = 0; c < depth; c++) {
+            size_t i = (size_t) x * depth + c;
+            int v = wide
+                ? reader->file_row[i * 2] << 8 | reader->file_row[i * 2 + 1]
+                : reader->file_row[i];
+            if (v > maxval) v = maxval;
+            samples[c] = maxval == 255 ? v : (v * 255 + maxval / 2) / maxval;
+        }
+
+        uint8_t* pixel = &reader->row[x * 4];
+        bool gray = depth < 3;
+        pixel[0] = samples[0];
+        pixel[1] = gray ? samples[0] : samples[1];
+        pixel[2] = gray ? samples[0] : samples[2];
+        pixel[3] = depth == 2 ? samples[1] : depth == 4 ? samples[3] : 255;
+    }
+}
+
+/* Read the next row as RGBA into `reader->row`. */
+bool image_reader_read_row(
+    image_reader* reader
+)
+{
+    if (reader->format == IMAGE_PNG) {
+        if (setjmp(png_jmpbuf(reader->png))) {
+            /* Do not overwrite `image_error_msg` set by the handler. */
+            return false;
+        }
+
+        png_read_row(reader->png, reader->row, NULL);
+        reader->y++;
+
+        return true;
+    }
+
+    size_t sample_size = reader->maxval > 255 ? 2 : 1;
+    size_t row_size = (size_t) reader->width * reader->depth * sample_size;
+
+    if (reader->depth == 4 && sample_size == 1) {
+        if (!image_reader_read(reader, reader->row, row_size)) {
+            image_error_msg = "Read Error";
+            return false;
+        }
+    } else {
+        if (!image_reader_read(reader, reader->file_row, row_size)) {
+            image_error_msg = "Read Error";
+            return false;
+        }
+        image_reader_expand_row(reader);
+    }
+
+    if (reader->quantize) {
+        hicolor_result res =
+            image_reader_quantize(reader, reader->y, 4, reader->row);
+        if (res != HICOLOR_OK) {
+            image_error_msg = hicolor_error_message(res);
+            return false;
+        }
+    }
+
+    reader->y++;
+
+    return true;
+}
+
+/* Read the next `rows` rows into `rgb_img` and `alpha`. */
+bool image_reader_read_rows(
+    image_reader* reader,
+    int rows,
+    hicolor_rgb* rgb_img,
+    uint8_t* alpha
+)
+{
+    for (int y = 0; y < rows; y++) {
+        if (!image_reader_read_row(reader)) {
+            return false;
+        }
+
+        for (int x = 0; x < reader->width; x++) {
+            png_bytep pixel = &(reader->row[x * 4]);
+            size_t i = (size_t) y * reader->width + x;
+            rgb_img[i].r = pixel[0];
+            rgb_img[i].g = pixel[1];
+            rgb_img[i].b = pixel[2];
+            alpha[i] = pixel[3];
+        }
+    }
+
+    return true;
+}
+
+/* Load an image file. If `quantize` is true, quantize it while decoding.
+ * With a `context`, the image and alpha buffers come from its arenas and
+ * must not be freed. Otherwise they are allocated for the caller.
+ */
+bool load_image(
+    const char* filename,
+    const image_options* image,
+    hicolor_context* context,
+    bool quantize,
+    hicolor_version version,
+    hicolor_dither dither,
+    uint8_t alpha_threshold,
+    int* width,
+    int* height,
+    hicolor_rgb** rgb_img,
+    uint8_t** alpha
+)
+{
+    image_reader reader;
+    if (!image_reader_open(
+        &reader,
+        filename,
+        image,
+        quantize,
+        version,
+        dither,
+        alpha_threshold
+    )) {
+        return false;
+    }
+
+    *width = reader.width;
+    *height = reader.height;
+
+    size_t count = (size_t) *width * *height;
+    if (context != NULL) {
+        *rgb_img = hicolor_context_buffer(
+            context,
+            HICOLOR_CLI_ARENA_RGB,
+            sizeof(hicolor_rgb) * count
+        );
+        *alpha = hicolor_context_buffer(
+            context,
+            HICOLOR_CLI_ARENA_ALPHA,
+            sizeof(uint8_t) * count
+        );
+    } else {
+        *rgb_img = malloc(sizeof(hicolor_rgb) * count);
+        *alpha = malloc(sizeof(uint8_t) * count);
+    }
+
+    bool success = *rgb_img != NULL && *alpha != NULL;
+    if (!success) {
+        image_error_msg = "failed to allocate memory for `rgb_img` or `alpha`";
+    } else {
+        double start = trace_begin();
+        success = image_reader_read_rows(&reader, *height, *rgb_img, *alpha);
+        trace_span("decode", filename, start);
+    }
+
+    image_reader_close(&reader);
+
+    if (!success && context == NULL) {
+        free(*rgb_img);
+        free(*alpha);
+    }
+
+    return success;
+}
+
+void image_writer_abort(
+    image_writer* writer
+)
+{
+    free(writer->row);
+    free(writer->buffer);
+    if (writer->png != NULL) {
+        png_destroy_write_struct(&writer->png, &writer->info);
+    }
+    fclose(writer->fp);
+}
+
+bool image_writer_flush_buffer(
+    image_writer* writer
+)
+{
+    double start = trace_begin();
+    size_t written = fwrite(writer->buffer, 1, writer->buffered, writer->fp);
+    bool success = written == writer->buffered;
+    writer->buffered = 0;
+    trace_span("write", NULL, start);
+
+    return success;
+}
+
+bool image_writer_write(
+    image_writer* writer,
+    const uint8_t* data,
+    size_t length
+)
+{
+    while (length > 0) {
+        if (writer->buffered == HICOLOR_CLI_IO_BUFFER_SIZE
+            && !image_writer_flush_buffer(writer)) {
+            return false;
+        }
+
+        size_t n = HICOLOR_CLI_IO_BUFFER_SIZE - writer->buffered;
+        if (n > length) n = length;
+
+        memcpy(writer->buffer + writer->buffered, data, n);
+        writer->buffered += n;
+        data += n;
+        length -= n;
+    }
+
+    return true;
+}
+
+void png_write_output(
+    png_structp png,
+    png_bytep data,
+    size_t length
+)
+{
+    if (!image_writer_write(png_get_io_ptr(png), data, length)) {
+        /* The same message as libpng's own write function. */
+        png_error(png, "Write Error");
+    }
+}
+
+void png_flush_output(
+    png_structp png
+)
+{
+    image_writer* writer = png_get_io_ptr(png);
+
+    if (!image_writer_flush_buffer(writer) || fflush(writer->fp) != 0) {
+        png_error(png, "Write Error");
+    }
+}
+
+uint8_t* alloc_io_buffer()
+{
+#ifdef _WIN32
+    return malloc(HICOLOR_CLI_IO_BUFFER_SIZE);
+#else
+    void* buffer;
+    if (posix_memalign(
+        &buffer,
+        HICOLOR_CLI_IO_ALIGNMENT,
+        HICOLOR_CLI_IO_BUFFER_SIZE
+    ) != 0) {
+        return NULL;
+    }
+
+    return buffer;
+#endif
+}
+
+bool image_writer_open_png(
+    image_writer* writer
+)
+{
+    png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, libpng_error_handler, NULL);
+    if (png == NULL) {
+        image_error_msg = "`png_create_write_struct` returned null";
+        return false;
+    }
+    writer->png = png;
+
+    png_infop info = png_create_info_struct(png);
+    if (info == NULL) {
+        image_error_msg = "`png_create_info_struct` returned null";
+        return false;
+    }
+    writer->info = info;
+
+    if (setjmp(png_jmpbuf(png))) {
+        /* Do not overwrite `image_error_msg` set by the handler. */
+        return false;
+    }
+
+    png_set_write_fn(png, writer, png_write_output, png_flush_output);
+
+    png_set_IHDR(
+        png,
+        info,
+        writer->width,
+        writer->height,
+        8,
+        PNG_COLOR_TYPE_RGBA,
+        PNG_INTERLACE_NONE,
+        PNG_COMPRESSION_TYPE_DEFAULT,
+        PNG_FILTER_TYPE_DEFAULT
+    );
+    png_set_compression_level(png, HICOLOR_CLI_LIBPNG_COMPRESSION_LEVEL);
+    png_write_info(png, info);
+
+    return true;
+}
+
+bool image_writer_open(
+    image_writer* writer,
+    const char* filename,
+    const image_options* image,
+    int width,
+    int height
+)
+{
+    writer->row = NULL;
+    writer->png = NULL;
+    writer->info = NULL;
+    writer->format = image_format_for(image, filename);
+    writer->width = width;
+    writer->height = height;
+    writer->buffered = 0;
+
+    writer->buffer = alloc_io_buffer();
+    if (writer->buffer == NULL) {
+        image_error_msg = "failed to allocate memory for the output buffer";
+        return false;
+    }
+
+    writer->fp = fopen(filename, "wb");
+    if (!writer->fp) {
+        image_error_msg = "failed to open for writing";
+        free(writer->buffer);
+        return false;
+    }
+
+    /* The writer buffers the output itself. */
+    setvbuf(writer->fp, NULL, _IONBF, 0);
+
+    char header[128];
+    int header_size = 0;
+    bool ok = true;
+
+    switch (writer->format) {
+    case IMAGE_PPM:
+        header_size = sprintf(header, "P6\n%i %i\n255\n", width, height);
+        break;
+    case IMAGE_PAM:
+        header_size = sprintf(
+            header,
+            "P7\nWIDTH %i\nHEIGHT %i\nDEPTH 4\nMAXVAL 255\n"
+            "TUPLTYPE RGB_ALPHA\nENDHDR\n",
+            width,
+            height
+        );
+        break;
+    case IMAGE_RGB:
+    case IMAGE_RGBA:
+        break;
+    default:
+        ok = image_writer_open_png(writer);
+    }
+
+    if (ok && header_size > 0) {
+        ok = image_writer_write(writer, (uint8_t*) header, header_size);
+        if (!ok) {
+            image_error_msg = "Write Error";
+        }
+    }
+
+    if (ok) {
+        writer->row = malloc((size_t) width * 4);
+        if (writer->row == NULL) {
+            image_error_msg = "failed to allocate memory for `row`";
+            ok = false;
+        }
+    }
+
+    if (!ok) {
+        image_writer_abort(writer);
+        return false;
+    }
+
+    return true;
+}
+
+/* Write the next `rows` rows. `alpha` can be null for opaque images.
+ * PPM and raw RGB leave out alpha.
+ */
+bool image_writer_write_rows(
+    image_writer* writer,
+    int rows,
+    const hicolor_rgb* rgb_img,
+    const uint8_t* alpha
+)
+{
+    if (writer->png != NULL && setjmp(png_jmpbuf(writer->png))) {
+        /* Do not overwrite `image_error_msg` set by the handler. */
+        return false;
+    }
+
+    int channels =
+        writer->format == IMAGE_PPM || writer->format == IMAGE_RGB ? 3 : 4;
+
+    for (int y = 0; y < rows; y++) {
+        for (int x = 0; x < writer->width; x++) {
+            png_bytep pixel = &(writer->row[x * channels]);
+            size_t i = (size_t) y * writer->width + x;
+            pixel[0] = rgb_img[i].r;
+            pixel[1] = rgb_img[i].g;
+            pixel[2] = rgb_img[i].b;
+            if (channels == 4) {
+                pixel[3] = alpha == NULL ? 255 : alpha[i];
+            }
+        }
+
+        if (writer->png != NULL) {
+            png_write_row(writer->png, writer->row);
+        } else if (!image_writer_write(
+            writer,
+            writer->row,
+            (size_t) writer->width * channels
+        )) {
+            image_error_msg = "Write Error";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+bool image_writer_close(
+    image_writer* writer
+)
+{
+    if (writer->png != NULL) {
+        if (setjmp(png_jmpbuf(writer->png))) {
+            /* Do not overwrite `image_error_msg` set by the handler. */
+            image_writer_abort(writer);
+            return false;
+        }
+
+        png_write_end(writer->png, NULL);
+    }
+
+    bool success = image_writer_flush_buffer(writer);
+    if (!success) {
+        image_error_msg = "Write Error";
+    }
+
+    free(writer->row);
+    free(writer->buffer);
+    if (writer->png != NULL) {
+        png_destroy_write_struct(&writer->png, &writer->info);
+    }
+    if (fclose(writer->fp) != 0 && success) {
+        image_error_msg = "Write Error";
+        success = false;
+    }
+
+    return success;
+}
+
+bool save_image(
+    const char* filename,
+    const image_options* image,
+    int width,
+    int height,
+    const hicolor_rgb* rgb_img,
+    const uint8_t* alpha
+)
+{
+    image_writer writer;
+    if (!image_writer_open(&writer, filename, image, width, height)) {
+        return false;
+    }
+
+    double start = trace_begin();
+    if (!image_writer_write_rows(&writer, height, rgb_img, alpha)) {
+        image_writer_abort(&writer);
+        return false;
+    }
+
+    bool success = image_writer_close(&writer);
+    trace_span("encode", filename, start);
+
+    return success;
+}
+
+bool check_and_report_error(
+    char* step,
+    hicolor_result res
+)
+{
+    if (res == HICOLOR_OK) {
+        return false;
+    }
+
+    fprintf(
+        stderr,
+        HICOLOR_CLI_ERROR "%s: %s\n",
+        step,
+        hicolor_error_message(res)
+    );
+
+    return true;
+}
+
+bool check_src_exists(
+    const char* src
+)
+{
+    if (access(src, F_OK) != 0) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "source image \"%s\" doesn't exist\n",
+            src
+        );
+        return false;
+    }
+
+    return true;
+}
+
+/* The pipeline overlaps image decoding, quantization, and output.
+ * A reader thread decodes bands of rows into a ring of slots,
+ * worker threads quantize the decoded bands,
+ * and the calling thread writes the quantized bands in order and frees
+ * their slots for the reader.
+ *
+ * Error diffusion can't quantize bands independently. Instead the workers
+ * take rows in order and follow each other in a wavefront: a span of a row is
+ * diffused once the row above has finished the pixels the span depends on.
+ * Each of the rows in flight uses one of `jobs + 1` error buffers.
+ */
+typedef enum band_state {
+    BAND_FREE,
+    BAND_DECODED,
+    BAND_QUANTIZING,
+    BAND_QUANTIZED
+} band_state;
+
+typedef struct band {
+    band_state state;
+    int index;
+    hicolor_rgb* rgb_img;
+    uint8_t* alpha;
+} band;
+
+typedef struct pipeline {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    hicolor_metadata meta;
+    hicolor_dither dither;
+    uint8_t alpha_threshold;
+    const image_options* image;
+    const char* src;
+    const char* dest;
+    image_reader reader;
+    FILE* hi_file;
+    image_writer png_out;
+    band* bands;
+    int band_rows;
+    int slots;
+    int band_count;
+    int next_quantize;
+    int16_t** errors;
+    int* progress;
+    int error_rows;
+    int next_row;
+    bool failed;
+} pipeline;
+
+int pipeline_band_rows(
+    const pipeline* p,
+    int index
+)
+{
+    int rows = p->meta.height - index * p->band_rows;
+    return rows < p->band_rows ? rows : p->band_rows;
+}
+
+void pipeline_fail(
+    pipeline* p
+)
+{
+    pthread_mutex_lock(&p->lock);
+    p->failed = true;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+void pipeline_set_state(
+    pipeline* p,
+    band* b,
+    band_state state
+)
+{
+    pthread_mutex_lock(&p->lock);
+    b->state = state;
+    pthread_cond_broadcast(&p->changed);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/* Wait until the slot for band `index` is in `state`.
+ * Return false if the pipeline has failed.
+ */
+bool pipeline_wait(
+    pipeline* p,
+    int index,
+    band_state state
+)
+{
+    band* b = &p->bands[index % p->slots];
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->failed
+           && !(b->state == state
+                && (state == BAND_FREE || b->index == index))) {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    bool ok = !p->failed;
+    pthread_mutex_unlock(&p->lock);
+
+    return ok;
+}
+
+void* pipeline_read(
+    void* arg
+)
+{
+    pipeline* p = arg;
+    trace_thread_name("reader");
+
+    for (int i = 0; i < p->band_count; i++) {
+        if (!pipeline_wait(p, i, BAND_FREE)) {
+            break;
+        }
+
+        band* b = &p->bands[i % p->slots];
+        int rows = pipeline_band_rows(p, i);
+        double start = trace_begin();
+        if (!image_reader_read_rows(&p->reader, rows, b->rgb_img, b->alpha)) {
+            report_load_error(p->image, p->src);
+            pipeline_fail(p);
+            break;
+        }
+        trace_span("decode", p->src, start);
+
+        b->index = i;
+        pipeline_set_state(p, b, BAND_DECODED);
+    }
+
+    return NULL;
+}
+
+void* pipeline_quantize(
+    void* arg
+)
+{
+    pipeline* p = arg;
+    trace_thread_name("worker");
+
+    while (true) {
+        pthread_mutex_lock(&p->lock);
+        band* b = NULL;
+        while (!p->failed && p->next_quantize < p->band_count) {
+            b = &p->bands[p->next_quantize % p->slots];
+            if (b->state == BAND_DECODED && b->index == p->next_quantize) {
+                break;
+            }
+
+            b = NULL;
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if (b == NULL || p->failed) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int i = p->next_quantize++;
+        b->state = BAND_QUANTIZING;
+        pthread_mutex_unlock(&p->lock);
+
+        double start = trace_begin();
+        hicolor_result res = p->meta.version == HICOLOR_VERSION_A
+            ? hicolor_quantize_rgba_rows(
+                p->meta,
+                p->dither,
+                i * p->band_rows,
+                pipeline_band_rows(p, i),
+                b->rgb_img,
+                b->alpha,
+                p->alpha_threshold
+            )
+            : hicolor_quantize_rgb_rows(
+                p->meta,
+                p->dither,
+                i * p->band_rows,
+                pipeline_band_rows(p, i),
+                b->rgb_img
+            );
+        if (check_and_report_error("can't quantize image", res)) {
+            pipeline_fail(p);
+            break;
+        }
+        trace_span("quantize", p->src, start);
+
+        pipeline_set_state(p, b, BAND_QUANTIZED);
+    }
+
+    return NULL;
+}
+
+/* Wait until row `y` has been diffused up to pixel `x`.
+ * Return false if the pipeline has failed.
+ */
+bool pipeline_wait_progress(
+    pipeline* p,
+    int y,
+    int x
+)
+{
+    int* progress = &p->progress[y % p->error_rows];
+
+    pthread_mutex_lock(&p->lock);
+    while (!p->failed && *progress < x) {
+        pthread_cond_wait(&p->changed, &p->lock);
+    }
+    bool ok = !p->failed;
+    pthread_mutex_unlock(&p->lock);
+
+    return ok;
+}
+
+void* pipeline_diffuse(
+    void* arg
+)
+{
+    pipeline* p = arg;
+    size_t error_size = ((size_t) p->meta.width + 2) * 3 * sizeof(int16_t);
+    trace_thread_name("worker");
+
+    while (true) {
+        pthread_mutex_lock(&p->lock);
+        band* b = NULL;
+        while (!p->failed && p->next_row < p->meta.height) {
+            int index = p->next_row / p->band_rows;
+            b = &p->bands[index % p->slots];
+            if ((b->state == BAND_DECODED || b->state == BAND_QUANTIZING)
+                && b->index == index) {
+                break;
+            }
+
+            b = NULL;
+            pthread_cond_wait(&p->changed, &p->lock);
+        }
+        if (b == NULL || p->failed) {
+            pthread_mutex_unlock(&p->lock);
+            break;
+        }
+        int y = p->next_row++;
+        b->state = BAND_QUANTIZING;
+        p->progress[y % p->error_rows] = 0;
+        pthread_mutex_unlock(&p->lock);
+
+        /* Rows finish in order and at most `jobs` are in flight,
+         * so row `y - jobs`, the last user of this buffer, is done.
+         */
+        int16_t* errors = p->errors[y % p->error_rows];
+        int16_t* next_errors = p->errors[(y + 1) % p->error_rows];
+        memset(next_errors, 0, error_size);
+        double start = trace_begin();
+
+        size_t row_start = (size_t) (y % p->band_rows) * p->meta.width;
+        hicolor_rgb* row = &b->rgb_img[row_start];
+        uint8_t* alpha_row = &b->alpha[row_start];
+
+        for (int x = 0; x < p->meta.width; x += HICOLOR_CLI_DIFFUSION_SPAN) {
+            int x_end = x + HICOLOR_CLI_DIFFUSION_SPAN;
+            if (x_end > p->meta.width) x_end = p->meta.width;
+
+            int needed = x_end + 2;
+            if (needed > p->meta.width) needed = p->meta.width;
+            if (y > 0 && !pipeline_wait_progress(p, y - 1, needed)) {
+                return NULL;
+            }
+
+            hicolor_result res = p->meta.version == HICOLOR_VERSION_A
+                ? hicolor_diffuse_rgba_span(
+                    p->meta,
+                    x,
+                    x_end,
+                    errors,
+                    next_errors,
+                    row,
+                    alpha_row,
+                    p->alpha_threshold
+                )
+                : hicolor_diffuse_rgb_span(
+                    p->meta,
+                    x,
+                    x_end,
+                    errors,
+                    next_errors,
+                    row
+                );
+            if (check_and_report_error("can't quantize image", res)) {
+                pipeline_fail(p);
+                return NULL;
+            }
+
+            pthread_mutex_lock(&p->lock);
+            p->progress[y % p->error_rows] = x_end;
+            if (x_end == p->meta.width
+                && (y % p->band_rows == p->band_rows - 1
+                    || y == p->meta.height - 1)) {
+                b->state = BAND_QUANTIZED;
+            }
+            pthread_cond_broadcast(&p->changed);
+            pthread_mutex_unlock(&p->lock);
+        }
+
+        trace_span("quantize", p->src, start);
+    }
+
+    return NULL;
+}
+
+bool pipeline_write(
+    pipeline* p
+)
+{
+    for (int i = 0; i < p->band_count; i++) {
+        if (!pipeline_wait(p, i, BAND_QUANTIZED)) {
+            return false;
+        }
+
+        band* b = &p->bands[i % p->slots];
+        int rows = pipeline_band_rows(p, i);
+        double start = trace_begin();
+
+        if (p->hi_file != NULL) {
+            hicolor_metadata band_meta = p->meta;
+            band_meta.height = rows;
+
+            hicolor_result res = hicolor_write_rgba_image(
+                p->hi_file,
+                band_meta,
+                b->rgb_img,
+                b->alpha,
+                p->alpha_threshold
+            );
+            if (check_and_report_error("can't write image data", res)) {
+                pipeline_fail(p);
+                return false;
+            }
+        } else if (!image_writer_write_rows(
+            &p->png_out,
+            rows,
+            b->rgb_img,
+            b->alpha
+        )) {
+            report_save_error(p->image, p->dest);
+            pipeline_fail(p);
+            return false;
+        }
+
+        trace_span(p->hi_file != NULL ? "write" : "encode", p->dest, start);
+        pipeline_set_state(p, b, BAND_FREE);
+    }
+
+    return true;
+}
+
+/* Run the pipeline from an open reader to an open writer with the bands
+ * and threads of `plan`.
+ */
+bool pipeline_run(
+    pipeline* p,
+    const hicolor_plan* plan
+)
+{
+    bool success = false;
+    int jobs = plan->jobs;
+
+    p->band_rows = plan->band_rows;
+    p->slots = plan->slots;
+    p->band_count = (p->meta.height + p->band_rows - 1) / p->band_rows;
+    p->next_quantize = 0;
+    p->next_row = 0;
+    p->error_rows = 0;
+    p->errors = NULL;
+    p->progress = NULL;
+    p->failed = false;
+
+    p->bands = calloc(p->slots, sizeof(band));
+    if (p->bands == NULL) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        return false;
+    }
+
+    size_t band_pixels = (size_t) p->band_rows * p->meta.width;
+    for (int i = 0; i < p->slots; i++) {
+        p->bands[i].state = BAND_FREE;
+        p->bands[i].rgb_img = malloc(sizeof(hicolor_rgb) * band_pixels);
+        p->bands[i].alpha = malloc(sizeof(uint8_t) * band_pixels);
+
+        if (p->bands[i].rgb_img == NULL || p->bands[i].alpha == NULL) {
+            fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+            goto clean_up_bands;
+        }
+    }
+
+    if (p->dither == HICOLOR_FLOYD_STEINBERG) {
+        p->error_rows = jobs + 1;
+        p->errors = calloc(p->error_rows, sizeof(int16_t*));
+        p->progress = calloc(p->error_rows, sizeof(int));
+        if (p->errors == NULL || p->progress == NULL) {
+            fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+            goto clean_up_bands;
+        }
+
+        for (int i = 0; i < p->error_rows; i++) {
+            p->errors[i] =
+                calloc((size_t) p->meta.width + 2, 3 * sizeof(int16_t));
+            if (p->errors[i] == NULL) {
+                fprintf(
+                    stderr,
+                    HICOLOR_CLI_ERROR "failed to allocate memory\n"
+                );
+                goto clean_up_bands;
+            }
+        }
+    }
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->changed, NULL);
+
+    pthread_t reader_thread;
+    pthread_t worker_threads[HICOLOR_CLI_MAX_JOBS];
+    int started = 0;
+
+    bool reader_started =
+        pthread_create(&reader_thread, NULL, pipeline_read, p) == 0;
+    if (reader_started) {
+        for (; started < jobs; started++) {
+            if (pthread_create(
+                &worker_threads[started],
+                NULL,
+                p->dither == HICOLOR_FLOYD_STEINBERG
+                    ? pipeline_diffuse
+                    : pipeline_quantize,
+                p
+            ) != 0) {
+                break;
+            }
+        }
+    }
+
+    if (!reader_started || started == 0) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to start threads\n");
+        pipeline_fail(p);
+    } else {
+        success = pipeline_write(p);
+    }
+
+    if (reader_started) {
+        pthread_join(reader_thread, NULL);
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(worker_threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&p->changed);
+    pthread_mutex_destroy(&p->lock);
+
+clean_up_bands:
+    for (int i = 0; i < p->slots; i++) {
+        free(p->bands[i].rgb_img);
+        free(p->bands[i].alpha);
+    }
+    free(p->bands);
+
+    if (p->errors != NULL) {
+        for (int i = 0; i < p->error_rows; i++) {
+            free(p->errors[i]);
+        }
+    }
+    free(p->errors);
+    free(p->progress);
+
+    return success;
+}
+
+/* Convert an image file to HiColor (`to_png` false) or to a quantized image
+ * (`to_png` true) in a pipeline laid out by `plan`.
+ */
+bool convert_pipelined(
+    bool to_png,
+    const image_options* image,
+    hicolor_version version,
+    hicolor_dither dither,
+    uint8_t alpha_threshold,
+    const hicolor_plan* plan,
+    const char* src,
+    const char* dest
+)
+{
+    pipeline p;
+    p.image = image;
+    p.dither = dither;
+    p.alpha_threshold = alpha_threshold;
+    p.src = src;
+    p.dest = dest;
+    p.hi_file = NULL;
+
+    if (!image_reader_open(
+        &p.reader,
+        src,
+        image,
+        false,
+        version,
+        dither,
+        alpha_threshold
+    )) {
+        report_load_error(image, src);
+        return false;
+    }
+
+    p.meta.version = version;
+    p.meta.width = p.reader.width;
+    p.meta.height = p.reader.height;
+
+    bool success = false;
+
+    if (to_png) {
+        if (!image_writer_open(
+            &p.png_out,
+            dest,
+            image,
+            p.reader.width,
+            p.reader.height
+        )) {
+            report_save_error(image, dest);
+            goto clean_up_reader;
+        }
+    } else {
+        p.hi_file = fopen(dest, "wb");
+        if (p.hi_file == NULL) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "can't open file \"%s\" for writing\n",
+                dest
+            );
+            goto clean_up_reader;
+        }
+
+        hicolor_result res = hicolor_write_header(p.hi_file, p.meta);
+        if (check_and_report_error("can't write header", res)) {
+            fclose(p.hi_file);
+            goto clean_up_reader;
+        }
+    }
+
+    success = pipeline_run(&p, plan);
+
+    if (to_png) {
+        if (success) {
+            success = image_writer_close(&p.png_out);
+            if (!success) {
+                report_save_error(image, dest);
+            }
+        } else {
+            image_writer_abort(&p.png_out);
+        }
+    } else {
+        if (fclose(p.hi_file) != 0 && success) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "can't write image data: %s\n",
+                hicolor_error_message(HICOLOR_IO_ERROR)
+            );
+            success = false;
+        }
+    }
+
+    if (!success) {
+        remove(dest);
+    }
+
+clean_up_reader:
+    image_reader_close(&p.reader);
+
+    return success;
+}
+
+/* Resize an image file as its rows are decoded and quantize each output row
+ * as soon as the resizer produces it. Only the rows the filter spans
+ * are kept in memory.
+ */
+bool convert_resized(
+    bool to_png,
+    const convert_options* opts,
+    const char* src,
+    const char* dest
+)
+{
+    hicolor_result res;
+    image_reader reader;
+    image_writer png_out;
+    FILE* hi_file = NULL;
+    hicolor_resizer resizer;
+    hicolor_diffuser diffuser = {.errors = NULL, .next_errors = NULL};
+    hicolor_metadata meta = {
+        .version = opts->version,
+        .width = opts->resize_width,
+        .height = opts->resize_height
+    };
+    hicolor_metadata row_meta = meta;
+    row_meta.height = 1;
+    bool success = false;
+
+    if (!image_reader_open(
+        &reader,
+        src,
+        &opts->image,
+        false,
+        opts->version,
+        opts->dither,
+        opts->alpha_threshold
+    )) {
+        report_load_error(&opts->image, src);
+        return false;
+    }
+
+    res = hicolor_resizer_init(
+        &resizer,
+        reader.width,
+        reader.height,
+        meta.width,
+        meta.height,
+        4
+    );
+    if (check_and_report_error("can't resize image", res)) {
+        goto clean_up_reader;
+    }
+
+    if (opts->dither == HICOLOR_FLOYD_STEINBERG) {
+        res = hicolor_diffuser_init(&diffuser, meta);
+        if (check_and_report_error("can't quantize image", res)) {
+            goto clean_up_resizer;
+        }
+    }
+
+    uint8_t* row = malloc((size_t) meta.width * 4);
+    hicolor_rgb* rgb_row = malloc(sizeof(hicolor_rgb) * meta.width);
+    uint8_t* alpha_row = malloc(meta.width);
+    if (row == NULL || rgb_row == NULL || alpha_row == NULL) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        goto clean_up_rows;
+    }
+
+    if (to_png) {
+        if (!image_writer_open(
+            &png_out,
+            dest,
+            &opts->image,
+            meta.width,
+            meta.height
+        )) {
+            report_save_error(&opts->image, dest);
+            goto clean_up_rows;
+        }
+    } else {
+        hi_file = fopen(dest, "wb");
+        if (hi_file == NULL) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "can't open file \"%s\" for writing\n",
+                dest
+            );
+            goto clean_up_rows;
+        }
+
+        res = hicolor_write_header(hi_file, meta);
+        if (check_and_report_error("can't write header", res)) {
+            goto clean_up_output;
+        }
+    }
+
+    double start = trace_begin();
+
+    for (int y = 0; y < reader.height; y++) {
+        if (!image_reader_read_row(&reader)) {
+            report_load_error(&opts->image, src);
+            goto clean_up_output;
+        }
+
+        res = hicolor_resizer_push_row(&resizer, reader.row);
+        if (check_and_report_error("can't resize image", res)) {
+            goto clean_up_output;
+        }
+
+        while (hicolor_resizer_pull_row(&resizer, row)) {
+            if (meta.version == HICOLOR_VERSION_A) {
+                res = opts->dither == HICOLOR_FLOYD_STEINBERG
+                    ? hicolor_diffuse_rgba_row(
+                        &diffuser,
+                        row,
+                        opts->alpha_threshold
+                    )
+                    : hicolor_quantize_rgba_row(
+                        meta,
+                        opts->dither,
+                        resizer.rows_out - 1,
+                        row,
+                        opts->alpha_threshold
+                    );
+            } else if (opts->dither == HICOLOR_FLOYD_STEINBERG) {
+                res = hicolor_diffuse_row(&diffuser, 4, row);
+            } else {
+                res = hicolor_quantize_row(
+                    meta,
+                    opts->dither,
+                    resizer.rows_out - 1,
+                    4,
+                    row
+                );
+            }
+            if (check_and_report_error("can't quantize image", res)) {
+                goto clean_up_output;
+            }
+
+            for (uint16_t x = 0; x < meta.width; x++) {
+                rgb_row[x].r = row[x * 4];
+                rgb_row[x].g = row[x * 4 + 1];
+                rgb_row[x].b = row[x * 4 + 2];
+                alpha_row[x] = row[x * 4 + 3];
+            }
+
+            if (to_png) {
+                if (!image_writer_write_rows(&png_out, 1, rgb_row, alpha_row)) {
+                    report_save_error(&opts->image, dest);
+                    goto clean_up_output;
+                }
+            } else {
+                res = hicolor_write_rgba_image(
+                    hi_file,
+                    row_meta,
+                    rgb_row,
+                    alpha_row,
+                    opts->alpha_threshold
+                );
+                if (check_and_report_error("can't write image data", res)) {
+                    goto clean_up_output;
+                }
+            }
+        }
+    }
+
+    trace_span("resize", src, start);
+    success = true;
+
+clean_up_output:
+    if (to_png) {
+        if (success) {
+            success = image_writer_close(&png_out);
+            if (!success) {
+                report_save_error(&opts->image, dest);
+            }
+        } else {
+            image_writer_abort(&png_out);
+        }
+    } else if (fclose(hi_file) != 0 && success) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't write image data: %s\n",
+            hicolor_error_message(HICOLOR_IO_ERROR)
+        );
+        success = false;
+    }
+
+    if (!success) {
+        remove(dest);
+    }
+
+clean_up_rows:
+    free(row);
+    free(rgb_row);
+    free(alpha_row);
+    hicolor_diffuser_free(&diffuser);
+
+clean_up_resizer:
+    hicolor_resizer_free(&resizer);
+
+clean_up_reader:
+    image_reader_close(&reader);
+
+    return success;
+}
+
+/* Load an image file and quantize it. Quantize while decoding unless
+ * `skip_exact` is set or `original` isn't NULL. With `skip_exact`,
+ * the image is only dithered if it has colors that are not high-color.
+ * `original` receives a copy of the image before quantization.
+ * The buffers are in `scratch` and are reused by the next call.
+ */
+bool load_quantized_image(
+    const convert_options* opts,
+    const char* src,
+    int* width,
+    int* height,
+    hicolor_rgb** rgb_img,
+    uint8_t** alpha,
+    hicolor_rgb** original
+)
+{
+    bool quantize_later = opts->skip_exact || original != NULL;
+
+    if (!load_image(
+        src,
+        &opts->image,
+        &scratch,
+        !quantize_later,
+        opts->version,
+        opts->dither,
+        opts->alpha_threshold,
+        width,
+        height,
+        rgb_img,
+        alpha
+    )) {
+        report_load_error(&opts->image, src);
+        return false;
+    }
+
+    if (!quantize_later) {
+        return true;
+    }
+
+    hicolor_metadata meta = {
+        .version = opts->version,
+        .width = *width,
+        .height = *height
+    };
+    size_t size = sizeof(hicolor_rgb) * meta.width * meta.height;
+
+    if (original != NULL) {
+        *original =
+            hicolor_context_buffer(&scratch, HICOLOR_CLI_ARENA_ORIGINAL, size);
+        if (*original == NULL) {
+            fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+            return false;
+        }
+        memcpy(*original, *rgb_img, size);
+    }
+
+    /* Quantizing exact colors without dithering leaves them as they are
+     * but still applies the alpha threshold of version A.
+     */
+    hicolor_dither dither = opts->dither;
+    if (opts->skip_exact && hicolor_is_exact_rgb_image(meta, *rgb_img)) {
+        if (meta.version != HICOLOR_VERSION_A) {
+            return true;
+        }
+        dither = HICOLOR_NO_DITHER;
+    }
+
+    double start = trace_begin();
+    hicolor_result res = meta.version == HICOLOR_VERSION_A
+        ? hicolor_quantize_rgba_image(
+            meta,
+            dither,
+            *rgb_img,
+            *alpha,
+            opts->alpha_threshold
+        )
+        : hicolor_quantize_rgb_image(meta, dither, *rgb_img);
+    if (check_and_report_error("can't quantize image", res)) {
+        return false;
+    }
+    trace_span("quantize", src, start);
+
+    return true;
+}
+
+/* Return the memory of the CLI outside the buffers the library plans for
+ * images `width` pixels wide: the fixed overhead and the rows of the
+ * reader, one of RGBA and one of up to 16-bit file samples.
+ */
+size_t cli_memory_overhead(
+    uint16_t width
+)
+{
+    return HICOLOR_CLI_MEMORY_OVERHEAD + (size_t) width * (4 + 8);
+}
+
+/* Return the memory left for image data under `max_memory`. */
+size_t memory_budget(
+    size_t max_memory,
+    uint16_t width
+)
+{
+    size_t overhead = cli_memory_overhead(width);
+
+    return max_memory > overhead ? max_memory - overhead : 1;
+}
+
+bool check_and_report_plan_error(
+    const char* src,
+    hicolor_metadata meta,
+    const hicolor_plan* plan,
+    hicolor_result res
+)
+{
+    if (res == HICOLOR_OK || res == HICOLOR_OUT_OF_MEMORY) {
+        trace_plan(src, plan);
+    }
+
+    if (res == HICOLOR_OUT_OF_MEMORY) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't convert \"%s\" within the memory limit: "
+            "needs about %zu MiB\n",
+            src,
+            (plan->memory + cli_memory_overhead(meta.width) + (1 << 20) - 1)
+                >> 20
+        );
+        return true;
+    }
+
+    return check_and_report_error("can't plan conversion", res);
+}
+
+/* Choose between the whole image and the pipeline for `src`.
+ * Without a memory limit, `--jobs` decides. With one, read the size of
+ * the image and let the library fit the choice, the bands, and the
+ * number of threads within the limit. The pyramid and indexed images
+ * only apply when encoding.
+ */
+bool plan_conversion(
+    const convert_options* opts,
+    bool encode,
+    const char* src,
+    hicolor_plan* plan
+)
+{
+    bool pyramid = encode && opts->pyramid;
+    bool indexed = encode && opts->indexed;
+    bool whole_image = opts->skip_exact || indexed || pyramid;
+
+    if (opts->max_memory == 0) {
+        plan->whole_image = opts->jobs == 0 || whole_image;
+        plan->band_rows = HICOLOR_PLAN_BAND_ROWS;
+        plan->jobs = opts->jobs;
+        plan->slots = opts->jobs * 2 + 2;
+        plan->memory = 0;
+
+        return true;
+    }
+
+    image_reader reader;
+    if (!image_reader_open(
+        &reader,
+        src,
+        &opts->image,
+        false,
+        opts->version,
+        opts->dither,
+        opts->alpha_threshold
+    )) {
+        report_load_error(&opts->image, src);
+        return false;
+    }
+    hicolor_metadata meta = reader.meta;
+    image_reader_close(&reader);
+
+    hicolor_result res = hicolor_plan_conversion(
+        meta,
+        opts->dither,
+        opts->skip_exact || indexed,
+        pyramid,
+        opts->jobs,
+        /* The alpha plane. */
+        meta.width,
+        memory_budget(opts->max_memory, meta.width),
+        plan
+    );
+
+    return !check_and_report_plan_error(src, meta, plan, res);
+}
+
+bool encode_image(
+    const convert_options* opts,
+    const char* src,
+    const char* dest
+)
+{
+    hicolor_result res;
+
+    bool exists = check_src_exists(src);
+    if (!exists) {
+        return false;
+    }
+
+    if (opts->resize_width > 0) {
+        return convert_resized(false, opts, src, dest);
+    }
+
+    hicolor_plan plan;
+    if (!plan_conversion(opts, true, src, &plan)) {
+        return false;
+    }
+
+    if (!plan.whole_image) {
+        return convert_pipelined(
+            false,
+            &opts->image,
+            opts->version,
+            opts->dither,
+            opts->alpha_threshold,
+            &plan,
+            src,
+            dest
+        );
+    }
+
+    int width, height;
+    hicolor_rgb* rgb_img = NULL;
+    uint8_t* alpha = NULL;
+    hicolor_rgb* original = NULL;
+    if (!load_quantized_image(
+        opts,
+        src,
+        &width,
+        &height,
+        &rgb_img,
+        &alpha,
+        opts->pyramid ? &original : NULL
+    )) {
+        return false;
+    }
+
+    FILE* hi_file = fopen(dest, "wb");
+    if (hi_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open file \"%s\" for writing\n",
+            dest
+        );
+        return false;
+    }
+
+    hicolor_metadata meta = {
+        .version = opts->version,
+        .width = width,
+        .height = height
+    };
+
+    /* Store the image with a palette if it has few enough colors. */
+    hicolor_palette palette;
+    bool indexed = opts->indexed
+        && hicolor_build_palette(meta, rgb_img, &palette);
+
+    res = indexed
+        ? hicolor_write_indexed_header(hi_file, meta, &palette)
+        : hicolor_write_header(hi_file, meta);
+
+    bool success = false;
+    if (check_and_report_error("can't write header", res)) {
+        goto clean_up_file;
+    }
+
+    double start = trace_begin();
+    res = indexed
+        ? hicolor_write_indexed_image(hi_file, meta, &palette, rgb_img)
+        : hicolor_write_rgba_image(
+            hi_file,
+            meta,
+            rgb_img,
+            alpha,
+            opts->alpha_threshold
+        );
+    if (check_and_report_error("can't write image data", res)) {
+        goto clean_up_file;
+    }
+    trace_span("write", dest, start);
+
+    if (opts->pyramid) {
+        start = trace_begin();
+        res = hicolor_write_pyramid(hi_file, meta, opts->dither, original);
+        if (check_and_report_error("can't write pyramid", res)) {
+            goto clean_up_file;
+        }
+        trace_span("pyramid", dest, start);
+    }
+
+    success = true;
+
+clean_up_file:
+    fclose(hi_file);
+
+    return success;
+}
+
+/* Append a checksum chunk to a finished HiColor file. */
+bool add_checksum(
+    const char* filename
+)
+{
+    FILE* hi_file = fopen(filename, "r+b");
+    if (hi_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open file \"%s\" for updating\n",
+            filename
+        );
+        return false;
+    }
+
+    hicolor_metadata meta;
+    hicolor_result res = hicolor_read_header(hi_file, &meta);
+    bool success = !check_and_report_error("can't read header", res);
+
+    if (success) {
+        double start = trace_begin();
+        res = hicolor_write_checksum(hi_file, meta);
+        success = !check_and_report_error("can't write checksum", res);
+        trace_span("checksum", filename, start);
+    }
+
+    if (fclose(hi_file) != 0 && success) {
+        check_and_report_error("can't write checksum", HICOLOR_IO_ERROR);
+        success = false;
+    }
+
+    return success;
+}
+
+bool image_to_hicolor(
+    const convert_options* opts,
+    const char* src,
+    const char* dest
+)
+{
+    if (!encode_image(opts, src, dest)) {
+        return false;
+    }
+
+    return !opts->checksum || add_checksum(dest);
+}
+
+bool quantize_image(
+    const convert_options* opts,
+    const char* src,
+    const char* dest
+)
+{
+    bool exists = check_src_exists(src);
+    if (!exists) {
+        return false;
+    }
+
+    if (opts->resize_width > 0) {
+        return convert_resized(true, opts, src, dest);
+    }
+
+    hicolor_plan plan;
+    if (!plan_conversion(opts, false, src, &plan)) {
+        return false;
+    }
+
+    if (!plan.whole_image) {
+        return convert_pipelined(
+            true,
+            &opts->image,
+            opts->version,
+            opts->dither,
+            opts->alpha_threshold,
+            &plan,
+            src,
+            dest
+        );
+    }
+
+    int width, height;
+    hicolor_rgb* rgb_img = NULL;
+    uint8_t* alpha = NULL;
+    if (!load_quantized_image(
+        opts,
+        src,
+        &width,
+        &height,
+        &rgb_img,
+        &alpha,
+        NULL
+    )) {
+        return false;
+    }
+
+    if (!save_image(dest, &opts->image, width, height, rgb_img, alpha)) {
+        report_save_error(&opts->image, dest);
+        return false;
+    }
+
+    return true;
+}
+
+#ifndef _WIN32
+/* A parallel decoder for the image data of a HiColor file. The rows are
+ * split into bands. Each thread takes the next band, reads it with `pread`
+ * at its offset in the file, and converts it straight into its rows of
+ * `rgb_img` and `alpha` if it isn't NULL. The result is that of the first
+ * band that failed.
+ */
+typedef struct decode_job {
+    pthread_mutex_t lock;
+    int fd;
+    hicolor_metadata meta;
+    hicolor_rgb* rgb_img;
+    uint8_t* alpha;
+    const char* src;
+    int band_rows;
+    int bands;
+    int next;
+    int failed_band;
+    hicolor_result res;
+} decode_job;
+
+hicolor_result decode_band(
+    decode_job* job,
+    uint8_t* buffer,
+    int band
+)
+{
+    int y = band * job->band_rows;
+    int rows = job->meta.height - y < job->band_rows
+        ? job->meta.height - y
+        : job->band_rows;
+    size_t size = (size_t) rows * job->meta.width * 2;
+    off_t offset = HICOLOR_HEADER_SIZE + (off_t) y * job->meta.width * 2;
+    size_t done = 0;
+
+    while (done < size) {
+        ssize_t n = pread(job->fd, buffer + done, size - done, offset + done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return HICOLOR_IO_ERROR;
+        }
+        if (n == 0) {
+            break;
+        }
+
+        done += n;
+    }
+
+    size_t start = (size_t) y * job->meta.width;
+    hicolor_result res = job->alpha == NULL
+        ? hicolor_bytes_to_rgb(
+            job->meta.version,
+            buffer,
+            done / 2,
+            &job->rgb_img[start]
+        )
+        : hicolor_bytes_to_rgba(
+            job->meta.version,
+            buffer,
+            done / 2,
+            &job->rgb_img[start],
+            &job->alpha[start]
+        );
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    return done == size ? HICOLOR_OK : HICOLOR_INSUFFICIENT_DATA;
+}
+
+void* decode_run(
+    void* arg
+)
+{
+    decode_job* job = arg;
+    trace_thread_name("decode");
+
+    uint8_t* buffer = malloc((size_t) job->band_rows * job->meta.width * 2);
+
+    while (true) {
+        pthread_mutex_lock(&job->lock);
+        int band = job->next < job->bands ? job->next++ : -1;
+        pthread_mutex_unlock(&job->lock);
+
+        if (band < 0) {
+            break;
+        }
+
+        double start = trace_begin();
+        hicolor_result res = buffer == NULL
+            ? HICOLOR_OUT_OF_MEMORY
+            : decode_band(job, buffer, band);
+        trace_span("decode", job->src, start);
+
+        if (res != HICOLOR_OK) {
+            /* The bands before this one have been handed out already. */
+            pthread_mutex_lock(&job->lock);
+            if (band < job->failed_band) {
+                job->failed_band = band;
+                job->res = res;
+            }
+            job->next = job->bands;
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    free(buffer);
+
+    return NULL;
+}
+
+/* Decode the image data of `hi_file` into `rgb_img` and `alpha`
+ * with `jobs` threads.
+ */
+hicolor_result decode_parallel(
+    FILE* hi_file,
+    hicolor_metadata meta,
+    int jobs,
+    hicolor_rgb* rgb_img,
+    uint8_t* alpha,
+    const char* src
+)
+{
+    /* A few bands per thread for balance, each within the I/O buffer size. */
+    int max_rows = HICOLOR_CLI_IO_BUFFER_SIZE / (meta.width * 2);
+    int rows = (meta.height + jobs * 4 - 1) / (jobs * 4);
+    if (rows > max_rows) {
+        rows = max_rows;
+    }
+    if (rows < 1) {
+        rows = 1;
+    }
+
+    decode_job job;
+    job.fd = fileno(hi_file);
+    job.meta = meta;
+    job.rgb_img = rgb_img;
+    job.alpha = alpha;
+    job.src = src;
+    job.band_rows = rows;
+    job.bands = (meta.height + rows - 1) / rows;
+    job.next = 0;
+    job.failed_band = job.bands;
+    job.res = HICOLOR_OK;
+
+    if (jobs > job.bands) {
+        jobs = job.bands;
+    }
+
+    pthread_mutex_init(&job.lock, NULL);
+
+    pthread_t threads[HICOLOR_CLI_MAX_JOBS];
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, decode_run, &job) != 0) {
+            break;
+        }
+    }
+
+    /* Without threads, decode every band here. */
+    if (started == 0) {
+        decode_run(&job);
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&job.lock);
+
+    return job.res;
+}
+#else
+/* Without `pread`, decode on one thread. */
+hicolor_result decode_parallel(
+    FILE* hi_file,
+    hicolor_metadata meta,
+    int jobs,
+    hicolor_rgb* rgb_img,
+    uint8_t* alpha,
+    const char* src
+)
+{
+    (void) jobs;
+    (void) src;
+
+    return alpha == NULL
+        ? hicolor_read_rgb_image(hi_file, meta, rgb_img)
+        : hicolor_read_rgba_image(hi_file, meta, rgb_img, alpha);
+}
+#endif
+
+/* Decode the image data of an open HiColor file `rows` rows at a time. */
+bool decode_bands(
+    const image_options* image,
+    FILE* hi_file,
+    hicolor_metadata meta,
+    int rows,
+    const char* src,
+    const char* dest
+)
+{
+    hicolor_rgb* band = hicolor_context_buffer(
+        &scratch,
+        HICOLOR_CLI_ARENA_RGB,
+        sizeof(hicolor_rgb) * meta.width * rows
+    );
+    uint8_t* alpha = NULL;
+    if (meta.version == HICOLOR_VERSION_A) {
+        alpha = hicolor_context_buffer(
+            &scratch,
+            HICOLOR_CLI_ARENA_ALPHA,
+            sizeof(uint8_t) * meta.width * rows
+        );
+    }
+    if (band == NULL
+        || (meta.version == HICOLOR_VERSION_A && alpha == NULL)) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        return false;
+    }
+
+    image_writer writer;
+    if (!image_writer_open(&writer, dest, image, meta.width, meta.height)) {
+        report_save_error(image, dest);
+        return false;
+    }
+
+    hicolor_metadata band_meta = meta;
+    for (int y = 0; y < meta.height; y += rows) {
+        band_meta.height = meta.height - y < rows ? meta.height - y : rows;
+
+        double start = trace_begin();
+        hicolor_result res = alpha == NULL
+            ? hicolor_read_rgb_image(hi_file, band_meta, band)
+            : hicolor_read_rgba_image(hi_file, band_meta, band, alpha);
+        if (check_and_report_error("can't read image data", res)) {
+            image_writer_abort(&writer);
+            return false;
+        }
+        trace_span("decode", src, start);
+
+        start = trace_begin();
+        if (!image_writer_write_rows(&writer, band_meta.height, band, alpha)) {
+            report_save_error(image, dest);
+            image_writer_abort(&writer);
+            return false;
+        }
+        trace_span("encode", dest, start);
+    }
+
+    if (!image_writer_close(&writer)) {
+        report_save_error(image, dest);
+        return false;
+    }
+
+    return true;
+}
+
+/* Decode a HiColor file. With `max_memory`, decode it in bands
+ * if the whole image doesn't fit. Decode the whole image with `jobs`
+ * threads if there are more than one. Indexed images are always decoded
+ * whole on one thread.
+ */
+bool hicolor_to_image(
+    const image_options* image,
+    size_t max_memory,
+    int jobs,
+    const char* src,
+    const char* dest
+)
+{
+    hicolor_result res;
+
+    bool exists = check_src_exists(src);
+    if (!exists) {
+        return false;
+    }
+
+    FILE* hi_file = fopen(src, "rb");
+    if (hi_file == NULL) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n", src);
+        return false;
+    }
+
+    hicolor_metadata meta;
+    hicolor_palette palette;
+    bool indexed = false;
+    res = hicolor_read_header(hi_file, &meta);
+
+    /* Indexed images have their own header. */
+    if (res == HICOLOR_UNKNOWN_VERSION) {
+        rewind(hi_file);
+        res = hicolor_read_indexed_header(hi_file, &meta, &palette);
+        indexed = res == HICOLOR_OK;
+    }
+
+    bool success = false;
+    if (check_and_report_error("can't read header", res)) {
+        goto clean_up_file;
+    }
+
+    if (max_memory > 0) {
+        hicolor_plan plan;
+        res = hicolor_plan_conversion(
+            meta,
+            HICOLOR_NO_DITHER,
+            indexed,
+            false,
+            0,
+            /* The alpha plane. */
+            meta.version == HICOLOR_VERSION_A ? meta.width : 0,
+            memory_budget(max_memory, meta.width),
+            &plan
+        );
+        if (check_and_report_plan_error(src, meta, &plan, res)) {
+            goto clean_up_file;
+        }
+
+        if (!plan.whole_image) {
+            success =
+                decode_bands(image, hi_file, meta, plan.band_rows, src, dest);
+            goto clean_up_file;
+        }
+    }
+
+    hicolor_rgb* rgb_img = hicolor_context_buffer(
+        &scratch,
+        HICOLOR_CLI_ARENA_RGB,
+        sizeof(hicolor_rgb) * meta.width * meta.height
+    );
+    /* Only version A has alpha. */
+    uint8_t* alpha = NULL;
+    if (meta.version == HICOLOR_VERSION_A && !indexed) {
+        alpha = hicolor_context_buffer(
+            &scratch,
+            HICOLOR_CLI_ARENA_ALPHA,
+            sizeof(uint8_t) * meta.width * meta.height
+        );
+    }
+    if (rgb_img == NULL
+        || (meta.version == HICOLOR_VERSION_A && !indexed && alpha == NULL)) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        goto clean_up_file;
+    }
+    double start = trace_begin();
+    if (indexed) {
+        res = hicolor_read_indexed_image(hi_file, meta, &palette, rgb_img);
+    } else if (jobs > 1) {
+        res = decode_parallel(hi_file, meta, jobs, rgb_img, alpha, src);
+    } else if (alpha != NULL) {
+        res = hicolor_read_rgba_image(hi_file, meta, rgb_img, alpha);
+    } else {
+        res = hicolor_read_rgb_image(hi_file, meta, rgb_img);
+    }
+    if (check_and_report_error("can't read image data", res)) {
+        goto clean_up_file;
+    }
+    trace_span("decode", src, start);
+
+    if (!save_image(dest, image, meta.width, meta.height, rgb_img, alpha)) {
+        report_save_error(image, dest);
+        goto clean_up_file;
+    }
+
+    success = true;
+
+clean_up_file:
+    fclose(hi_file);
+
+    return success;
+}
+
+/* Convert a HiColor file to another version. Without `dest`, convert
+ * into a temporary file next to `src` and rename it over `src`,
+ * so a failed conversion leaves the original intact.
+ */
+bool convert_hicolor(
+    const convert_options* opts,
+    const char* src,
+    const char* dest
+)
+{
+    bool exists = check_src_exists(src);
+    if (!exists) {
+        return false;
+    }
+
+    char* tmp_path = NULL;
+    const char* out_path = dest;
+    if (dest == NULL) {
+        tmp_path = malloc(strlen(src) + 5);
+        if (tmp_path == NULL) {
+            fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+            return false;
+        }
+        sprintf(tmp_path, "%s.tmp", src);
+        out_path = tmp_path;
+    }
+
+    bool success = false;
+
+    FILE* in = fopen(src, "rb");
+    if (in == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n",
+            src
+        );
+        goto clean_up_path;
+    }
+
+    /* Read back to recompute a checksum. */
+    FILE* out = fopen(out_path, "w+b");
+    if (out == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open file \"%s\" for writing\n",
+            out_path
+        );
+        fclose(in);
+        goto clean_up_path;
+    }
+
+    double start = trace_begin();
+    hicolor_result res =
+        hicolor_convert_stream(in, out, opts->version, opts->dither);
+    success = !check_and_report_error("can't convert image", res);
+    trace_span("convert", src, start);
+
+    if (fclose(out) != 0 && success) {
+        check_and_report_error("can't convert image", HICOLOR_IO_ERROR);
+        success = false;
+    }
+    fclose(in);
+
+    if (!success) {
+        remove(out_path);
+    } else if (tmp_path != NULL && rename(tmp_path, src) != 0) {
+        /* `rename` doesn't replace existing files on Windows.
+         * Keep the converted file if the source is gone.
+         */
+        remove(src);
+        if (rename(tmp_path, src) != 0) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "can't rename \"%s\" to \"%s\"\n",
+                tmp_path,
+                src
+            );
+            success = false;
+        }
+    }
+
+clean_up_path:
+    free(tmp_path);
+
+    return success;
+}
+
+bool hicolor_print_info(
+    const char* src
+)
+{
+    hicolor_result res;
+
+    bool exists = check_src_exists(src);
+    if (!exists) {
+        return false;
+    }
+
+    FILE* hi_file = fopen(src, "rb");
+    if (hi_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n",
+            src
+        );
+        return false;
+    }
+
+    hicolor_metadata meta;
+    res = hicolor_read_header(hi_file, &meta);
+    bool success = false;
+
+    /* Sequences and indexed images have their own headers. */
+    if (res == HICOLOR_UNKNOWN_VERSION) {
+        hicolor_sequence_info info;
+        hicolor_palette palette;
+
+        rewind(hi_file);
+        if (hicolor_read_indexed_header(hi_file, &meta, &palette)
+            == HICOLOR_OK) {
+            uint8_t vch = '\0';
+            hicolor_version_to_char(meta.version, &vch);
+
+            printf("%c %i %i\n", vch, meta.width, meta.height);
+            printf("palette %i\n", palette.size);
+
+            success = true;
+            goto clean_up_file;
+        }
+
+        rewind(hi_file);
+        if (hicolor_read_sequence_header(hi_file, &info) == HICOLOR_OK) {
+            uint8_t vch = '\0';
+            hicolor_version_to_char(info.meta.version, &vch);
+
+            printf(
+                "%c %i %i %u\n",
+                vch,
+                info.meta.width,
+                info.meta.height,
+                (unsigned int) info.frames
+            );
+
+            success = true;
+            goto clean_up_file;
+        }
+    }
+
+    if (check_and_report_error("can't read header", res)) {
+        goto clean_up_file;
+    }
+
+    uint8_t vch = '\0';
+    res = hicolor_version_to_char(meta.version, &vch);
+    if (check_and_report_error("can't decode version", res)) {
+        goto clean_up_file;
+    }
+
+    printf(
+        "%c %i %i\n",
+        vch,
+        meta.width,
+        meta.height
+    );
+
+    hicolor_pyramid pyramid;
+    res = hicolor_read_pyramid(hi_file, meta, &pyramid);
+    if (check_and_report_error("can't read pyramid", res)) {
+        goto clean_up_file;
+    }
+
+    for (uint8_t i = 1; i < pyramid.levels; i++) {
+        printf(
+            "level %i %i %i\n",
+            i,
+            pyramid.level[i].width,
+            pyramid.level[i].height
+        );
+    }
+
+    success = true;
+
+clean_up_file:
+    fclose(hi_file);
+
+    return success;
+}
+
+typedef struct compare_image {
+    hicolor_metadata meta;
+    hicolor_rgb* rgb_img;
+    hicolor_value* values;
+} compare_image;
+
+/* Load a HiColor image or another image for comparison.
+ * `values` is only set for HiColor images.
+ */
+bool load_compare_image(
+    const char* src,
+    compare_image* image
+)
+{
+    hicolor_result res;
+
+    image->rgb_img = NULL;
+    image->values = NULL;
+
+    bool exists = check_src_exists(src);
+    if (!exists) {
+        return false;
+    }
+
+    FILE* hi_file = fopen(src, "rb");
+    if (hi_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n",
+            src
+        );
+        return false;
+    }
+
+    res = hicolor_read_header(hi_file, &image->meta);
+    if (res == HICOLOR_BAD_MAGIC) {
+        image_options default_image = {.format = IMAGE_AUTO};
+        fclose(hi_file);
+
+        int width, height;
+        uint8_t* alpha = NULL;
+        if (!load_image(
+            src,
+            &default_image,
+            NULL,
+            false,
+            HICOLOR_VERSION_6,
+            HICOLOR_NO_DITHER,
+            HICOLOR_ALPHA_THRESHOLD,
+            &width,
+            &height,
+            &image->rgb_img,
+            &alpha
+        )) {
+            report_load_error(&default_image, src);
+            return false;
+        }
+
+        free(alpha);
+        image->meta.width = width;
+        image->meta.height = height;
+
+        return true;
+    }
+
+    hicolor_palette palette;
+    bool indexed = false;
+    if (res == HICOLOR_UNKNOWN_VERSION) {
+        rewind(hi_file);
+        res = hicolor_read_indexed_header(hi_file, &image->meta, &palette);
+        indexed = res == HICOLOR_OK;
+    }
+
+    bool success = false;
+    if (check_and_report_error("can't read header", res)) {
+        goto clean_up_file;
+    }
+
+    size_t count = (size_t) image->meta.width * image->meta.height;
+    image->values = malloc(sizeof(hicolor_value) * count);
+    image->rgb_img = malloc(sizeof(hicolor_rgb) * count);
+    if (image->values == NULL || image->rgb_img == NULL) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        goto clean_up_images;
+    }
+
+    /* The colors of an indexed image map back to values exactly. */
+    if (indexed) {
+        res = hicolor_read_indexed_image(
+            hi_file,
+            image->meta,
+            &palette,
+            image->rgb_img
+        );
+        for (size_t i = 0; res == HICOLOR_OK && i < count; i++) {
+            hicolor_rgb_to_value(
+                image->meta.version,
+                image->rgb_img[i],
+                &image->values[i]
+            );
+        }
+    } else {
+        res = hicolor_read_value_image(hi_file, image->meta, image->values);
+        for (size_t i = 0; res == HICOLOR_OK && i < count; i++) {
+            hicolor_value_to_rgb(
+                image->meta.version,
+                image->values[i],
+                &image->rgb_img[i]
+            );
+        }
+    }
+    if (check_and_report_error("can't read image data", res)) {
+        goto clean_up_images;
+    }
+
+    success = true;
+
+clean_up_images:
+    if (!success) {
+        free(image->values);
+        free(image->rgb_img);
+    }
+
+clean_up_file:
+    fclose(hi_file);
+
+    return success;
+}
+
+typedef struct compare_band {
+    hicolor_metadata meta;
+    uint16_t rows;
+    const hicolor_rgb* a;
+    const hicolor_rgb* b;
+    hicolor_stats stats;
+} compare_band;
+
+void* compare_band_run(
+    void* arg
+)
+{
+    compare_band* band = arg;
+    trace_thread_name("compare");
+
+    double start = trace_begin();
+    hicolor_stats_clear(&band->stats);
+    hicolor_compare_rgb_rows(
+        band->meta,
+        band->rows,
+        band->a,
+        band->b,
+        &band->stats
+    );
+    trace_span("compare", NULL, start);
+
+    return NULL;
+}
+
+/* Print the rectangles that enclose runs of rows with changed values. */
+void print_changed_regions(
+    const compare_image* a,
+    const compare_image* b
+)
+{
+    uint16_t width = a->meta.width;
+    int region_y = -1;
+    uint16_t region_start = 0;
+    uint16_t region_end = 0;
+
+    for (int y = 0; y <= a->meta.height; y++) {
+        uint16_t x_start = 0, x_end = 0;
+        bool changed = y < a->meta.height && hicolor_diff_value_row(
+            width,
+            &a->values[(size_t) y * width],
+            &b->values[(size_t) y * width],
+            &x_start,
+            &x_end
+        );
+
+        if (changed && region_y == -1) {
+            region_y = y;
+            region_start = x_start;
+            region_end = x_end;
+        } else if (changed) {
+            if (x_start < region_start) region_start = x_start;
+            if (x_end > region_end) region_end = x_end;
+        } else if (region_y != -1) {
+            printf(
+                "changed %i %i %i %i\n",
+                region_start,
+                region_y,
+                region_end - region_start,
+                y - region_y
+            );
+            region_y = -1;
+        }
+    }
+}
+
+bool compare_images(
+    int jobs,
+    const char* src_a,
+    const char* src_b
+)
+{
+    compare_image a, b;
+
+    if (!load_compare_image(src_a, &a)) {
+        return false;
+    }
+
+    bool success = false;
+    if (!load_compare_image(src_b, &b)) {
+        goto clean_up_a;
+    }
+
+    if (a.meta.width != b.meta.width || a.meta.height != b.meta.height) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "images have different dimensions\n"
+        );
+        goto clean_up_b;
+    }
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+
+    /* Split the image into one band per thread along SSIM window rows. */
+    int windows = (a.meta.height + HICOLOR_SSIM_WINDOW - 1)
+        / HICOLOR_SSIM_WINDOW;
+    int band_rows = (windows + jobs - 1) / jobs * HICOLOR_SSIM_WINDOW;
+    if (band_rows == 0) band_rows = HICOLOR_SSIM_WINDOW;
+
+    compare_band bands[HICOLOR_CLI_MAX_JOBS];
+    pthread_t threads[HICOLOR_CLI_MAX_JOBS];
+    bool started[HICOLOR_CLI_MAX_JOBS];
+    int band_count = 0;
+
+    for (int y = 0; y < a.meta.height; y += band_rows) {
+        compare_band* band = &bands[band_count];
+        size_t offset = (size_t) y * a.meta.width;
+
+        band->meta = a.meta;
+        band->rows = a.meta.height - y < band_rows
+            ? a.meta.height - y
+            : band_rows;
+        band->a = &a.rgb_img[offset];
+        band->b = &b.rgb_img[offset];
+
+        started[band_count] = band_count > 0 && pthread_create(
+            &threads[band_count],
+            NULL,
+            compare_band_run,
+            band
+        ) == 0;
+        band_count++;
+    }
+
+    hicolor_stats stats;
+    hicolor_stats_clear(&stats);
+
+    /* The first band and any band whose thread didn't start run here. */
+    for (int i = 0; i < band_count; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        } else {
+            compare_band_run(&bands[i]);
+        }
+        hicolor_stats_merge(&stats, &bands[i].stats);
+    }
+
+    double pixels = stats.pixels > 0 ? (double) stats.pixels : 1;
+    printf("psnr %.2f\n", hicolor_stats_psnr(&stats));
+    printf("ssim %.4f\n", hicolor_stats_ssim(&stats));
+    printf(
+        "max %i %i %i\n",
+        stats.max_error[0],
+        stats.max_error[1],
+        stats.max_error[2]
+    );
+    printf(
+        "mean %.3f %.3f %.3f\n",
+        stats.absolute_error[0] / pixels,
+        stats.absolute_error[1] / pixels,
+        stats.absolute_error[2] / pixels
+    );
+
+    /* Values of different versions don't encode the same colors. */
+    if (a.values != NULL
+        && b.values != NULL
+        && a.meta.version == b.meta.version) {
+        print_changed_regions(&a, &b);
+    }
+
+    success = true;
+
+clean_up_b:
+    free(b.rgb_img);
+    free(b.values);
+
+clean_up_a:
+    free(a.rgb_img);
+    free(a.values);
+
+    return success;
+}
+
+/* Store HiColor images of the same size and version as a sequence. */
+bool pack_sequence(
+    uint32_t keyframe_interval,
+    char** srcs,
+    int src_count,
+    const char* dest
+)
+{
+    hicolor_result res;
+    hicolor_metadata meta, frame_meta;
+    hicolor_value* values = NULL;
+    hicolor_sequence_writer writer = {.index = NULL, .previous = NULL};
+    bool success = false;
+
+    FILE* seq_file = fopen(dest, "wb");
+    if (seq_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open destination \"%s\" for writing\n",
+            dest
+        );
+        return false;
+    }
+
+    for (int i = 0; i < src_count; i++) {
+        if (!check_src_exists(srcs[i])) {
+            goto clean_up;
+        }
+
+        FILE* hi_file = fopen(srcs[i], "rb");
+        if (hi_file == NULL) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n",
+                srcs[i]
+            );
+            goto clean_up;
+        }
+
+        res = hicolor_read_header(hi_file, &frame_meta);
+        if (check_and_report_error("can't read header", res)) {
+            fclose(hi_file);
+            goto clean_up;
+        }
+
+        if (i == 0) {
+            meta = frame_meta;
+
+            values = malloc(sizeof(hicolor_value) * meta.width * meta.height);
+            if (values == NULL) {
+                fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+                fclose(hi_file);
+                goto clean_up;
+            }
+
+            res = hicolor_sequence_writer_init(
+                &writer,
+                seq_file,
+                meta,
+                keyframe_interval
+            );
+            if (check_and_report_error("can't start sequence", res)) {
+                fclose(hi_file);
+                goto clean_up;
+            }
+        } else if (frame_meta.version != meta.version
+                   || frame_meta.width != meta.width
+                   || frame_meta.height != meta.height) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "image \"%s\" differs in version or size from the first\n",
+                srcs[i]
+            );
+            fclose(hi_file);
+            goto clean_up;
+        }
+
+        res = hicolor_read_value_image(hi_file, meta, values);
+        fclose(hi_file);
+        if (check_and_report_error("can't read image data", res)) {
+            goto clean_up;
+        }
+
+        res = hicolor_sequence_write_frame(&writer, values);
+        if (check_and_report_error("can't write frame", res)) {
+            goto clean_up;
+        }
+    }
+
+    res = hicolor_sequence_writer_finish(&writer);
+    if (check_and_report_error("can't finish sequence", res)) {
+        goto clean_up;
+    }
+
+    success = true;
+
+clean_up:
+    hicolor_sequence_writer_free(&writer);
+    free(values);
+
+    if (fclose(seq_file) != 0) {
+        success = false;
+    }
+    if (!success) {
+        remove(dest);
+    }
+
+    return success;
+}
+
+/* Frames from one keyframe up to the next are a segment.
+ * Each thread decodes whole segments with its own stream.
+ */
+typedef struct unpack_job {
+    const char* src;
+    const char* prefix;
+    hicolor_sequence_info info;
+    const hicolor_sequence_entry* index;
+    const uint32_t* segments;
+    uint32_t segment_count;
+    uint32_t next_segment;
+    bool failed;
+    pthread_mutex_t mutex;
+} unpack_job;
+
+bool unpack_next_segment(
+    unpack_job* job,
+    uint32_t* segment
+)
+{
+    pthread_mutex_lock(&job->mutex);
+
+    bool found = !job->failed && job->next_segment < job->segment_count;
+    if (found) {
+        *segment = job->next_segment;
+        job->next_segment++;
+    }
+
+    pthread_mutex_unlock(&job->mutex);
+
+    return found;
+}
+
+void unpack_fail(
+    unpack_job* job
+)
+{
+    pthread_mutex_lock(&job->mutex);
+    job->failed = true;
+    pthread_mutex_unlock(&job->mutex);
+}
+
+bool unpack_write_frame(
+    const unpack_job* job,
+    uint32_t frame,
+    const hicolor_value* values
+)
+{
+    char* dest = malloc(strlen(job->prefix) + 16);
+    if (dest == NULL) {
+        return false;
+    }
+    sprintf(dest, "%s%06u.hic", job->prefix, (unsigned int) frame);
+
+    FILE* hi_file = fopen(dest, "wb");
+    if (hi_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open destination \"%s\" for writing\n",
+            dest
+        );
+        free(dest);
+        return false;
+    }
+
+    hicolor_result res = hicolor_write_header(hi_file, job->info.meta);
+    if (res == HICOLOR_OK) {
+        res = hicolor_write_value_image(hi_file, job->info.meta, values);
+    }
+
+    bool success = !check_and_report_error("can't write image", res);
+    if (fclose(hi_file) != 0) {
+        success = false;
+    }
+    if (!success) {
+        remove(dest);
+    }
+
+    free(dest);
+
+    return success;
+}
+
+void* unpack_run(
+    void* arg
+)
+{
+    unpack_job* job = arg;
+    const hicolor_metadata meta = job->info.meta;
+    uint32_t segment;
+    trace_thread_name("unpack");
+
+    hicolor_value* values =
+        malloc(sizeof(hicolor_value) * meta.width * meta.height);
+    FILE* seq_file = fopen(job->src, "rb");
+    if (values == NULL || seq_file == NULL) {
+        unpack_fail(job);
+        goto clean_up;
+    }
+
+    while (unpack_next_segment(job, &segment)) {
+        uint32_t start = job->segments[segment];
+        uint32_t end = segment + 1 < job->segment_count
+            ? job->segments[segment + 1]
+            : job->info.frames;
+        double segment_start = trace_begin();
+
+        hicolor_result res =
+            hicolor_seek_sequence_frame(seq_file, job->index[start]);
+
+        for (uint32_t frame = start;
+             res == HICOLOR_OK && frame < end;
+             frame++) {
+            hicolor_frame_type type;
+            res = hicolor_read_sequence_frame(seq_file, meta, values, &type);
+
+            if (res == HICOLOR_OK
+                && !unpack_write_frame(job, frame, values)) {
+                unpack_fail(job);
+                goto clean_up;
+            }
+        }
+
+        if (check_and_report_error("can't read frame", res)) {
+            unpack_fail(job);
+            goto clean_up;
+        }
+        trace_span("unpack", job->src, segment_start);
+    }
+
+clean_up:
+    if (seq_file != NULL) {
+        fclose(seq_file);
+    }
+    free(values);
+
+    return NULL;
+}
+
+/* Write every frame of a sequence to "<prefix>NNNNNN.hic". */
+bool unpack_sequence(
+    int jobs,
+    const char* src,
+    const char* prefix
+)
+{
+    hicolor_result res;
+    unpack_job job = {
+        .src = src,
+        .prefix = prefix,
+        .next_segment = 0,
+        .failed = false
+    };
+    hicolor_sequence_entry* index = NULL;
+    uint32_t* segments = NULL;
+    bool success = false;
+
+    if (!check_src_exists(src)) {
+        return false;
+    }
+
+    FILE* seq_file = fopen(src, "rb");
+    if (seq_file == NULL) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n",
+            src
+        );
+        return false;
+    }
+
+    res = hicolor_read_sequence_header(seq_file, &job.info);
+    if (check_and_report_error("can't read sequence header", res)) {
+        goto clean_up;
+    }
+
+    index = malloc(sizeof(hicolor_sequence_entry) * (job.info.frames + 1));
+    segments = malloc(sizeof(uint32_t) * (job.info.frames + 1));
+    if (index == NULL || segments == NULL) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        goto clean_up;
+    }
+
+    res = hicolor_read_sequence_index(seq_file, job.info, index);
+    if (check_and_report_error("can't read sequence index", res)) {
+        goto clean_up;
+    }
+
+    job.segment_count = 0;
+    for (uint32_t i = 0; i < job.info.frames; i++) {
+        if (index[i].type == HICOLOR_KEYFRAME) {
+            segments[job.segment_count] = i;
+            job.segment_count++;
+        }
+    }
+
+    if (job.info.frames > 0
+        && (job.segment_count == 0 || segments[0] != 0)) {
+        check_and_report_error(
+            "sequence doesn't start with a keyframe",
+            HICOLOR_INVALID_VALUE
+        );
+        goto clean_up;
+    }
+
+    job.index = index;
+    job.segments = segments;
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if ((uint32_t) jobs > job.segment_count) {
+        jobs = job.segment_count > 0 ? job.segment_count : 1;
+    }
+
+    pthread_t threads[HICOLOR_CLI_MAX_JOBS];
+    bool started[HICOLOR_CLI_MAX_JOBS];
+    pthread_mutex_init(&job.mutex, NULL);
+
+    for (int i = 1; i < jobs; i++) {
+        started[i] = pthread_create(&threads[i], NULL, unpack_run, &job) == 0;
+    }
+
+    /* This thread works too and picks up the segments of threads that
+     * didn't start.
+     */
+    unpack_run(&job);
+
+    for (int i = 1; i < jobs; i++) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    pthread_mutex_destroy(&job.mutex);
+
+    success = !job.failed;
+
+clean_up:
+    free(index);
+    free(segments);
+    fclose(seq_file);
+
+    return success;
+}
+
+typedef struct verify_result {
+    bool done;
+    bool found;
+    hicolor_result res;
+} verify_result;
+
+typedef struct verify_job {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    char** files;
+    int count;
+    int next;
+    int jobs;
+    bool io_uring;
+    verify_result* results;
+} verify_job;
+
+/* Check the header and the checksum of a HiColor file
+ * from memory if it was read ahead.
+ */
+hicolor_result verify_file(
+    const prefetch_file* file,
+    bool* found
+)
+{
+    *found = false;
+
+    FILE* hi_file;
+    if (file->data != NULL) {
+        hi_file = fmemopen((void*) file->data, file->size, "rb");
+    } else {
+        hi_file = fopen(file->path, "rb");
+#ifndef _WIN32
+        if (hi_file != NULL) {
+            posix_fadvise(fileno(hi_file), 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+#endif
+    }
+    if (hi_file == NULL) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    hicolor_metadata meta;
+    hicolor_result res = hicolor_read_header(hi_file, &meta);
+    if (res == HICOLOR_OK) {
+        res = hicolor_verify_checksum(hi_file, meta, found);
+    }
+
+    fclose(hi_file);
+
+    return res;
+}
+
+void* verify_run(
+    void* arg
+)
+{
+    verify_job* job = arg;
+    trace_thread_name("verify");
+
+    prefetcher pf;
+    prefetcher_init(&pf, job->io_uring);
+
+    while (true) {
+        /* Share the files read ahead between the threads. */
+        pthread_mutex_lock(&job->lock);
+        int first = job->next;
+        int n = 1;
+        if (pf.active) {
+            n = (job->count - first + job->jobs - 1) / job->jobs;
+        }
+        if (n > HICOLOR_CLI_PREFETCH_FILES) {
+            n = HICOLOR_CLI_PREFETCH_FILES;
+        }
+        if (n > job->count - first) {
+            n = job->count - first;
+        }
+        job->next += n;
+        pthread_mutex_unlock(&job->lock);
+
+        if (n == 0) {
+            break;
+        }
+
+        prefetch(&pf, &job->files[first], n);
+
+        for (int k = 0; k < n; k++) {
+            int i = first + k;
+            bool found;
+            double start = trace_begin();
+            hicolor_result res = verify_file(&pf.files[k], &found);
+            trace_span("verify", job->files[i], start);
+
+            pthread_mutex_lock(&job->lock);
+            job->results[i].found = found;
+            job->results[i].res = res;
+            job->results[i].done = true;
+            pthread_cond_broadcast(&job->changed);
+            pthread_mutex_unlock(&job->lock);
+        }
+    }
+
+    prefetcher_free(&pf);
+
+    return NULL;
+}
+
+/* Check the checksums of `files` with `jobs` threads. Print a line for
+ * each file in order as soon as it and the files before it are done.
+ * A file without a checksum fails. With `io_uring`, each thread reads
+ * its files ahead in groups.
+ */
+bool verify_files(
+    int jobs,
+    bool io_uring,
+    char** files,
+    int count
+)
+{
+    verify_job job;
+    job.files = files;
+    job.count = count;
+    job.next = 0;
+    job.io_uring = io_uring;
+    job.results = calloc(count, sizeof(verify_result));
+    if (job.results == NULL) {
+        fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+        return false;
+    }
+
+    if (jobs < 1) {
+        jobs = 1;
+    }
+    if (jobs > count) {
+        jobs = count;
+    }
+    job.jobs = jobs;
+
+    pthread_mutex_init(&job.lock, NULL);
+    pthread_cond_init(&job.changed, NULL);
+
+    pthread_t threads[HICOLOR_CLI_MAX_JOBS];
+    int started = 0;
+    for (; started < jobs; started++) {
+        if (pthread_create(&threads[started], NULL, verify_run, &job) != 0) {
+            break;
+        }
+    }
+
+    /* Without threads, check every file before printing. */
+    if (started == 0) {
+        verify_run(&job);
+    }
+
+    bool success = true;
+    for (int i = 0; i < count; i++) {
+        pthread_mutex_lock(&job.lock);
+        while (!job.results[i].done) {
+            pthread_cond_wait(&job.changed, &job.lock);
+        }
+        verify_result result = job.results[i];
+        pthread_mutex_unlock(&job.lock);
+
+        if (result.res != HICOLOR_OK) {
+            printf(
+                "%s: FAILED (%s)\n",
+                files[i],
+                hicolor_error_message(result.res)
+            );
+            success = false;
+        } else if (!result.found) {
+            printf("%s: no checksum\n", files[i]);
+            success = false;
+        } else {
+            printf("%s: OK\n", files[i]);
+        }
+    }
+
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&job.changed);
+    pthread_mutex_destroy(&job.lock);
+    free(job.results);
+
+    return success;
+}
+
+/* The manifest records the source, options, and result of each conversion.
+ * Each line has the fields size, mtime, CRC-32 of the source, options,
+ * source path, and destination path separated by tabs.
+ * Entries are looked up by the destination in a hash table.
+ */
+typedef struct manifest_entry {
+    long long size;
+    long long mtime;
+    uint32_t crc;
+    char* options;
+    char* src;
+    char* dest;
+} manifest_entry;
+
+typedef struct manifest {
+    const char* path;
+    manifest_entry* entries;
+    size_t count;
+    size_t capacity;
+    size_t* table;
+    size_t table_size;
+    bool changed;
+} manifest;
+
+/* FNV-1a. */
+uint32_t manifest_hash(
+    const char* str
+)
+{
+    uint32_t hash = 2166136261u;
+
+    for (; *str != '\0'; str++) {
+        hash = (hash ^ (uint8_t) *str) * 16777619u;
+    }
+
+    return hash;
+}
+
+/* Return the index of the table slot for `dest`.
+ * The slot holds zero or the entry index plus one.
+ */
+size_t manifest_slot(
+    const manifest* m,
+    const char* dest
+)
+{
+    size_t slot = manifest_hash(dest) & (m->table_size - 1);
+
+    while (m->table[slot] != 0
+           && strcmp(m->entries[m->table[slot] - 1].dest, dest) != 0) {
+        slot = (slot + 1) & (m->table_size - 1);
+    }
+
+    return slot;
+}
+
+manifest_entry* manifest_find(
+    const manifest* m,
+    const char* dest
+)
+{
+    if (m->table_size == 0) {
+        return NULL;
+    }
+
+    size_t slot = manifest_slot(m, dest);
+    return m->table[slot] == 0 ? NULL : &m->entries[m->table[slot] - 1];
+}
+
+/* Grow the entry array and the table so there is room for one more entry. */
+bool manifest_reserve(
+    manifest* m
+)
+{
+    if (m->count == m->capacity) {
+        size_t capacity = m->capacity == 0 ? 64 : m->capacity * 2;
+        manifest_entry* entries =
+            realloc(m->entries, capacity * sizeof(manifest_entry));
+        if (entries == NULL) {
+            return false;
+        }
+
+        m->entries = entries;
+        m->capacity = capacity;
+    }
+
+    /* Keep the load factor at or below one half. */
+    if ((m->count + 1) * 2 > m->table_size) {
+        size_t table_size = m->table_size == 0 ? 128 : m->table_size * 2;
+        size_t* table = calloc(table_size, sizeof(size_t));
+        if (table == NULL) {
+            return false;
+        }
+
+        free(m->table);
+        m->table = table;
+        m->table_size = table_size;
+
+        for (size_t i = 0; i < m->count; i++) {
+            m->table[manifest_slot(m, m->entries[i].dest)] = i + 1;
+        }
+    }
+
+    return true;
+}
+
+char* copy_string(
+    const char* str
+)
+{
+    char* copy = malloc(strlen(str) + 1);
+    if (copy != NULL) {
+        strcpy(copy, str);
+    }
+
+    return copy;
+}
+
+/* Add or replace the entry for `entry.dest`.
+ * The manifest takes ownership of the strings.
+ */
+bool manifest_put(
+    manifest* m,
+    manifest_entry entry
+)
+{
+    manifest_entry* existing = manifest_find(m, entry.dest);
+    if (existing != NULL) {
+        free(existing->options);
+        free(existing->src);
+        free(existing->dest);
+        *existing = entry;
+        m->changed = true;
+        return true;
+    }
+
+    if (!manifest_reserve(m)) {
+        return false;
+    }
+
+    m->entries[m->count] = entry;
+    m->count++;
+    m->table[manifest_slot(m, entry.dest)] = m->count;
+    m->changed = true;
+
+    return true;
+}
+
+void manifest_free(
+    manifest* m
+)
+{
+    for (size_t i = 0; i < m->count; i++) {
+        free(m->entries[i].options);
+        free(m->entries[i].src);
+        free(m->entries[i].dest);
+    }
+
+    free(m->entries);
+    free(m->table);
+}
+
+/* Load the manifest at `path`. A missing file is an empty manifest.
+ * Malformed lines are ignored.
+ */
+bool manifest_load(
+    manifest* m,
+    const char* path
+)
+{
+    m->path = path;
+    m->entries = NULL;
+    m->count = 0;
+    m->capacity = 0;
+    m->table = NULL;
+    m->table_size = 0;
+    m->changed = false;
+
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
+        return true;
+    }
+
+    char* line = malloc(HICOLOR_CLI_MANIFEST_LINE_MAX);
+    if (line == NULL) {
+        fclose(fp);
+        return false;
+    }
+
+    bool success = true;
+    while (fgets(line, HICOLOR_CLI_MANIFEST_LINE_MAX, fp) != NULL) {
+        char* fields[6];
+        char* p = line;
+        int n = 0;
+
+        for (; n < 6; n++) {
+            fields[n] = p;
+            p = strpbrk(p, n < 5 ? "\t" : "\n");
+            if (p == NULL) break;
+            *p++ = '\0';
+        }
+        if (n < 6) {
+            continue;
+        }
+
+        manifest_entry entry = {
+            .size = strtoll(fields[0], NULL, 10),
+            .mtime = strtoll(fields[1], NULL, 10),
+            .crc = strtoul(fields[2], NULL, 16),
+            .options = copy_string(fields[3]),
+            .src = copy_string(fields[4]),
+            .dest = copy_string(fields[5])
+        };
+
+        if (entry.options == NULL
+            || entry.src == NULL
+            || entry.dest == NULL
+            || !manifest_put(m, entry)) {
+            free(entry.options);
+            free(entry.src);
+            free(entry.dest);
+            success = false;
+            break;
+        }
+    }
+
+    free(line);
+    fclose(fp);
+    m->changed = false;
+
+    return success;
+}
+
+/* Write the manifest to a temporary file and rename it over the old one. */
+bool manifest_save(
+    const manifest* m
+)
+{
+    if (!m->changed) {
+        return true;
+    }
 
-        free(rgb_img);
+    char* tmp_path = malloc(strlen(m->path) + 5);
+    if (tmp_path == NULL) {
         return false;
     }
+    sprintf(tmp_path, "%s.tmp", m->path);
 
-    hicolor_metadata meta = {
-        .version = version,
-        .width = width,
-        .height = height
-    };
-    res = hicolor_write_header(hi_file, meta);
-
-    bool success = false;
-    if (check_and_report_error("can't write header", res)) {
-        goto clean_up_file;
+    FILE* fp = fopen(tmp_path, "wb");
+    if (fp == NULL) {
+        free(tmp_path);
+        return false;
     }
 
-    res = hicolor_quantize_rgb_image(meta, dither, rgb_img);
-    if (check_and_report_error("can't quantize image", res)) {
-        goto clean_up_images;
-    }
+    bool success = true;
+    for (size_t i = 0; i < m->count; i++) {
+        const manifest_entry* e = &m->entries[i];
 
-    res = hicolor_write_rgb_image(hi_file, meta, rgb_img);
-    if (check_and_report_error("can't write image data", res)) {
-        goto clean_up_images;
+        if (fprintf(
+            fp,
+            "%lld\t%lld\t%08x\t%s\t%s\t%s\n",
+            e->size,
+            e->mtime,
+            (unsigned int) e->crc,
+            e->options,
+            e->src,
+            e->dest
+        ) < 0) {
+            success = false;
+            break;
+        }
     }
 
-    success = true;
+    if (fclose(fp) != 0) {
+        success = false;
+    }
 
-clean_up_images:
-    free(rgb_img);
+    if (success) {
+        /* `rename` doesn't replace existing files on Windows. */
+        remove(m->path);
+        success = rename(tmp_path, m->path) == 0;
+    } else {
+        remove(tmp_path);
+    }
 
-clean_up_file:
-    fclose(hi_file);
+    free(tmp_path);
 
     return success;
 }
 
-bool png_quantize(
-    hicolor_version version,
-    hicolor_dither dither,
-    const char* src,
-    const char* dest
+bool hash_file(
+    const char* path,
+    uint32_t* crc
 )
 {
-    hicolor_result res;
-
-    bool exists = check_src_exists(src);
-    if (!exists) {
+    FILE* fp = fopen(path, "rb");
+    if (fp == NULL) {
         return false;
     }
 
-    int width, height;
-    hicolor_rgb* rgb_img = NULL;
-    uint8_t* alpha = NULL;
-    if (!load_png(src, &width, &height, &rgb_img, &alpha)) {
-        fprintf(
-            stderr,
-            HICOLOR_CLI_ERROR "can't load PNG file \"%s\": %s\n",
-            src,
-            png_error_msg
-        );
+    uint8_t* buffer = malloc(HICOLOR_CLI_HASH_BUFFER_SIZE);
+    if (buffer == NULL) {
+        fclose(fp);
         return false;
     }
 
-    hicolor_metadata meta = {
-        .version = version,
-        .width = width,
-        .height = height
-    };
+    uLong value = crc32(0L, Z_NULL, 0);
+    size_t n;
+    while ((n = fread(buffer, 1, HICOLOR_CLI_HASH_BUFFER_SIZE, fp)) > 0) {
+        value = crc32(value, buffer, n);
+    }
 
-    res = hicolor_quantize_rgb_image(meta, dither, rgb_img);
-    bool success = false;
-    if (check_and_report_error("can't quantize image", res)) {
-        goto clean_up_images;
+    bool success = !ferror(fp);
+    *crc = value;
+
+    free(buffer);
+    fclose(fp);
+
+    return success;
+}
+
+/* Describe the options that affect the output. */
+void format_options(
+    bool encode,
+    const convert_options* opts,
+    char* buffer,
+    size_t size
+)
+{
+    const char* dither_flags[] = {"-a", "-b", "-n", "-f", "-B"};
+    uint8_t vch = '?';
+    hicolor_version_to_char(opts->version, &vch);
+
+    int n = snprintf(
+        buffer,
+        size,
+        "%s -%c %s%s%s%s%s",
+        encode ? HICOLOR_CLI_CMD_ENCODE : HICOLOR_CLI_CMD_QUANTIZE,
+        vch,
+        dither_flags[opts->dither],
+        opts->skip_exact ? " -x" : "",
+        encode && opts->pyramid ? " -p" : "",
+        encode && opts->checksum ? " -c" : "",
+        encode && opts->indexed ? " -i" : ""
+    );
+
+    if (opts->version == HICOLOR_VERSION_A && n > 0 && (size_t) n < size) {
+        n += snprintf(buffer + n, size - n, " -t %i", opts->alpha_threshold);
     }
 
-    if (!save_png(dest, width, height, rgb_img, alpha)) {
-        fprintf(
-            stderr,
-            HICOLOR_CLI_ERROR "can't save PNG: %s\n",
-            png_error_msg
+    if (opts->resize_width > 0 && n > 0 && (size_t) n < size) {
+        n += snprintf(
+            buffer + n,
+            size - n,
+            " -r %ix%i",
+            opts->resize_width,
+            opts->resize_height
         );
-        goto clean_up_images;
     }
 
-    success = true;
-
-clean_up_images:
-    free(rgb_img);
+    if (opts->image.format != IMAGE_AUTO && n > 0 && (size_t) n < size) {
+        n += snprintf(
+            buffer + n,
+            size - n,
+            " -F %s",
+            image_format_extensions[opts->image.format]
+        );
+    }
 
-    return success;
+    if (opts->image.width > 0 && n > 0 && (size_t) n < size) {
+        snprintf(
+            buffer + n,
+            size - n,
+            " -s %ix%i",
+            opts->image.width,
+            opts->image.height
+        );
+    }
 }
 
-bool hicolor_to_png(
+/* A destination is up to date when it exists and the manifest records
+ * a conversion of the same source with the same options.
+ * The source matches when its size and mtime or its size and hash are
+ * the same. If only the mtime differs, the entry is updated.
+ */
+bool manifest_up_to_date(
+    manifest* m,
+    const char* options,
     const char* src,
     const char* dest
 )
 {
-    hicolor_result res;
-
-    bool exists = check_src_exists(src);
-    if (!exists) {
+    manifest_entry* entry = manifest_find(m, dest);
+    if (entry == NULL
+        || strcmp(entry->src, src) != 0
+        || strcmp(entry->options, options) != 0
+        || access(dest, F_OK) != 0) {
         return false;
     }
 
-    FILE* hi_file = fopen(src, "rb");
-    if (hi_file == NULL) {
-        fprintf(stderr, HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n", src);
+    struct stat st;
+    if (stat(src, &st) != 0 || (long long) st.st_size != entry->size) {
         return false;
     }
 
-    hicolor_metadata meta;
-    res = hicolor_read_header(hi_file, &meta);
-    bool success = false;
-    if (check_and_report_error("can't read header", res)) {
-        goto clean_up_file;
+    if ((long long) st.st_mtime == entry->mtime) {
+        return true;
     }
 
-    hicolor_rgb* rgb_img = malloc(sizeof(hicolor_rgb) * meta.width * meta.height);
-    if (rgb_img == NULL) {
-        goto clean_up_file;
-    }
-    res = hicolor_read_rgb_image(hi_file, meta, rgb_img);
-    if (check_and_report_error("can't read image data", res)) {
-        goto clean_up_rgb_img;
+    uint32_t crc;
+    if (!hash_file(src, &crc) || crc != entry->crc) {
+        return false;
     }
 
-    if (!save_png(dest, meta.width, meta.height, rgb_img, NULL)) {
-        fprintf(
-            stderr,
-            HICOLOR_CLI_ERROR "can't save PNG: %s\n",
-            png_error_msg
-        );
-        goto clean_up_rgb_img;
-    }
+    entry->mtime = st.st_mtime;
+    m->changed = true;
 
-    success = true;
+    return true;
+}
+
+void manifest_record(
+    manifest* m,
+    const char* options,
+    const char* src,
+    const char* dest
+)
+{
+    /* Tabs and newlines would break the format. */
+    if (strpbrk(src, "\t\n") != NULL || strpbrk(dest, "\t\n") != NULL) {
+        return;
+    }
 
-clean_up_rgb_img:
-    free(rgb_img);
+    struct stat st;
+    uint32_t crc;
+    if (stat(src, &st) != 0 || !hash_file(src, &crc)) {
+        return;
+    }
 
-clean_up_file:
-    fclose(hi_file);
+    manifest_entry entry = {
+        .size = st.st_size,
+        .mtime = st.st_mtime,
+        .crc = crc,
+        .options = copy_string(options),
+        .src = copy_string(src),
+        .dest = copy_string(dest)
+    };
 
-    return success;
+    if (entry.options == NULL
+        || entry.src == NULL
+        || entry.dest == NULL
+        || !manifest_put(m, entry)) {
+        free(entry.options);
+        free(entry.src);
+        free(entry.dest);
+    }
 }
 
-bool hicolor_print_info(
+/* Return the default destination for `src`. The caller frees it. */
+char* default_dest(
+    bool encode,
+    const image_options* image,
     const char* src
 )
 {
-    hicolor_result res;
+    image_format format =
+        image->format == IMAGE_AUTO ? IMAGE_PNG : image->format;
+    const char* ext = encode ? "hic" : image_format_extensions[format];
 
-    bool exists = check_src_exists(src);
-    if (!exists) {
-        return false;
+    char* dest = malloc(strlen(src) + strlen(ext) + 2);
+    if (dest != NULL) {
+        sprintf(dest, "%s.%s", src, ext);
     }
 
-    FILE* hi_file = fopen(src, "rb");
-    if (hi_file == NULL) {
+    return dest;
+}
+
+/* Convert one image with `src` and `dest` or, in batch mode, every
+ * argument as a source with the default destination.
+ * With a manifest, skip destinations that are up to date.
+ * With `io_uring`, read batch sources ahead in groups.
+ */
+bool convert_files(
+    bool encode,
+    const convert_options* opts,
+    const char* manifest_path,
+    bool batch,
+    bool io_uring,
+    char** args,
+    int arg_count
+)
+{
+    manifest m;
+    bool use_manifest = manifest_path != NULL;
+    char options[128];
+
+    if (use_manifest && !manifest_load(&m, manifest_path)) {
         fprintf(
             stderr,
-            HICOLOR_CLI_ERROR "can't open source image \"%s\" for reading\n",
-            src
+            HICOLOR_CLI_ERROR "can't load manifest \"%s\"\n",
+            manifest_path
         );
+        manifest_free(&m);
         return false;
     }
 
-    hicolor_metadata meta;
-    res = hicolor_read_header(hi_file, &meta);
-    bool success = false;
-    if (check_and_report_error("can't read header", res)) {
-        goto clean_up_file;
-    }
+    format_options(encode, opts, options, sizeof(options));
 
-    uint8_t vch = '\0';
-    res = hicolor_version_to_char(meta.version, &vch);
-    if (check_and_report_error("can't decode version", res)) {
-        goto clean_up_file;
+    bool success = true;
+    int count = batch ? arg_count : 1;
+
+    prefetcher pf;
+    prefetcher_init(&pf, batch && io_uring);
+    int first = 0;
+    int ahead = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (i == first + ahead && pf.active) {
+            first = i;
+            ahead = prefetch(&pf, &args[i], count - i);
+        }
+        prefetched = i < first + ahead ? &pf.files[i - first] : NULL;
+
+        const char* src = args[i];
+        char* dest = !batch && arg_count == 2
+            ? copy_string(args[1])
+            : default_dest(encode, &opts->image, src);
+        if (dest == NULL) {
+            fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+            success = false;
+            break;
+        }
+
+        if (use_manifest && manifest_up_to_date(&m, options, src, dest)) {
+            free(dest);
+            continue;
+        }
+
+        /* Each file is planned with the whole memory budget,
+         * so it can't share it with the buffers of the last one.
+         */
+        if (opts->max_memory > 0) {
+            hicolor_context_free(&scratch);
+        }
+
+        double start = trace_begin();
+        bool converted = encode
+            ? image_to_hicolor(opts, src, dest)
+            : quantize_image(opts, src, dest);
+        trace_span("convert", src, start);
+
+        if (converted && use_manifest) {
+            manifest_record(&m, options, src, dest);
+        }
+
+        success = success && converted;
+        free(dest);
     }
 
-    printf(
-        "%c %i %i\n",
-        vch,
-        meta.width,
-        meta.height
-    );
+    prefetched = NULL;
+    prefetcher_free(&pf);
 
-    success = true;
+    if (use_manifest) {
+        if (!manifest_save(&m)) {
+            fprintf(
+                stderr,
+                HICOLOR_CLI_ERROR "can't save manifest \"%s\"\n",
+                manifest_path
+            );
+            success = false;
+        }
 
-clean_up_file:
-    fclose(hi_file);
+        manifest_free(&m);
+    }
 
     return success;
 }
@@ -502,9 +5020,19 @@ void usage(
     fprintf(
         output,
         "usage:\n"
-        "  hicolor (encode|quantize) [-5|-6] [-a|-b|-n] [--] <src> [<dest>]\n"
-        "  hicolor decode <src> [<dest>]\n"
+        "  hicolor (encode|quantize) [-5|-6|-A] [-a|-b|-B|-f|-n] [-x] [-p] [-c]\n"
+        "                            [-i] [-t <n>] [-r <w>x<h>] [-F <format>]\n"
+        "                            [-s <w>x<h>] [-j <n>] [-m <file>]\n"
+        "                            [--] <src> [<dest>]\n"
+        "  hicolor (encode|quantize) [<option> ...] --batch [--io-uring]\n"
+        "                            [--] <src> ...\n"
+        "  hicolor decode [-F <format>] [-j <n>] [--] <src> [<dest>]\n"
         "  hicolor info <file>\n"
+        "  hicolor compare [-j <n>] <image> <image>\n"
+        "  hicolor convert [-5|-6|-A] [-a|-b|-B|-n] [--] <src> [<dest>]\n"
+        "  hicolor pack [-k <n>] [--] <src> ... <dest>\n"
+        "  hicolor unpack [-j <n>] [--] <src> [<prefix>]\n"
+        "  hicolor verify [-j <n>] [--io-uring] [--] <file> ...\n"
         "  hicolor (version|help|-h|--help)\n"
     );
 }
@@ -560,18 +5088,62 @@ void help()
     usage(stdout);
     printf(
         "\ncommands:\n"
-        "  encode           convert PNG to HiColor\n"
-        "  decode           convert HiColor to PNG\n"
-        "  quantize         quantize PNG to PNG\n"
+        "  encode           convert PNG, PPM, PAM, or raw RGB(A) to HiColor\n"
+        "  decode           convert HiColor to PNG, PPM, PAM, or raw RGB(A)\n"
+        "  quantize         quantize an image without converting it to HiColor\n"
         "  info             print HiColor image version and resolution\n"
+        "                   (and frame count for sequences, pyramid levels,\n"
+        "                   palette size)\n"
+        "  compare          print PSNR, SSIM, and channel error between images\n"
+        "  convert          convert HiColor to another version (in place\n"
+        "                   without <dest>, undithered by default)\n"
+        "  pack             store HiColor images as a sequence\n"
+        "  unpack           extract the frames of a sequence\n"
+        "  verify           check HiColor files against their checksums\n"
         "  version          print version of HiColor, libpng, and zlib\n"
         "  help             print this help message\n"
         "\noptions:\n"
         "  -5, --15-bit     15-bit color\n"
         "  -6, --16-bit     16-bit color\n"
+        "  -A, --alpha      15-bit color with 1-bit alpha\n"
         "  -a, --a-dither   dither image with \"a dither\"\n"
         "  -b, --bayer      dither image with Bayer algorithm (default)\n"
+        "  -B, --blue-noise dither image with a blue-noise threshold matrix\n"
+        "  -f, --floyd      dither image with Floyd-Steinberg error diffusion\n"
         "  -n, --no-dither  do not dither image\n"
+        "  -x, --skip-exact don't dither images that only have high-color colors\n"
+        "                   (reads the whole image before quantizing it)\n"
+        "  -p, --pyramid    store half-size levels down to 32x32 after the image\n"
+        "                   for faster zoomed-out viewing (encode only)\n"
+        "  -c, --checksum   end the file with a CRC-32C checksum (encode only)\n"
+        "  -i, --indexed    store images with up to 4096 colors as a palette\n"
+        "                   and 8- or 12-bit indices (encode only)\n"
+        "  -t, --alpha-threshold <n>\n"
+        "                   make pixels with alpha below <n> transparent\n"
+        "                   with --alpha (default 128)\n"
+        "  -r, --resize <w>x<h>\n"
+        "                   resize image while decoding it\n"
+        "  -F, --format <format>\n"
+        "                   read or write png, ppm, pam, rgb, or rgba images\n"
+        "                   (default: by file extension, else png)\n"
+        "  -s, --size <w>x<h>\n"
+        "                   size of raw rgb and rgba source images\n"
+        "  -j, --jobs <n>   decode, quantize, and write in a pipeline\n"
+        "                   with <n> quantization threads (decode: read and\n"
+        "                   convert bands of rows in <n> threads)\n"
+        "  -m, --manifest <file>\n"
+        "                   record conversions in <file> and skip those\n"
+        "                   whose source and options haven't changed\n"
+        "  --batch          convert every <src> to the default <dest>\n"
+        "  --io-uring       read small files ahead in groups with io_uring\n"
+        "                   on Linux (batches and verify)\n"
+        "  --max-memory <n> keep image buffers within <n> bytes (K, M, or G\n"
+        "                   suffix) by quantizing in bands if necessary\n"
+        "  --trace <file>   write a Chrome trace of every stage to <file>\n"
+        "                   for viewing in Perfetto\n"
+        "  -k, --keyframes <n>\n"
+        "                   make every <n>th frame a keyframe (default 30,\n"
+        "                   0 for only the first)\n"
     );
 }
 
@@ -595,8 +5167,78 @@ bool str_prefix(
     return true;
 }
 
+/* Parse a size like "640x480" with dimensions from 1 to 65535. */
+bool parse_size(
+    const char* arg,
+    int* width,
+    int* height
+)
+{
+    char* end = NULL;
+    long w = strtol(arg, &end, 10);
+    if (*end != 'x') {
+        return false;
+    }
+
+    long h = strtol(end + 1, &end, 10);
+
+    if (*end != '\0'
+        || w < 1
+        || w > UINT16_MAX
+        || h < 1
+        || h > UINT16_MAX) {
+        return false;
+    }
+
+    *width = w;
+    *height = h;
+
+    return true;
+}
+
+/* Parse a number of bytes with an optional K, M, or G suffix. */
+bool parse_memory(
+    const char* arg,
+    size_t* size
+)
+{
+    char* end = NULL;
+    unsigned long long n = strtoull(arg, &end, 10);
+    if (end == arg || arg[0] == '-') {
+        return false;
+    }
+
+    int shift = 0;
+    switch (*end) {
+    case 'K':
+    case 'k':
+        shift = 10;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        shift = 20;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        shift = 30;
+        end++;
+        break;
+    }
+
+    if (*end != '\0' || n < 1 || n > (SIZE_MAX >> shift)) {
+        return false;
+    }
+
+    *size = (size_t) n << shift;
+
+    return true;
+}
+
 typedef enum command {
-    ENCODE, DECODE, QUANTIZE, INFO, VERSION, HELP
+    ENCODE, DECODE, QUANTIZE, INFO, COMPARE, CONVERT, PACK, UNPACK, VERSION,
+    VERIFY, HELP
 } command;
 
 int main(
@@ -605,8 +5247,25 @@ int main(
 )
 {
     command opt_command = ENCODE;
-    hicolor_dither opt_dither = HICOLOR_BAYER;
-    hicolor_version opt_version = HICOLOR_VERSION_6;
+    convert_options opts = {
+        .version = HICOLOR_VERSION_6,
+        .dither = HICOLOR_BAYER,
+        .jobs = 0,
+        .skip_exact = false,
+        .pyramid = false,
+        .resize_width = 0,
+        .resize_height = 0,
+        .image = {.format = IMAGE_AUTO, .width = 0, .height = 0},
+        .max_memory = 0,
+        .checksum = false,
+        .indexed = false,
+        .alpha_threshold = HICOLOR_ALPHA_THRESHOLD
+    };
+    const char* opt_manifest = NULL;
+    const char* opt_trace = NULL;
+    bool opt_batch = false;
+    bool opt_io_uring = false;
+    long opt_keyframes = HICOLOR_CLI_KEYFRAME_INTERVAL;
     const char* command_name;
     char* arg_src;
     char* arg_dest;
@@ -634,7 +5293,6 @@ int main(
         command_name = HICOLOR_CLI_CMD_ENCODE;
         opt_command = ENCODE;
     } else if (str_prefix(HICOLOR_CLI_CMD_DECODE, argv[i])) {
-        allow_opts = false;
         command_name = HICOLOR_CLI_CMD_DECODE;
         opt_command = DECODE;
     } else if (str_prefix(HICOLOR_CLI_CMD_QUANTIZE, argv[i])) {
@@ -645,12 +5303,31 @@ int main(
         command_name = HICOLOR_CLI_CMD_INFO;
         max_pos_args = 1;
         opt_command = INFO;
+    } else if (str_prefix(HICOLOR_CLI_CMD_COMPARE, argv[i])) {
+        command_name = HICOLOR_CLI_CMD_COMPARE;
+        min_pos_args = 2;
+        opt_command = COMPARE;
+    } else if (str_prefix(HICOLOR_CLI_CMD_CONVERT, argv[i])) {
+        command_name = HICOLOR_CLI_CMD_CONVERT;
+        /* Only dither when asked to. */
+        opts.dither = HICOLOR_NO_DITHER;
+        opt_command = CONVERT;
+    } else if (str_prefix(HICOLOR_CLI_CMD_PACK, argv[i])) {
+        command_name = HICOLOR_CLI_CMD_PACK;
+        min_pos_args = 2;
+        opt_command = PACK;
+    } else if (str_prefix(HICOLOR_CLI_CMD_UNPACK, argv[i])) {
+        command_name = HICOLOR_CLI_CMD_UNPACK;
+        opt_command = UNPACK;
     } else if (str_prefix(HICOLOR_CLI_CMD_VERSION, argv[i])) {
         allow_opts = false;
         command_name = HICOLOR_CLI_CMD_VERSION;
         min_pos_args = 0;
         max_pos_args = 0;
         opt_command = VERSION;
+    } else if (str_prefix(HICOLOR_CLI_CMD_VERIFY, argv[i])) {
+        command_name = HICOLOR_CLI_CMD_VERIFY;
+        opt_command = VERIFY;
     } else if (str_prefix(HICOLOR_CLI_CMD_HELP, argv[i])) {
         allow_opts = false;
         command_name = HICOLOR_CLI_CMD_HELP;
@@ -674,21 +5351,211 @@ int main(
             if (strcmp(argv[i], "--") == 0) {
                 i++;
                 break;
+            } else if (opt_command == DECODE
+                && strcmp(argv[i], "-F") != 0
+                && strcmp(argv[i], "--format") != 0
+                && strcmp(argv[i], "-j") != 0
+                && strcmp(argv[i], "--jobs") != 0
+                && strcmp(argv[i], "--max-memory") != 0
+                && strcmp(argv[i], "--trace") != 0) {
+                /* Only the output format, threads, the memory limit,
+                 * and tracing apply to decoding.
+                 */
+                usage(stderr);
+                fprintf(
+                    stderr,
+                    "\n" HICOLOR_CLI_ERROR "unknown option \"%s\"\n",
+                    argv[i]
+                );
+                return 1;
             } else if (strcmp(argv[i], "-5") == 0
                 || strcmp(argv[i], "--15-bit") == 0) {
-                opt_version = HICOLOR_VERSION_5;
+                opts.version = HICOLOR_VERSION_5;
             } else if (strcmp(argv[i], "-6") == 0
                 || strcmp(argv[i], "--16-bit") == 0) {
-                opt_version = HICOLOR_VERSION_6;
+                opts.version = HICOLOR_VERSION_6;
+            } else if (strcmp(argv[i], "-A") == 0
+                || strcmp(argv[i], "--alpha") == 0) {
+                opts.version = HICOLOR_VERSION_A;
+            } else if (strcmp(argv[i], "-t") == 0
+                || strcmp(argv[i], "--alpha-threshold") == 0) {
+                char* end = NULL;
+                long threshold = -1;
+                if (i + 1 < argc) {
+                    threshold = strtol(argv[i + 1], &end, 10);
+                }
+                if (end == NULL
+                    || *end != '\0'
+                    || threshold < 0
+                    || threshold > 255) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires an alpha threshold from 0 to 255\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                opts.alpha_threshold = threshold;
+                i++;
             } else if (strcmp(argv[i], "-a") == 0
                 || strcmp(argv[i], "--a-dither") == 0) {
-                opt_dither = HICOLOR_A_DITHER;
+                opts.dither = HICOLOR_A_DITHER;
             } else if (strcmp(argv[i], "-b") == 0
                 || strcmp(argv[i], "--bayer") == 0) {
-                opt_dither = HICOLOR_BAYER;
+                opts.dither = HICOLOR_BAYER;
+            } else if (strcmp(argv[i], "-B") == 0
+                || strcmp(argv[i], "--blue-noise") == 0) {
+                opts.dither = HICOLOR_BLUE_NOISE;
+            } else if (strcmp(argv[i], "-f") == 0
+                || strcmp(argv[i], "--floyd") == 0) {
+                opts.dither = HICOLOR_FLOYD_STEINBERG;
             } else if (strcmp(argv[i], "-n") == 0
                 || strcmp(argv[i], "--no-dither") == 0) {
-                opt_dither = HICOLOR_NO_DITHER;
+                opts.dither = HICOLOR_NO_DITHER;
+            } else if (strcmp(argv[i], "-x") == 0
+                || strcmp(argv[i], "--skip-exact") == 0) {
+                opts.skip_exact = true;
+            } else if (strcmp(argv[i], "-r") == 0
+                || strcmp(argv[i], "--resize") == 0) {
+                int width, height;
+                if (i + 1 == argc || !parse_size(argv[i + 1], &width, &height)) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a size like 640x480\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                opts.resize_width = width;
+                opts.resize_height = height;
+                i++;
+            } else if (strcmp(argv[i], "-s") == 0
+                || strcmp(argv[i], "--size") == 0) {
+                if (i + 1 == argc || !parse_size(
+                    argv[i + 1],
+                    &opts.image.width,
+                    &opts.image.height
+                )) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a size like 640x480\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                i++;
+            } else if (strcmp(argv[i], "-F") == 0
+                || strcmp(argv[i], "--format") == 0) {
+                opts.image.format = IMAGE_AUTO;
+                for (int f = IMAGE_PNG; f <= IMAGE_RGBA && i + 1 < argc; f++) {
+                    if (strcmp(argv[i + 1], image_format_extensions[f]) == 0) {
+                        opts.image.format = f;
+                    }
+                }
+                if (opts.image.format == IMAGE_AUTO) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a format (png, ppm, pam, rgb, or rgba)\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                i++;
+            } else if (strcmp(argv[i], "-p") == 0
+                || strcmp(argv[i], "--pyramid") == 0) {
+                opts.pyramid = true;
+            } else if (strcmp(argv[i], "-c") == 0
+                || strcmp(argv[i], "--checksum") == 0) {
+                opts.checksum = true;
+            } else if (strcmp(argv[i], "-i") == 0
+                || strcmp(argv[i], "--indexed") == 0) {
+                opts.indexed = true;
+            } else if (strcmp(argv[i], "-m") == 0
+                || strcmp(argv[i], "--manifest") == 0) {
+                if (i + 1 == argc) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a file name\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                opt_manifest = argv[i + 1];
+                i++;
+            } else if (strcmp(argv[i], "--max-memory") == 0) {
+                if (i + 1 == argc
+                    || !parse_memory(argv[i + 1], &opts.max_memory)) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a number of bytes like 512M\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                i++;
+            } else if (strcmp(argv[i], "--trace") == 0) {
+                if (i + 1 == argc) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a file name\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                opt_trace = argv[i + 1];
+                i++;
+            } else if (strcmp(argv[i], "--batch") == 0) {
+                opt_batch = true;
+            } else if (strcmp(argv[i], "--io-uring") == 0) {
+                opt_io_uring = true;
+            } else if (opt_command == PACK
+                && (strcmp(argv[i], "-k") == 0
+                    || strcmp(argv[i], "--keyframes") == 0)) {
+                /* Other commands report it as unknown below. */
+                char* end = NULL;
+                if (i + 1 < argc) {
+                    opt_keyframes = strtol(argv[i + 1], &end, 10);
+                }
+                if (end == NULL
+                    || *end != '\0'
+                    || opt_keyframes < 0
+                    || opt_keyframes > INT32_MAX) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a keyframe interval\n",
+                        argv[i]
+                    );
+                    return 1;
+                }
+                i++;
+            } else if (strcmp(argv[i], "-j") == 0
+                || strcmp(argv[i], "--jobs") == 0) {
+                char* end = NULL;
+                if (i + 1 < argc) {
+                    opts.jobs = strtol(argv[i + 1], &end, 10);
+                }
+                if (end == NULL
+                    || *end != '\0'
+                    || opts.jobs < 1
+                    || opts.jobs > HICOLOR_CLI_MAX_JOBS) {
+                    usage(stderr);
+                    fprintf(
+                        stderr,
+                        "\n" HICOLOR_CLI_ERROR "option \"%s\" requires a number of jobs from 1 to %i\n",
+                        argv[i],
+                        HICOLOR_CLI_MAX_JOBS
+                    );
+                    return 1;
+                }
+                i++;
             } else {
                 usage(stderr);
                 fprintf(
@@ -705,6 +5572,54 @@ int main(
 
     int rem_args = argc - i;
 
+    if (opts.resize_width > 0 && (opts.skip_exact || opts.pyramid)) {
+        usage(stderr);
+        fprintf(
+            stderr,
+            "\n" HICOLOR_CLI_ERROR "option \"--resize\" can't be combined with \"--skip-exact\" or \"--pyramid\"\n"
+        );
+        return 1;
+    }
+
+    /* Indexed images have no chunks and need the whole image. */
+    if (opt_command == ENCODE
+        && opts.indexed
+        && (opts.resize_width > 0 || opts.pyramid || opts.checksum)) {
+        usage(stderr);
+        fprintf(
+            stderr,
+            "\n" HICOLOR_CLI_ERROR "option \"--indexed\" can't be combined with \"--resize\", \"--pyramid\", or \"--checksum\"\n"
+        );
+        return 1;
+    }
+
+    /* The pyramid and palettes have no alpha. */
+    if (opt_command == ENCODE
+        && opts.version == HICOLOR_VERSION_A
+        && (opts.pyramid || opts.indexed)) {
+        usage(stderr);
+        fprintf(
+            stderr,
+            "\n" HICOLOR_CLI_ERROR "option \"--alpha\" can't be combined with \"--pyramid\" or \"--indexed\"\n"
+        );
+        return 1;
+    }
+
+    if (opt_command == CONVERT && opts.dither == HICOLOR_FLOYD_STEINBERG) {
+        usage(stderr);
+        fprintf(
+            stderr,
+            "\n" HICOLOR_CLI_ERROR "command \"convert\" can't use error diffusion\n"
+        );
+        return 1;
+    }
+
+    if ((opt_batch && (opt_command == ENCODE || opt_command == QUANTIZE))
+        || opt_command == PACK
+        || opt_command == VERIFY) {
+        max_pos_args = rem_args;
+    }
+
     if (rem_args < min_pos_args) {
         usage(stderr);
         fprintf(
@@ -725,19 +5640,68 @@ int main(
         return 1;
     }
 
+    if (opt_trace != NULL && !trace_open(opt_trace)) {
+        fprintf(
+            stderr,
+            HICOLOR_CLI_ERROR "can't open trace file \"%s\" for writing\n",
+            opt_trace
+        );
+        return 1;
+    }
+
+    if ((opt_command == ENCODE || opt_command == QUANTIZE)
+        && (opt_batch || opt_manifest != NULL)) {
+        return !convert_files(
+            opt_command == ENCODE,
+            &opts,
+            opt_manifest,
+            opt_batch,
+            opt_io_uring,
+            &argv[i],
+            rem_args
+        );
+    }
+
+    if (opt_command == VERIFY) {
+        return !verify_files(opts.jobs, opt_io_uring, &argv[i], rem_args);
+    }
+
+    if (opt_command == PACK) {
+        return !pack_sequence(
+            opt_keyframes,
+            &argv[i],
+            rem_args - 1,
+            argv[argc - 1]
+        );
+    }
+
     arg_src = argv[i];
     i++;
 
+    if (opt_command == CONVERT) {
+        return !convert_hicolor(&opts, arg_src, i == argc ? NULL : argv[i]);
+    }
+
+    if (opt_command == UNPACK) {
+        char* prefix = i == argc ? NULL : argv[i];
+        if (prefix == NULL) {
+            prefix = malloc(strlen(arg_src) + 2);
+            if (prefix == NULL) {
+                fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
+                return HICOLOR_CLI_NO_MEMORY_EXIT_CODE;
+            }
+            sprintf(prefix, "%s.", arg_src);
+        }
+
+        return !unpack_sequence(opts.jobs, arg_src, prefix);
+    }
+
     if (i == argc) {
-        arg_dest = malloc(strlen(arg_src) + 5);
+        arg_dest = default_dest(opt_command == ENCODE, &opts.image, arg_src);
         if (arg_dest == NULL) {
+            fprintf(stderr, HICOLOR_CLI_ERROR "failed to allocate memory\n");
             return HICOLOR_CLI_NO_MEMORY_EXIT_CODE;
         }
-        sprintf(
-            arg_dest,
-            opt_command == ENCODE ? "%s.hic" : "%s.png",
-            arg_src
-        );
     } else {
         arg_dest = argv[i];
     }
@@ -745,18 +5709,30 @@ int main(
 
     switch (opt_command) {
     case ENCODE:
-        return !png_to_hicolor(opt_version, opt_dither, arg_src, arg_dest);
+        return !image_to_hicolor(&opts, arg_src, arg_dest);
     case DECODE:
-        return !hicolor_to_png(arg_src, arg_dest);
+        return !hicolor_to_image(
+            &opts.image,
+            opts.max_memory,
+            opts.jobs,
+            arg_src,
+            arg_dest
+        );
     case QUANTIZE:
-        return !png_quantize(opt_version, opt_dither, arg_src, arg_dest);
+        return !quantize_image(&opts, arg_src, arg_dest);
     case INFO:
         return !hicolor_print_info(arg_src);
+    case COMPARE:
+        return !compare_images(opts.jobs, arg_src, arg_dest);
     case VERSION:
         version(true);
         return 0;
     case HELP:
         help();
         return 0;
+    default:
+        /* The other commands have returned above. */
+        assert(false);
+        return 1;
     }
 }
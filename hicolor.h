@@ -17,13 +17,43 @@
 #include <math.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 #define HICOLOR_BAYER_SIZE 8
+#define HICOLOR_BLUE_NOISE_SIZE 64
+#define HICOLOR_HEADER_SIZE 12
+#define HICOLOR_SEQUENCE_HEADER_SIZE 25
+#define HICOLOR_SEQUENCE_ENTRY_SIZE 9
+#define HICOLOR_INDEXED_HEADER_SIZE 15
+#define HICOLOR_PALETTE_MAX 4096
+#define HICOLOR_PALETTE_MAX_8_BIT 256
+#define HICOLOR_CHUNK_HEADER_SIZE 12
+#define HICOLOR_PYRAMID_MIN_SIZE 32
+#define HICOLOR_PYRAMID_MAX_LEVELS 16
+#define HICOLOR_IO_CHUNK_SIZE 4096
+#define HICOLOR_ARENA_ALIGNMENT 64
+#define HICOLOR_CONTEXT_ARENAS 4
+#define HICOLOR_PLAN_BAND_ROWS 16
+#define HICOLOR_PROGRESS_ROWS 64
+#define HICOLOR_CHECKSUM_SIZE 4
+#define HICOLOR_CHECKSUM_BUFFER_SIZE 262144
+#define HICOLOR_SSIM_WINDOW 8
+#define HICOLOR_ALPHA_THRESHOLD 128
 #define HICOLOR_LIBRARY_VERSION 10001
 
 /* Types. */
 
-static const uint8_t hicolor_magic[7] = "HiColor";
+/* Brace-initialized so that the header also compiles as C++. */
+static const uint8_t hicolor_magic[7] = {'H', 'i', 'C', 'o', 'l', 'o', 'r'};
+static const uint8_t hicolor_sequence_char = 'S';
+static const uint8_t hicolor_indexed_char = 'I';
+static const uint8_t hicolor_pyramid_tag[4] = {'M', 'I', 'P', 'S'};
+static const uint8_t hicolor_checksum_tag[4] = {'C', 'R', 'C', 'C'};
 
 /* These arrays are generated with `scripts/conversion-tables.tcl`. */
 static const uint8_t hicolor_256_to_32[] = {
@@ -88,9 +118,325 @@ static const double hicolor_bayer[HICOLOR_BAYER_SIZE * HICOLOR_BAYER_SIZE] = {
     42.0/64, 26.0/64, 38.0/64, 22.0/64, 41.0/64, 25.0/64, 37.0/64, 21.0/64
 };
 
+/* CRC-32C for CPUs without CRC instructions.
+ * The values in this array are the output of `scripts/crc32c-table.tcl`.
+ */
+static const uint32_t hicolor_crc32c_table[256] = {
+    0x00000000, 0xf26b8303, 0xe13b70f7, 0x1350f3f4, 0xc79a971f, 0x35f1141c,
+    0x26a1e7e8, 0xd4ca64eb, 0x8ad958cf, 0x78b2dbcc, 0x6be22838, 0x9989ab3b,
+    0x4d43cfd0, 0xbf284cd3, 0xac78bf27, 0x5e133c24, 0x105ec76f, 0xe235446c,
+    0xf165b798, 0x030e349b, 0xd7c45070, 0x25afd373, 0x36ff2087, 0xc494a384,
+    0x9a879fa0, 0x68ec1ca3, 0x7bbcef57, 0x89d76c54, 0x5d1d08bf, 0xaf768bbc,
+    0xbc267848, 0x4e4dfb4b, 0x20bd8ede, 0xd2d60ddd, 0xc186fe29, 0x33ed7d2a,
+    0xe72719c1, 0x154c9ac2, 0x061c6936, 0xf477ea35, 0xaa64d611, 0x580f5512,
+    0x4b5fa6e6, 0xb93425e5, 0x6dfe410e, 0x9f95c20d, 0x8cc531f9, 0x7eaeb2fa,
+    0x30e349b1, 0xc288cab2, 0xd1d83946, 0x23b3ba45, 0xf779deae, 0x05125dad,
+    0x1642ae59, 0xe4292d5a, 0xba3a117e, 0x4851927d, 0x5b016189, 0xa96ae28a,
+    0x7da08661, 0x8fcb0562, 0x9c9bf696, 0x6ef07595, 0x417b1dbc, 0xb3109ebf,
+    0xa0406d4b, 0x522bee48, 0x86e18aa3, 0x748a09a0, 0x67dafa54, 0x95b17957,
+    0xcba24573, 0x39c9c670, 0x2a993584, 0xd8f2b687, 0x0c38d26c, 0xfe53516f,
+    0xed03a29b, 0x1f682198, 0x5125dad3, 0xa34e59d0, 0xb01eaa24, 0x42752927,
+    0x96bf4dcc, 0x64d4cecf, 0x77843d3b, 0x85efbe38, 0xdbfc821c, 0x2997011f,
+    0x3ac7f2eb, 0xc8ac71e8, 0x1c661503, 0xee0d9600, 0xfd5d65f4, 0x0f36e6f7,
+    0x61c69362, 0x93ad1061, 0x80fde395, 0x72966096, 0xa65c047d, 0x5437877e,
+    0x4767748a, 0xb50cf789, 0xeb1fcbad, 0x197448ae, 0x0a24bb5a, 0xf84f3859,
+    0x2c855cb2, 0xdeeedfb1, 0xcdbe2c45, 0x3fd5af46, 0x7198540d, 0x83f3d70e,
+    0x90a324fa, 0x62c8a7f9, 0xb602c312, 0x44694011, 0x5739b3e5, 0xa55230e6,
+    0xfb410cc2, 0x092a8fc1, 0x1a7a7c35, 0xe811ff36, 0x3cdb9bdd, 0xceb018de,
+    0xdde0eb2a, 0x2f8b6829, 0x82f63b78, 0x709db87b, 0x63cd4b8f, 0x91a6c88c,
+    0x456cac67, 0xb7072f64, 0xa457dc90, 0x563c5f93, 0x082f63b7, 0xfa44e0b4,
+    0xe9141340, 0x1b7f9043, 0xcfb5f4a8, 0x3dde77ab, 0x2e8e845f, 0xdce5075c,
+    0x92a8fc17, 0x60c37f14, 0x73938ce0, 0x81f80fe3, 0x55326b08, 0xa759e80b,
+    0xb4091bff, 0x466298fc, 0x1871a4d8, 0xea1a27db, 0xf94ad42f, 0x0b21572c,
+    0xdfeb33c7, 0x2d80b0c4, 0x3ed04330, 0xccbbc033, 0xa24bb5a6, 0x502036a5,
+    0x4370c551, 0xb11b4652, 0x65d122b9, 0x97baa1ba, 0x84ea524e, 0x7681d14d,
+    0x2892ed69, 0xdaf96e6a, 0xc9a99d9e, 0x3bc21e9d, 0xef087a76, 0x1d63f975,
+    0x0e330a81, 0xfc588982, 0xb21572c9, 0x407ef1ca, 0x532e023e, 0xa145813d,
+    0x758fe5d6, 0x87e466d5, 0x94b49521, 0x66df1622, 0x38cc2a06, 0xcaa7a905,
+    0xd9f75af1, 0x2b9cd9f2, 0xff56bd19, 0x0d3d3e1a, 0x1e6dcdee, 0xec064eed,
+    0xc38d26c4, 0x31e6a5c7, 0x22b65633, 0xd0ddd530, 0x0417b1db, 0xf67c32d8,
+    0xe52cc12c, 0x1747422f, 0x49547e0b, 0xbb3ffd08, 0xa86f0efc, 0x5a048dff,
+    0x8ecee914, 0x7ca56a17, 0x6ff599e3, 0x9d9e1ae0, 0xd3d3e1ab, 0x21b862a8,
+    0x32e8915c, 0xc083125f, 0x144976b4, 0xe622f5b7, 0xf5720643, 0x07198540,
+    0x590ab964, 0xab613a67, 0xb831c993, 0x4a5a4a90, 0x9e902e7b, 0x6cfbad78,
+    0x7fab5e8c, 0x8dc0dd8f, 0xe330a81a, 0x115b2b19, 0x020bd8ed, 0xf0605bee,
+    0x24aa3f05, 0xd6c1bc06, 0xc5914ff2, 0x37faccf1, 0x69e9f0d5, 0x9b8273d6,
+    0x88d28022, 0x7ab90321, 0xae7367ca, 0x5c18e4c9, 0x4f48173d, 0xbd23943e,
+    0xf36e6f75, 0x0105ec76, 0x12551f82, 0xe03e9c81, 0x34f4f86a, 0xc69f7b69,
+    0xd5cf889d, 0x27a40b9e, 0x79b737ba, 0x8bdcb4b9, 0x988c474d, 0x6ae7c44e,
+    0xbe2da0a5, 0x4c4623a6, 0x5f16d052, 0xad7d5351
+};
+
+/* A tileable blue-noise threshold matrix.
+ * The values in this array are the output of `scripts/blue-noise.tcl`.
+ */
+static const uint8_t hicolor_blue_noise[
+    HICOLOR_BLUE_NOISE_SIZE * HICOLOR_BLUE_NOISE_SIZE
+] = {     40, 183, 154,   3, 138,  28,  94,  55, 155, 238, 176, 144,  43, 222, 129,  52,
+    213,   4, 165, 254, 180, 104, 169, 130, 247,  20,  85, 139, 182,  98, 158,  15,
+    170, 212, 124, 193,  66, 177,   3,  75, 253, 173,   8, 117, 247,  90,  10, 208,
+    104, 133,  29,  61, 128, 101, 190, 121, 249, 171,  66, 192, 231,   1,  90, 127,
+     13,  76, 117,  54, 195,  72, 245, 204, 108,  38, 214, 120,  75, 183, 103, 170,
+     76, 230, 121,  82,  47, 202,  11,  63,  99, 156, 199,  57,  26, 207,  41, 222,
+     70,  49, 153, 237,  44, 214, 159, 119,  54, 202,  98, 166,  56, 149, 229,  39,
+     76, 238, 167, 200,  17, 174,  72,   4, 211, 103,  15, 122,  38, 157,  58, 220,
+    137, 246, 211, 163, 225, 119, 171,   6, 188, 136,  18,  96, 232,  11, 247,  28,
+    150,  42, 194,  22, 224, 116, 144, 235, 181,  43, 224, 111, 243, 147,  86, 179,
+    116, 246,  20,  99, 134,  31,  89, 223, 144,  35,  71, 225,  19, 200, 108, 140,
+    192,   8,  87, 112, 251,  40, 232, 160,  36, 139, 237, 166,  80, 255, 110, 171,
+     66,  93,  20,  40, 100,  23, 145,  50,  81, 253,  63, 179, 157,  50, 135, 196,
+     89, 239, 140,  99, 160,  57, 210,  31,  79, 128,   5, 168,  72, 123, 232,   3,
+    140,  81, 182, 207,  73, 232, 189,  14, 107, 244, 157, 122,  82, 175,  26, 254,
+     62, 155, 221,  50, 149, 133,  96, 204,  63,  86, 197,  53, 205, 142,  25, 194,
+    233, 203, 146, 185, 250,  65, 207, 233, 102, 153, 218,  27, 202, 111,  68, 217,
+    116,  14,  66, 181, 247,   0,  93, 188, 153, 251,  95, 190,  47,  25, 196,  57,
+    217,  38, 146,   7, 169, 111, 150,  60, 178,  22, 208,  46, 241, 132,  53,  94,
+    181, 121,  32, 205,  77, 190,  25, 122, 225, 156,  27, 114,   6, 226,  98,  44,
+     10, 110,  59, 124,  86, 168, 131,  14, 174,  39, 125,  89, 141, 235,   2, 166,
+     44, 154, 219,  36,  76, 136, 230, 119,  18,  59, 216, 134, 237, 155, 106, 168,
+     95, 190, 118, 253,  52,  28, 239,  84, 219, 138,  92, 191,   0, 219, 161, 207,
+     15, 235,  97, 172,   0, 229,  57, 175,   9, 106, 249, 171, 132,  57, 180, 154,
+     77, 164, 220,   2, 202,  31, 111, 214,  69, 195,  10, 246,  46,  78, 187, 100,
+    253, 191, 126, 102, 204, 168,  40,  70, 205, 169,  34,  86,  12, 211,  76, 244,
+     13, 229,  61,  88, 212, 132, 193,   4, 118,  37,  69, 150, 104,  66, 115,  37,
+    147,  72, 138, 245, 118, 151,  91, 241, 142,  47, 190,  71, 217,  86, 238, 125,
+    252, 190,  46, 236, 152,  54, 242,  89, 142, 229, 109, 183, 157, 209,  33, 133,
+     59,  83,   7, 235,  26, 111, 194, 141, 240, 106, 147, 183, 116,  51, 139,  35,
+    129, 162,  26, 149, 177,  99,  67, 164, 251, 200, 174, 236,  30, 185, 247,  80,
+    225, 191,  51,  29,  67, 216,  38, 197,  76, 213,  96,  36, 149,  17, 200,  33,
+    139,  23,  93, 134,  75, 173, 189,  21,  48, 163,  62,  85,  19, 117, 226, 174,
+     20, 212, 166, 142,  62, 249,  13,  88,  50,   7, 223,  63, 252, 165, 193, 219,
+     66, 110, 198, 226,  12,  40, 220, 143,  49, 100,  10, 122, 214, 143,  12, 172,
+    124,   8, 162, 199, 106, 169, 130,  22, 117, 165,  11, 244, 177, 119,  52, 103,
+     70, 178, 214, 115,  13, 222, 102, 128, 255,   2, 220, 136, 237,  56, 148,  89,
+    243, 113,  49, 197,  95, 177, 151, 217, 186, 129,  81, 201,  22,  98,   0,  87,
+    181, 249,  47,  74, 127, 244, 113,  17,  80, 229, 161,  60,  86,  47,  96, 204,
+     59, 108, 249,  82, 227,  10, 186, 254,  49, 225, 135, 105,  68, 233, 162, 222,
+     15, 156,  56, 248, 146,  39,  65, 157, 201, 115, 186,  33, 169, 105,   5, 199,
+     68, 152,  28, 224, 130,  39,  71, 118,  28, 246, 172,  41, 154, 126, 238,  43,
+    148,  16, 100, 142, 194,  85, 171, 210, 184, 134,  21, 248, 196, 169, 128, 239,
+     34, 213, 136,  24, 145,  57, 100,  70, 147,  84, 202,  43, 191,   1,  89, 187,
+    239, 109,  30, 195,  88, 206, 237,  26,  79,  54,  96, 214,  75, 251, 183,  39,
+    129, 231, 182,  85,   2, 201, 233, 167,  97,  58, 143, 110, 232,  73, 208, 168,
+    122, 203, 236, 173,   4,  54, 152,  31,  66, 218, 109, 147,  32, 225,  18, 154,
+     74, 180,  95,  46, 192, 237, 163, 211,   4, 179,  25, 230, 123, 151,  38, 126,
+    215,  85, 136, 163,   4, 114, 170, 133, 218, 178, 150,  11, 124,  50, 139, 210,
+     98,  13,  63, 123, 255, 142,  53,  16, 223, 198,   4, 217,  29, 178,  56, 106,
+     30,  81,  61,  37, 228, 207, 101, 254, 123,  44,  89, 182,  71, 105,  54, 193,
+    118,   2, 221, 160, 112,  79,  27, 120, 241, 102, 158,  56,  81, 245, 204,  60,
+      7, 181,  43, 235,  74, 184,  47,  99,  14, 240,  42, 197, 230, 162,  23,  81,
+    244, 156, 205, 169,  31, 107, 190,  82, 136, 106,  71, 185,  90, 136,   9, 255,
+    188, 220, 134, 160, 116,  73, 137,   9, 169, 201, 231,   2, 242, 141, 219,  90,
+    253, 148,  68, 243,  15, 206, 140,  47, 194,  67, 132, 215, 174,  21, 100, 142,
+    253,  67, 199, 121, 217,  20, 251, 154,  63, 114, 140,  88,  61, 104, 223, 172,
+     33, 113,  49,  92, 217,  68, 242, 162,  38, 238, 151,  49, 244, 160, 213,  70,
+    151,  12, 101, 246,  24, 191,  48, 215,  80,  27, 156,  58, 117, 165,  15, 175,
+     32,  51, 201, 125,  39, 176, 232,  90, 168,  30, 250,   7, 114, 197,  45, 168,
+     87, 153,  25,  97,  55, 142,  86, 194, 227, 172,  26, 244, 185,   5, 123,  66,
+    195, 141, 235,   6, 183, 145,  18, 121, 177,  13, 205, 127,  22, 113,  40,  95,
+    125, 182,  47, 205,  85, 167, 234, 148, 104, 192, 133,  92, 207,  41,  81, 211,
+    137, 101, 182,  80, 153,  99,  64,   9, 222, 146,  96,  51, 156,  71, 227, 118,
+     15, 230, 131, 245, 161, 205,  37, 111,   1,  79, 208, 130,  39, 216, 152, 251,
+     13,  77, 213, 125,  40,  98, 228,  50, 196,  65,  96, 224,  77, 173, 232, 198,
+     27, 241,  68, 144,   2, 119,  32,  67, 221,  45, 239,  19, 172, 247, 127,  65,
+    231,  21, 238,   7, 209, 252, 133, 198, 114,  73, 204, 183, 238, 137,  30, 206,
+    189, 107,  41, 180,   7,  70, 241, 137, 188,  53, 159, 108,  71, 178,  88,  50,
+    180, 102, 163,  61, 248, 160, 206,  83, 112, 252, 169,  44, 193,   1, 134,  54,
+    165,  91, 226, 176, 102, 251, 186, 132,  16, 114, 183,  67, 143, 100,   9, 187,
+    158, 116, 167,  61, 119,  29,  52, 177,  20, 235,  37, 108,  13,  88, 174,  57,
+     81, 219,  68, 212,  92, 123, 176,  21, 224,  93, 254,  11, 234, 141,  27, 118,
+    237,  36, 199,  22, 139,  71,  26, 133,   6, 149,  29, 140, 107, 247,  86, 218,
+    116,  14, 131,  30, 217,  49, 152,  91, 244, 161,  82, 217,  35, 229, 201,  48,
+     84,  31, 219,  93, 185, 147, 215,  92, 157, 122, 171,  64, 219, 124, 247, 147,
+      1, 167, 135,  28, 155, 233,  55, 104, 166,  33, 145, 191,  48, 100, 212, 194,
+    153, 129,  84, 233, 113, 187, 222, 170, 236, 200,  90, 213,  60, 155,  25, 186,
+     72, 207, 158,  60, 193,  80,   9, 208,  56, 198,   3, 122, 176,  61, 135, 111,
+    250, 144, 199,  44, 243,  76,   4, 229,  61,  28, 253, 141, 196,  45,  25, 111,
+    231,  49, 255, 112, 197,  40, 210,  75, 131, 215,  64, 120, 168, 227,   3,  74,
+     58,  16, 214, 167,   0,  52,  97,  37,  76,  53, 124,  11, 228, 178,  46, 234,
+    146,  42, 248,  93, 125, 164, 234, 111, 138,  34, 151, 254,  91,  18, 163, 208,
+      1,  69, 109,  14, 129, 166, 112, 181, 133, 207,  97,   5,  77, 156, 211, 185,
+    128,  88, 188,  16,  78, 146,   8, 186, 243,  13,  89, 205,  21,  83, 158, 114,
+    250, 174, 100,  67, 145, 254, 203, 115, 156, 186, 246, 152,  78, 112, 131,  89,
+      5, 107, 178,  12, 226,  28,  46, 180,  75, 228, 103,  45, 193, 237,  74,  42,
+    173, 230, 153, 190, 223,  59,  36, 245,  83,  48, 150, 184, 117, 234,  93,  64,
+    150,  35, 161, 221, 101, 236, 119, 158,  38, 111, 177, 247,  40, 132, 234, 191,
+     37, 137, 229,  42, 180,  78, 132,  10, 220,  24, 105,  41, 205,  18, 254, 197,
+    164, 215,  69, 141, 202, 104, 133, 249,  11, 171, 214,  69, 128, 148, 105, 216,
+    124,  85,  55,  27,  94, 206, 148,  19, 189, 222,  24, 241,  57,  31, 176,  10,
+    201, 228,  66, 137,  48, 195,  62,  87, 221, 142,  54, 153, 105, 182,  56,  14,
+     89, 208,  19, 115, 197,  27, 233, 173,  67, 138,  84, 223, 166,  69, 145,  54,
+     31, 123, 233,  51,  84, 169,  64, 197,  96, 122,  27, 185,   6, 224,  30, 188,
+     16, 240, 162, 121, 255,  72, 173, 101, 124,  65, 164, 105, 200, 143, 120, 246,
+    105,  21, 116, 183,   3, 164, 251,  21, 181,  73, 236,  26, 217,  70, 148, 221,
+    126, 164,  77, 245, 154,  91,  50, 101, 206, 238, 179,   4, 127, 191,  99, 222,
+     80, 180,  16, 154, 245,  19, 221,  35, 151,  51, 163, 244,  90,  54, 159,  93,
+    142,  46, 204, 178,   9, 136,  45, 238,   1, 203, 132,  75,  14, 220,  41,  79,
+     57, 167, 248,  92, 214,  37, 109, 135, 208,   9, 126,  97, 200,   5, 249, 108,
+     43, 189,  55, 138,   6, 218, 125, 161,  32,  48, 119,  62, 243,  44,  20, 155,
+    241, 104, 205,  39, 118, 185, 139,  80, 232, 203,  73, 138, 114, 201, 252,  67,
+    223, 108,  78,  35, 103, 216, 194, 159,  88, 226,  37, 252, 180,  92, 163, 193,
+    144, 209,  41, 130,  76, 148, 229,  53, 100, 157, 190,  48, 164, 129,  84, 171,
+     23, 236, 103, 205,  71, 177, 243,  16, 193, 152,  95, 218, 158, 111, 213, 128,
+      2,  58, 136,  87, 218,  57,  99,   0, 175, 106,  17, 214,  32, 175,  13, 125,
+    182,   2, 246, 150, 231,  65,  25, 118,  56, 174,  99, 151,  53, 127, 240,   4,
+    224,  73,  14, 192, 240,  23, 186,  80, 221,  40, 250,  82, 228,  31, 194,  53,
+    212, 134,  16, 170,  38, 112,  55,  80, 134, 252,  13, 196,  29,  86, 175,  73,
+    200, 163, 250, 175,  14, 159, 206, 253, 126,  41, 238, 157,  61,  85, 146,  44,
+    214, 161, 120,  51, 184, 128,  83, 245, 143,  29, 198,   7, 210,  70,  32, 113,
+     93, 135, 171, 111,  46, 162, 122,   6, 173, 138,  17, 119,  60, 149, 240, 117,
+     74, 158,  86, 253, 215, 145, 197, 231, 109,  51, 173,  70, 143, 248,  50, 232,
+     36, 113,  23,  67, 232, 114,  29, 150,  65, 192,  93, 129, 227, 198, 241,  99,
+     63,  30, 196,  95,  17, 167, 206,   8, 185,  75, 236, 109, 140, 227, 187, 157,
+     20,  54, 236, 213,  67,  98, 201, 231,  63, 106, 206, 179, 219,  11,  99, 184,
+      3, 220,  49, 123,  25,  95,   1, 164,  31, 216,  93, 129, 207,  19, 120, 148,
+    189,  83, 216, 145,  92, 199,  47,  83, 223,  12, 170,  49,   4, 108,  24, 167,
+    232, 144,  80, 240, 218,  45, 147, 101, 217, 127,  46, 168,  20,  83,  45, 253,
+    208, 184,  85,   2, 144, 255,  38,  90, 152, 240,  34,  93, 136,  77, 167,  40,
+    247, 140, 194, 164,  71, 180, 223,  65, 141, 186,   7, 230,  60, 184, 100,  10,
+    221, 130,  49, 185,   5, 126, 239, 165, 107, 134, 247,  80, 179, 139, 191,  76,
+    117, 205,   8, 136, 113,  70, 251,  35,  61, 159,  90, 248, 204, 125, 175, 104,
+    140,  34, 159, 123, 190,  22, 171, 128,  16, 186,  58, 163,  22, 235, 210, 130,
+     67,  96,  20, 107, 241,  35, 128, 105, 247,  79, 156, 110,  33, 159, 234,  69,
+    170,  26, 107, 244, 158,  60, 182,  21, 210,  35, 197, 119, 219,  38, 255,  50,
+     20, 177,  58, 165,  28, 192, 125, 173, 233,  12, 189,  31,  59, 152,   5,  67,
+    114, 245,  60, 229, 106,  73, 210,  51, 226,  83, 122, 252, 188,  48, 112,  28,
+    203, 176, 232,  46, 203, 149, 191,  50,  21, 204,  46, 244, 124, 211,  88,  37,
+    253, 151, 195,  79,  36, 213,  98, 142,  76,  56, 156,  20,  68,  94, 160, 129,
+    226, 103, 248, 212,  97, 228,   1,  78, 108, 139, 223, 120,  96, 239, 187, 225,
+    166,  92,  10, 204,  40, 149, 239,  99, 157, 197,   1, 144, 103,  73, 157, 230,
+     87,   8, 145, 120,  80,   9,  90, 231, 170, 135,  97, 175,  74,   1, 141, 201,
+    101,  59,   8, 137, 234, 118,  10, 252, 177, 226, 102, 243, 143, 194,  11, 211,
+     82, 152,  38,  73, 147,  53, 182, 153, 208,  24,  71, 177, 211,  41,  83,  23,
+     45, 217, 134, 162,  88, 185,   7, 133,  33,  68, 221,  44, 208,  10, 194, 138,
+     55, 166, 216,  64, 248, 165, 210, 115,  73,   8, 218,  27, 193, 238,  53, 179,
+    127, 227, 207,  94, 170,  70, 200,  45,  90, 123,   3, 183,  35, 234, 109,  62,
+    181,   6, 131, 195,  17, 116, 240,  34,  94, 255,  48, 149,  17, 112, 145, 200,
+    125, 183,  72, 249,  26, 120,  59, 202, 247, 178, 118,  88, 171, 243, 119,  23,
+    255, 108,  35, 183,  20, 137,  58,  31, 188, 254, 149,  61, 130,  94, 164,  17,
+     78,  33, 154,  50,  23, 223, 130, 151,  28, 216, 162,  55,  83, 126, 172,  41,
+    236, 203,  94, 244, 158,  84, 200,  61, 130, 163, 195,  79, 228, 172, 250,  69,
+    234,  18, 110,  52, 195, 234, 159,  81, 105,  21, 149, 235,  29,  60,  95, 181,
+     76, 201, 130,  85, 220, 104, 238, 159, 126,  41, 108, 172, 223,  36, 116, 210,
+    242, 184, 114, 250, 189, 105,  60, 172, 196,  71, 237, 138, 198, 223,  22, 146,
+     78, 120,  27, 176,  45, 219, 137,  20, 226, 113,  11, 102, 133,  56,   0,  98,
+     38, 156, 224, 174, 139,  97,  16, 213, 168,  53, 204,  74, 136, 161, 224,  44,
+    154,   5, 229, 150,  47, 195,   0,  91, 225,  78, 211,  12,  82, 250, 147,  64,
+    102,  11, 135,  82, 160,   0, 244,  94,  16, 117,  39, 102,   9,  64,  93, 252,
+    165,  54, 231,  70, 110,   5, 171,  74, 186,  41, 206, 245,  30, 188, 215, 139,
+    202,  65,  91,   3,  42, 221,  72,  37, 137, 228,   5, 113, 191,  14, 203, 127,
+    237,  65,  98,  24, 169,  69, 132, 178,  22, 192,  51, 136, 199,  23, 186,  39,
+    170, 227,  60,  36, 210, 143,  42, 205, 232, 147, 188, 249, 156, 215, 184, 110,
+      3, 209, 148, 128, 189, 249,  97, 150, 239,  88, 170,  66, 157, 115,  82, 166,
+    113, 252, 135, 209, 116, 151, 180, 254, 115,  84, 174, 242,  51, 104,  81,  32,
+    109, 174, 194, 250, 113, 214, 242,  56, 152, 119, 245, 168, 101,  69, 127, 217,
+     88, 150, 193, 237, 114,  71, 179, 128,  58,  86,  24,  77, 120,  31, 138,  44,
+    193,  87,  25, 221,  33,  57, 208,  24,  52, 125,   5, 139, 222,  44, 241,  10,
+     55,  29, 186,  77, 240,  57, 101,   8, 198,  62, 149,  36, 219, 169, 251, 142,
+    216,  18,  52, 134,  35,  83,  18, 105, 230,  34,  89,   3, 222, 155, 239,  16,
+     52, 107,   7, 172,  25, 223, 101,  12, 165, 220, 177, 207,  56, 171, 234,  72,
+    124, 242, 174, 102,  75, 165, 133, 113, 176, 212, 233,  98,  19, 199,  71, 181,
+    211, 121, 160,  15, 193,  28, 163, 231, 130,  24, 210,  96, 131,  66,   1, 182,
+     73, 156,  93, 209, 160, 187, 137, 206, 170,  66, 146, 187,  57,  33, 114, 178,
+    200, 246, 126,  86, 140,  52, 198, 255,  36,  97, 131,   2, 242,  89,  12, 206,
+    158,  57,  13, 144, 197, 227,   9, 246,  65,  31, 148,  77, 174, 131, 103, 151,
+     91, 230,  45, 103, 140, 220,  87,  42, 185, 106, 245,  15, 158, 205, 118,  45,
+    225, 124, 239,  68,   7, 245,  46,  78,   9, 199, 115, 233, 131, 209,  91,  70,
+    136,  34,  66, 207, 241, 161,  80, 121, 151, 230,  50, 161, 110, 146, 187, 101,
+     29, 215, 115, 254,  42,  94, 155,  82, 185, 104, 201,  52, 254,  36, 218,  22,
+    139,  71, 170, 247,  68, 123, 203, 143,  72, 161,  49, 191,  87,  34, 242,  98,
+    196,  12,  39, 178,  97, 121, 153, 226, 101, 251,  43,  79,  17, 162, 254,   5,
+    157, 226, 176,  17, 106,  39,   9, 187,  65,  18, 198,  75, 218,  26,  63, 230,
+    135,  83, 184,  67, 126,  22, 192,  45, 141, 239,  24, 162, 119, 189,  64, 242,
+    195,  33, 207,   8, 180,  49,  16, 249,  29, 227, 122,  69, 220, 175, 141,  59,
+    170, 150, 108, 228, 202,  30,  60, 181, 130,  27, 151, 177, 104, 197,  53, 120,
+    214,  97,  47, 147, 191, 229, 133, 215, 111, 245, 124, 180,  40, 253, 118, 170,
+     46, 238,   0, 168, 206, 235, 112, 219,   3, 123,  86, 225,  14,  81, 155,   1,
+    109,  84, 126, 154,  92, 225, 112, 172,  82, 204,   6, 152, 107,  12, 233,  26,
+     85, 255,  53, 136,  77, 162, 215,  17,  84, 192, 218,  64, 242,  34, 144, 187,
+     22,  77, 248, 119,  70,  92, 164,  45,  83, 157,  25,  94, 137, 196,  81,  19,
+    199, 148, 106,  31, 140,  73, 175,  58, 160, 205,  61, 184, 106, 237, 128, 178,
+    249, 215,  52, 234,  28, 193, 149,  55, 103, 135, 179, 252,  43, 129,  74, 203,
+    121, 213,  22, 175,   2, 248, 109, 143, 241,  47, 118,   4, 133,  87, 230,  62,
+    112, 199, 163,   2, 204,  29, 251, 182,   5, 222, 204,  51, 169,   4, 151, 224,
+     96,  62, 212, 246,  48, 101,  13, 242,  91,  34, 132, 152,  45, 212,  30,  57,
+    134,  17, 187, 102,  63, 129,   0, 241, 217,  23,  61,  92, 197, 227, 157, 181,
+     39, 147,  72, 195, 125,  91,  42, 204,  69, 168,  96, 190, 222, 167,  10, 179,
+    242,  34, 135, 233,  58, 150, 121,  63, 105, 141,  70, 232, 108, 241,  56, 128,
+     36, 182, 122,  81, 165, 225, 146, 117, 189, 215, 246,   6,  76, 192,  97, 164,
+     78,  42, 160, 138, 254, 207,  75, 182,  40, 155, 236, 120,  18,  54, 103,   4,
+     95, 234, 107, 218,  56, 230, 180,  10, 126, 229,  20, 148,  41,  69, 125,  95,
+    153,  55,  88, 181, 103, 224,  15, 201, 239,  37, 190, 124,  29,  86, 202, 162,
+    249,  21, 154,   7, 196,  29, 181,  43,  72,  21, 109, 176, 226, 123,  11, 232,
+    177, 112, 220,  12,  85,  34, 160,  95, 118, 201,  79, 167, 188, 145, 211, 248,
+     63, 172,  15, 155,  27, 134,  75, 153,  37, 199,  83, 253, 110, 212, 192,  19,
+    216, 127,  11, 211,  41,  75, 169, 133,  85, 175,  10, 155, 218, 183,  12, 109,
+     76, 215, 102, 239,  64, 129,  85, 253, 165, 144,  53,  92, 159,  63, 143, 203,
+     21, 244,  58, 198, 170, 121, 222,  15, 145,  55,   5, 231,  34,  70, 127,  28,
+    194, 138,  49, 243, 188, 103, 213, 238, 115, 161,  59, 177,  24, 144,  48, 233,
+     79, 176, 249, 158, 114, 196,  32, 228,  53, 116, 253,  95,  43,  68, 145, 231,
+     51, 190,  38, 142, 208, 108, 222,   3, 198, 120, 234, 209,  31, 250,  45,  94,
+     72, 127, 150,  98,  47, 236,  62, 186, 251, 211, 110, 136,  91, 242, 164, 110,
+     78, 224, 120,  93,  66, 166,  14,  53,  90,   0, 221, 127,  78, 240, 100, 161,
+     30, 108,  64,  26, 137, 244,  96, 152,  16, 215,  59, 135, 173, 242, 122,  27,
+    167, 127,  92, 173,  18,  46, 140,  62,  99,  35, 184,  11,  82, 116, 219, 154,
+    229,  33, 212,   3, 189, 140,  26, 104,  80,  32, 178, 221,  47, 191,  12, 214,
+     40, 179,   8, 201,  35, 249, 146, 206, 178, 243, 142,  46, 209,   7, 183,  59,
+    137, 192, 223,  85, 180,   6,  62, 122, 192, 163,  81, 202,   4, 102, 206,  84,
+    224,   0, 251,  73, 235, 188, 161, 210, 240,  78, 150, 131, 199, 171,   6, 188,
+    108, 176,  82, 248, 110,  74, 209, 173, 132, 157,  69,  21, 149, 100,  62, 141,
+    250,  90, 148, 231, 132, 100,  23, 122,  67, 105,  27, 189,  92, 153, 120, 203,
+    237,   1, 130,  48, 207, 156, 218, 236,  42, 107,  24, 226, 153,  36, 183,  59,
+    147, 197,  55, 155, 121,  87,  30, 112,  15, 172,  51, 245,  65,  96, 138,  54,
+     19,  63, 131, 166,  37, 156, 241,   6,  48, 203, 246, 126, 198, 237, 174, 117,
+     26, 167,  71,  47, 185,  78, 224, 194,  38, 162, 214, 117,  66, 250,  19,  81,
+     44, 167,  94, 255, 113,  74,  30,  88, 146, 247, 182,  50, 119,  72, 246,  14,
+     96, 115,  34, 216,  10, 228,  58, 194, 129, 216, 106,  18, 228,  35, 208, 253,
+    155, 233, 202,  15, 224,  59, 125,  92, 226, 107,  14,  89,  38,  75,   0, 202,
+     54, 236, 125, 211,   3, 171,  51, 138, 255,  80,   8, 229, 175,  36, 210, 144,
+    111, 216,  32, 150,  16, 174, 132, 186,   7,  68, 131,  94, 234, 172, 132, 209,
+    164, 232, 181, 135, 102, 174, 145, 252,  83,  38, 187, 154, 124, 165,  77, 121,
+    187,  84,  47, 116,  95, 193,  23, 177, 146,  64, 189, 168, 213, 112, 156, 226,
+     94, 190,  21, 106, 153, 235, 111,  13,  95, 186, 148,  55, 130,  97, 164,  59,
+    241, 179,  66, 198, 230,  43, 204, 103, 212, 168, 219,  11, 199,  24, 107,  43,
+     78,  18,  59,  82, 200,  44,  74,   3, 159, 225,  64,  87, 212,   0, 196,  41,
+     13, 142, 220, 179, 149, 254,  77, 212,  33, 235, 131,  55, 143, 255,  33,  69,
+    137, 160,  42, 251,  87,  62, 202, 165, 222,  32, 107, 237,  18, 196, 227,  23,
+     90,   9, 135,  97, 123,  79, 243,  58,  25, 115,  41, 154,  85,  63, 216, 145,
+    254, 193, 158, 243,  24, 231, 123, 184, 104,  19, 140, 248,  48, 111, 235,  98,
+    245, 110,  32,  68,   2, 128,  49, 162, 116,  84,   5, 220,  22,  91, 187, 122,
+     17, 219,  76, 178, 133,  18, 144,  43, 126,  68, 208, 160,  82,  43, 138, 119,
+    190, 159, 246,  50, 171,   4, 141, 158, 227,  76, 252, 191, 139, 239, 167,   6,
+     98, 123,  37, 141, 110, 163, 211,  55, 242, 195, 118,  29, 179, 148,  65, 173,
+     52, 192, 155, 236, 200,  90, 225,  17, 201, 246, 172, 109, 198,  60, 163, 240,
+     52, 195, 115, 227,  33, 209, 243,  84, 173, 247,   2, 117, 184, 248,  67, 213,
+     34,  74, 209,  23, 224, 196,  93,  39, 181, 134,  99,  56,  28, 117,  48, 184,
+     65, 225,  86, 214,   8,  79,  32, 147,  90,  44, 166, 223,  79, 205,  25, 135,
+    212,   8,  77, 104,  43, 173, 144, 103,  58, 142,  44,  77, 231, 139,   7, 209,
+    100, 146,   9,  58, 162, 105,  65, 191,  24, 101, 196,  56, 145,  14, 107, 154,
+    235,  99, 127, 149, 110,  69, 248, 121,  20, 203,   1, 176, 207,  91, 229, 132,
+    202,  23, 168,  52, 195, 251, 102, 176,   6, 206,  60, 100,   9, 126, 230,  88,
+    115, 252, 169, 131, 216,  12, 249,  74, 166,  25, 188, 128,  30, 179, 117,  40,
+     74, 175, 244,  89, 188, 124,   6, 228, 134, 155,  36, 233,  89, 218, 175,  50,
+      1, 180,  60,  39, 190,  17, 166, 213,  63, 237, 161, 113, 243,  15, 158,  35,
+    109, 147, 236, 117, 179, 134,  64, 225, 116, 239, 132, 159, 250, 189,  42, 165,
+    143,  57,  27, 189,  64, 114,  39, 185, 228, 114, 208, 243,  98,  68, 250, 152,
+    227,  28, 129, 209,  42, 238, 152,  91,  52, 209,  72, 166, 121,  30, 199,  79,
+    140, 203, 252, 160, 227,  87,  46, 106, 151,  89,  43,  75, 143,  62, 217,  81,
+    250,   2,  72,  94,  37,  13, 159, 200,  25,  79, 182,  22,  54, 112,  73,  19,
+    202,  99, 228,  87, 238, 161, 210, 130,  15,  86,  61,   0, 159, 200,  19,  91,
+    187, 109,  61, 143,  19,  75, 217,  33, 184, 115, 221,   8, 255,  62, 129, 240,
+    105,  32,  84,  11, 113, 139, 235, 192,  26, 131, 221, 195,  32, 183, 124, 169,
+     51, 185, 222, 153, 213, 240,  49,  87, 146,  42, 220,  95, 141, 210, 176, 240
+};
+
+/* Version `A` has the colors of version 5 and uses the top bit of each value
+ * as 1-bit alpha (ARGB1555). Transparent pixels are stored as 0.
+ */
 typedef enum hicolor_version {
     HICOLOR_VERSION_5,
-    HICOLOR_VERSION_6
+    HICOLOR_VERSION_6,
+    HICOLOR_VERSION_A
 } hicolor_version;
 
 typedef struct hicolor_metadata {
@@ -105,13 +451,18 @@ typedef enum hicolor_result {
     HICOLOR_UNKNOWN_VERSION,
     HICOLOR_INVALID_VALUE,
     HICOLOR_INSUFFICIENT_DATA,
-    HICOLOR_BAD_MAGIC
+    HICOLOR_BAD_MAGIC,
+    HICOLOR_OUT_OF_MEMORY,
+    HICOLOR_CHECKSUM_MISMATCH,
+    HICOLOR_CANCELED
 } hicolor_result;
 
 typedef enum hicolor_dither {
     HICOLOR_A_DITHER,
     HICOLOR_BAYER,
-    HICOLOR_NO_DITHER
+    HICOLOR_NO_DITHER,
+    HICOLOR_FLOYD_STEINBERG,
+    HICOLOR_BLUE_NOISE
 } hicolor_dither;
 
 typedef struct hicolor_rgb {
@@ -122,6 +473,175 @@ typedef struct hicolor_rgb {
 
 typedef uint16_t hicolor_value;
 
+/* State for Floyd-Steinberg error diffusion, which must process rows in
+ * order from top to bottom. The error buffers have three entries (red, green,
+ * blue) per pixel plus one pixel of padding on each side, so pixel `x` starts
+ * at index `(x + 1) * 3`. The errors are in 1/16 of an 8-bit step.
+ */
+typedef struct hicolor_diffuser {
+    hicolor_metadata meta;
+    int16_t* errors;
+    int16_t* next_errors;
+} hicolor_diffuser;
+
+/* Error statistics between two RGB images.
+ * SSIM is computed on luma in non-overlapping windows.
+ */
+typedef struct hicolor_stats {
+    uint64_t pixels;
+    uint64_t squared_error[3];
+    uint64_t absolute_error[3];
+    uint8_t max_error[3];
+    double ssim_sum;
+    uint64_t ssim_windows;
+} hicolor_stats;
+
+/* Framebuffer pixel formats for 16-bit words in host byte order.
+ * The `_SWAPPED` formats have the two bytes of each word exchanged.
+ * Version 6 values are BGR565, version 5 values are XBGR1555,
+ * and version A values are ABGR1555. The `ARGB` formats set alpha
+ * for every pixel of versions without it.
+ */
+typedef enum hicolor_pixel_format {
+    HICOLOR_RGB565,
+    HICOLOR_BGR565,
+    HICOLOR_RGB565_SWAPPED,
+    HICOLOR_BGR565_SWAPPED,
+    HICOLOR_XRGB1555,
+    HICOLOR_XBGR1555,
+    HICOLOR_ARGB1555,
+    HICOLOR_ABGR1555
+} hicolor_pixel_format;
+
+/* A sequence stores frames either whole (keyframes) or as the spans of
+ * values that changed from the previous frame (delta frames).
+ * The values of the type are the bytes that start each frame.
+ */
+typedef enum hicolor_frame_type {
+    HICOLOR_KEYFRAME = 'K',
+    HICOLOR_DELTA_FRAME = 'D'
+} hicolor_frame_type;
+
+typedef struct hicolor_sequence_info {
+    hicolor_metadata meta;
+    uint32_t frames;
+    uint64_t index_offset;
+} hicolor_sequence_info;
+
+typedef struct hicolor_sequence_entry {
+    uint64_t offset;
+    hicolor_frame_type type;
+} hicolor_sequence_entry;
+
+/* Streaming sequence encoder. The frames are written as they come and
+ * the index is written at the end, so the stream must be seekable.
+ */
+typedef struct hicolor_sequence_writer {
+    FILE* stream;
+    hicolor_metadata meta;
+    uint32_t keyframe_interval;
+    uint32_t frames;
+    uint64_t position;
+    hicolor_sequence_entry* index;
+    uint32_t index_capacity;
+    hicolor_value* previous;
+} hicolor_sequence_writer;
+
+/* The distinct values of an indexed image, at most `HICOLOR_PALETTE_MAX`. */
+typedef struct hicolor_palette {
+    uint16_t size;
+    hicolor_value values[HICOLOR_PALETTE_MAX];
+} hicolor_palette;
+
+/* A level of a mipmap pyramid. `offset` is the position of the level's
+ * values from the start of the file. Level 0 is the image itself.
+ */
+typedef struct hicolor_level {
+    uint16_t width;
+    uint16_t height;
+    uint64_t offset;
+} hicolor_level;
+
+typedef struct hicolor_pyramid {
+    uint8_t levels;
+    hicolor_level level[HICOLOR_PYRAMID_MAX_LEVELS];
+} hicolor_pyramid;
+
+/* The weights of a separable filter along one axis. Output pixel `i`
+ * is the sum of `count[i]` input pixels from `start[i]` on times
+ * `weights[i * max_count + k]`.
+ */
+typedef struct hicolor_filter {
+    uint16_t* start;
+    uint16_t* count;
+    float* weights;
+    uint16_t max_count;
+} hicolor_filter;
+
+/* Streaming resampler with a triangle filter that widens when downscaling.
+ * Rows go in top to bottom and come out as soon as all the input rows they
+ * depend on are in. Only `y_filter.max_count` rows filtered horizontally
+ * are kept.
+ */
+typedef struct hicolor_resizer {
+    uint16_t src_width;
+    uint16_t src_height;
+    uint16_t width;
+    uint16_t height;
+    uint8_t channels;
+    hicolor_filter x_filter;
+    hicolor_filter y_filter;
+    float* ring;
+    uint16_t rows_in;
+    uint16_t rows_out;
+} hicolor_resizer;
+
+/* A growable block of scratch memory aligned to `HICOLOR_ARENA_ALIGNMENT`.
+ * `block` is the allocation and `data` the aligned start within it.
+ */
+typedef struct hicolor_arena {
+    void* block;
+    uint8_t* data;
+    size_t capacity;
+} hicolor_arena;
+
+/* Scratch memory that outlives a single conversion. Each arena holds one
+ * buffer, which is reused as long as later requests fit in it. This saves
+ * repeated large allocations and the page faults of touching fresh memory
+ * when a process converts one image after another.
+ */
+typedef struct hicolor_context {
+    hicolor_arena arenas[HICOLOR_CONTEXT_ARENAS];
+} hicolor_context;
+
+/* How to convert an image within a memory budget: either hold the whole
+ * image or pass it through `slots` bands of `band_rows` rows with `jobs`
+ * threads quantizing bands. `memory` is the estimated peak in bytes.
+ */
+typedef struct hicolor_plan {
+    bool whole_image;
+    uint16_t band_rows;
+    int jobs;
+    int slots;
+    size_t memory;
+} hicolor_plan;
+
+/* Progress reporting and cancellation for long calls. The call works in
+ * bands of `rows` rows (`HICOLOR_PROGRESS_ROWS` if 0). After each band,
+ * it stores the number of rows finished in `done` and calls `callback`
+ * unless it is NULL. If the callback returns false, the call stops with
+ * `HICOLOR_CANCELED` before the next band. The rows before `done` are
+ * complete and can be kept. The library has no threads of its own:
+ * to cancel from another thread, have the callback read a flag that
+ * the program synchronizes, for example with C11 atomics.
+ */
+typedef struct hicolor_progress {
+    bool (*callback)(void* data, uint16_t done, uint16_t total);
+    void* data;
+    uint16_t rows;
+    uint16_t done;
+} hicolor_progress;
+
 /* Functions. */
 
 const char* hicolor_error_message(hicolor_result res);
@@ -146,6 +666,24 @@ hicolor_result hicolor_rgb_to_value(
     hicolor_value* value
 );
 
+/* Convert with alpha. Only version A stores alpha: `alpha` below `threshold`
+ * makes the value transparent, and transparent values give 0 alpha.
+ * Other versions ignore `alpha` and give 255.
+ */
+hicolor_result hicolor_value_to_rgba(
+    const hicolor_version version,
+    const hicolor_value value,
+    hicolor_rgb* rgb,
+    uint8_t* alpha
+);
+hicolor_result hicolor_rgba_to_value(
+    const hicolor_version version,
+    const hicolor_rgb rgb,
+    uint8_t alpha,
+    uint8_t threshold,
+    hicolor_value* value
+);
+
 hicolor_result hicolor_read_header(
     FILE* stream,
     hicolor_metadata* meta
@@ -162,6 +700,62 @@ hicolor_result hicolor_quantize_rgb_image(
     hicolor_rgb* image
 );
 
+/* Quantize `rows` rows of the image starting at row `y`.
+ * `image` points to the first pixel of row `y`.
+ * The result is the same as for the whole image, so bands can be quantized
+ * independently and in any order.
+ */
+hicolor_result hicolor_quantize_rgb_rows(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint16_t rows,
+    hicolor_rgb* image
+);
+
+/* Return true if every pixel already has a color of `meta.version`,
+ * so quantizing the image without dithering wouldn't change it.
+ * Return false if any pixel doesn't or if the version is unknown.
+ * The result is the only output; `image` isn't modified.
+ */
+bool hicolor_is_exact_rgb_image(
+    const hicolor_metadata meta,
+    const hicolor_rgb* image
+);
+
+/* Quantize the rectangle of `width` by `height` pixels at (`x`, `y`)
+ * in place. `image` points to the first pixel of the whole image.
+ * The dither pattern is aligned to the whole image, so the rectangle ends up
+ * the same as after quantizing the whole image. Use it to update the parts
+ * of an image that have changed.
+ */
+hicolor_result hicolor_quantize_rgb_rect(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t x,
+    uint16_t y,
+    uint16_t width,
+    uint16_t height,
+    hicolor_rgb* image
+);
+
+/* Rows, bands, and rectangles can't be quantized independently with
+ * `HICOLOR_FLOYD_STEINBERG`. Use a diffuser for it instead.
+ */
+
+/* Quantize row `y` of interleaved 8-bit pixels in place.
+ * Each pixel is `channels` bytes long and starts with red, green, and blue.
+ * Further channels like alpha are left unchanged.
+ * This function is meant for decoder callbacks that see one row at a time.
+ */
+hicolor_result hicolor_quantize_row(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint8_t channels,
+    uint8_t* row
+);
+
 hicolor_result hicolor_read_rgb_image(
     FILE* stream,
     const hicolor_metadata meta,
@@ -173,127 +767,691 @@ hicolor_result hicolor_write_rgb_image(
     const hicolor_rgb* image
 );
 
-#endif /* HICOLOR_H */
+/* Convert `count` values stored in little-endian order at `bytes` to RGB.
+ * The image data of a file starts at `HICOLOR_HEADER_SIZE` and row `y`
+ * at `y * width * 2` after it, so a program can read bands of rows some
+ * other way, like with `pread` in several threads, and decode them with this.
+ */
+hicolor_result hicolor_bytes_to_rgb(
+    const hicolor_version version,
+    const uint8_t* bytes,
+    size_t count,
+    hicolor_rgb* image
+);
 
-/* -------------------------------------------------------------------------- */
+/* The same as `hicolor_quantize_rgb_image`, `hicolor_read_rgb_image`, and
+ * `hicolor_write_rgb_image` with progress reporting and cancellation.
+ * `progress` may be NULL.
+ */
+hicolor_result hicolor_quantize_rgb_image_progress(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    hicolor_rgb* image,
+    hicolor_progress* progress
+);
+hicolor_result hicolor_read_rgb_image_progress(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_rgb* image,
+    hicolor_progress* progress
+);
+hicolor_result hicolor_write_rgb_image_progress(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    hicolor_progress* progress
+);
 
-#ifdef HICOLOR_IMPLEMENTATION
+/* Overwrite the rectangle of `width` by `height` pixels at (`x`, `y`) in
+ * an existing HiColor file with the same rectangle of `image`.
+ * `stream` must be open for reading and writing, `meta` must match its
+ * header, and `image` points to the first pixel of the whole image.
+ * If the file has a checksum chunk, the checksum is recomputed.
+ * Return `HICOLOR_INVALID_VALUE` without writing for files with a pyramid,
+ * whose levels would go stale, and for version A, since `image` has no alpha.
+ */
+hicolor_result hicolor_write_rgb_rect(
+    FILE* stream,
+    const hicolor_metadata meta,
+    uint16_t x,
+    uint16_t y,
+    uint16_t width,
+    uint16_t height,
+    const hicolor_rgb* image
+);
 
-const char* hicolor_error_message(hicolor_result res)
-{
-    switch (res) {
-    case HICOLOR_OK:
-        return "OK";
-    case HICOLOR_IO_ERROR:
-        return "I/O error";
-    case HICOLOR_UNKNOWN_VERSION:
-        return "unknown version";
-    case HICOLOR_INVALID_VALUE:
-        return "invalid value";
-    case HICOLOR_INSUFFICIENT_DATA:
-        return "insufficient data";
-    case HICOLOR_BAD_MAGIC:
-        return "bad magic value";
-    default:
-        return "";
-    }
-}
+/* Error diffusion over rows in order, for streaming. */
+hicolor_result hicolor_diffuser_init(
+    hicolor_diffuser* diffuser,
+    const hicolor_metadata meta
+);
+void hicolor_diffuser_free(
+    hicolor_diffuser* diffuser
+);
+hicolor_result hicolor_diffuse_rgb_rows(
+    hicolor_diffuser* diffuser,
+    uint16_t rows,
+    hicolor_rgb* image
+);
+/* Like `hicolor_quantize_row` but with error diffusion. */
+hicolor_result hicolor_diffuse_row(
+    hicolor_diffuser* diffuser,
+    uint8_t channels,
+    uint8_t* row
+);
 
-hicolor_result hicolor_char_to_version(
-    const uint8_t ch,
-    hicolor_version* version
-)
-{
-    switch (ch) {
-    case '5':
-        *version = HICOLOR_VERSION_5;
-        return HICOLOR_OK;
-    case '6':
-        *version = HICOLOR_VERSION_6;
-        return HICOLOR_OK;
-    default:
-        return HICOLOR_UNKNOWN_VERSION;
-    };
-}
+/* Diffuse the error of pixels `x_start` to `x_end - 1` of `row`.
+ * `errors` is the error carried into this row and `next_errors` collects
+ * the error for the next row. `next_errors` must be zeroed before the first
+ * span of a row. This allows several threads to work on consecutive rows
+ * (a wavefront): a span can start once the previous row has finished
+ * pixel `x_end + 1` (or the end of the row).
+ */
+hicolor_result hicolor_diffuse_rgb_span(
+    const hicolor_metadata meta,
+    uint16_t x_start,
+    uint16_t x_end,
+    int16_t* errors,
+    int16_t* next_errors,
+    hicolor_rgb* row
+);
 
+/* Quantize with 1-bit alpha. Pixels with alpha below `threshold` are
+ * transparent: their runs are skipped rather than quantized and end up 0
+ * in color and alpha. The other pixels are quantized and get 255 alpha.
+ * `alpha` has a byte per pixel of `image`, and `row` is RGBA.
+ * Error diffusion leaves out transparent pixels.
+ */
+hicolor_result hicolor_quantize_rgba_image(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    hicolor_rgb* image,
+    uint8_t* alpha,
+    uint8_t threshold
+);
+hicolor_result hicolor_quantize_rgba_rows(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint16_t rows,
+    hicolor_rgb* image,
+    uint8_t* alpha,
+    uint8_t threshold
+);
+hicolor_result hicolor_quantize_rgba_row(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint8_t* row,
+    uint8_t threshold
+);
+hicolor_result hicolor_diffuse_rgba_row(
+    hicolor_diffuser* diffuser,
+    uint8_t* row,
+    uint8_t threshold
+);
+hicolor_result hicolor_diffuse_rgba_span(
+    const hicolor_metadata meta,
+    uint16_t x_start,
+    uint16_t x_end,
+    int16_t* errors,
+    int16_t* next_errors,
+    hicolor_rgb* row,
+    uint8_t* alpha,
+    uint8_t threshold
+);
 
-hicolor_result hicolor_version_to_char(
+/* Read and write images with alpha, converting color and alpha in the same
+ * pass over the values. See `hicolor_value_to_rgba`.
+ */
+hicolor_result hicolor_read_rgba_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_rgb* image,
+    uint8_t* alpha
+);
+hicolor_result hicolor_write_rgba_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    const uint8_t* alpha,
+    uint8_t threshold
+);
+/* Like `hicolor_bytes_to_rgb` with alpha. */
+hicolor_result hicolor_bytes_to_rgba(
     const hicolor_version version,
-    uint8_t* ch
-)
-{
-    switch (version) {
-    case HICOLOR_VERSION_5:
-        *ch = '5';
-        return HICOLOR_OK;
-    case HICOLOR_VERSION_6:
-        *ch = '6';
-        return HICOLOR_OK;
-    default:
-        return HICOLOR_UNKNOWN_VERSION;
-    };
-}
+    const uint8_t* bytes,
+    size_t count,
+    hicolor_rgb* image,
+    uint8_t* alpha
+);
 
-hicolor_result hicolor_value_to_rgb(
-    const hicolor_version version,
-    const hicolor_value value,
-    hicolor_rgb* rgb
-)
-{
-    switch (version) {
-    case HICOLOR_VERSION_5:
-        if (value & 0x8000) return HICOLOR_INVALID_VALUE;
-        rgb->r = hicolor_32_to_256[value & 0x1f];
-        rgb->g = hicolor_32_to_256[(value & 0x3ff) >> 5];
-        rgb->b = hicolor_32_to_256[(value & 0x7fff) >> 10];
-        return HICOLOR_OK;
-    case HICOLOR_VERSION_6:
-        rgb->r = hicolor_32_to_256[value & 0x1f];
-        rgb->g = hicolor_64_to_256[(value & 0x7ff) >> 5];
-        rgb->b = hicolor_32_to_256[value >> 11];
-        return HICOLOR_OK;
-    default:
-        return HICOLOR_UNKNOWN_VERSION;
-    };
-}
+/* Compare `rows` rows of images `a` and `b` of width `meta.width` and add
+ * the result to `stats`. Statistics for separate bands can be merged.
+ * For the SSIM windows to line up, every band except the last must have
+ * a multiple of `HICOLOR_SSIM_WINDOW` rows.
+ */
+void hicolor_stats_clear(
+    hicolor_stats* stats
+);
+void hicolor_compare_rgb_rows(
+    const hicolor_metadata meta,
+    uint16_t rows,
+    const hicolor_rgb* a,
+    const hicolor_rgb* b,
+    hicolor_stats* stats
+);
+void hicolor_stats_merge(
+    hicolor_stats* stats,
+    const hicolor_stats* other
+);
+/* Return infinity for identical images. */
+double hicolor_stats_psnr(
+    const hicolor_stats* stats
+);
+double hicolor_stats_ssim(
+    const hicolor_stats* stats
+);
 
-hicolor_result hicolor_rgb_to_value(
-    const hicolor_version version,
-    const hicolor_rgb rgb,
-    hicolor_value* value
-)
-{
-    switch (version) {
-    case HICOLOR_VERSION_5:
-        *value = hicolor_256_to_32[rgb.r]
-            | hicolor_256_to_32[rgb.g] << 5
-            | hicolor_256_to_32[rgb.b] << 10;
-        return HICOLOR_OK;
-    case HICOLOR_VERSION_6:
-        *value = hicolor_256_to_32[rgb.r]
-            | hicolor_256_to_64[rgb.g] << 5
-            | hicolor_256_to_32[rgb.b] << 11;
-        return HICOLOR_OK;
-    default:
-        return HICOLOR_UNKNOWN_VERSION;
-    };
-}
+/* Find the first changed value `x_start` and the last `x_end - 1` in
+ * a row of `width` values. Return false if the row is unchanged.
+ */
+bool hicolor_diff_value_row(
+    uint16_t width,
+    const hicolor_value* a,
+    const hicolor_value* b,
+    uint16_t* x_start,
+    uint16_t* x_end
+);
 
-hicolor_result hicolor_read_header(
+/* Read and write raw values without converting them to RGB. Both return
+ * `HICOLOR_INVALID_VALUE` for version 5 values with the top bit set.
+ */
+hicolor_result hicolor_read_value_image(
     FILE* stream,
-    hicolor_metadata* meta
-)
-{
-    size_t total = 0;
-    hicolor_result res;
+    const hicolor_metadata meta,
+    hicolor_value* values
+);
+hicolor_result hicolor_write_value_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_value* values
+);
 
-    uint8_t magic[7];
-    total += fread(magic, 1, sizeof(magic), stream);
-    if (memcmp(magic, hicolor_magic, sizeof(magic)) != 0) {
-        return HICOLOR_BAD_MAGIC;
-    }
+/* Convert `count` values to a framebuffer pixel format.
+ * `values` and `pixels` may point to the same array.
+ */
+hicolor_result hicolor_values_to_pixels(
+    const hicolor_version version,
+    const hicolor_pixel_format format,
+    const hicolor_value* values,
+    uint16_t* pixels,
+    size_t count
+);
 
-    uint8_t vch;
+/* Start a sequence at the beginning of `stream`.
+ * Every `keyframe_interval`th frame is a keyframe, starting with the first.
+ * With an interval of 0 only the first frame is.
+ * Delta frames that would be larger than a keyframe are stored as keyframes.
+ */
+hicolor_result hicolor_sequence_writer_init(
+    hicolor_sequence_writer* writer,
+    FILE* stream,
+    const hicolor_metadata meta,
+    uint32_t keyframe_interval
+);
+hicolor_result hicolor_sequence_write_frame(
+    hicolor_sequence_writer* writer,
+    const hicolor_value* values
+);
+/* Write the index and update the header. */
+hicolor_result hicolor_sequence_writer_finish(
+    hicolor_sequence_writer* writer
+);
+void hicolor_sequence_writer_free(
+    hicolor_sequence_writer* writer
+);
+
+/* Read the header of a sequence at the beginning of `stream`.
+ * The stream is then at the first frame.
+ */
+hicolor_result hicolor_read_sequence_header(
+    FILE* stream,
+    hicolor_sequence_info* info
+);
+/* Read the `info.frames` entries of the index to `entries`. */
+hicolor_result hicolor_read_sequence_index(
+    FILE* stream,
+    const hicolor_sequence_info info,
+    hicolor_sequence_entry* entries
+);
+/* Move to a frame listed in the index. */
+hicolor_result hicolor_seek_sequence_frame(
+    FILE* stream,
+    const hicolor_sequence_entry entry
+);
+/* Read the frame at the current position of `stream` into `values`.
+ * For a delta frame `values` must hold the previous frame.
+ * Frames can be decoded in parallel from each keyframe on
+ * with a separate stream for each thread.
+ */
+hicolor_result hicolor_read_sequence_frame(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_value* values,
+    hicolor_frame_type* type
+);
+
+/* Indexed images store a palette of values and an index into it for each
+ * pixel: 8 bits with up to 256 colors, else 12 bits. Encoders can check
+ * whether a quantized image fits with `hicolor_build_palette`.
+ */
+
+/* Collect the distinct values of `image` in ascending order with
+ * a histogram pass. Return false if there are more than
+ * `HICOLOR_PALETTE_MAX` or `meta.version` is unknown or A, which
+ * indexed images don't support.
+ */
+bool hicolor_build_palette(
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    hicolor_palette* palette
+);
+/* Read and write the header and palette of an indexed image. Both return
+ * `HICOLOR_UNKNOWN_VERSION` for version A.
+ */
+hicolor_result hicolor_read_indexed_header(
+    FILE* stream,
+    hicolor_metadata* meta,
+    hicolor_palette* palette
+);
+hicolor_result hicolor_write_indexed_header(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_palette* palette
+);
+/* Expand the indices through a table of the RGB colors of the palette. */
+hicolor_result hicolor_read_indexed_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_palette* palette,
+    hicolor_rgb* image
+);
+/* Return HICOLOR_INVALID_VALUE if a pixel isn't in the palette. */
+hicolor_result hicolor_write_indexed_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_palette* palette,
+    const hicolor_rgb* image
+);
+
+/* Downsample an image to half its width and height, rounded up,
+ * by averaging blocks of 2x2 pixels.
+ */
+hicolor_result hicolor_downsample_rgb_image(
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    hicolor_rgb* half
+);
+/* Write a mipmap pyramid chunk after the image data. `image` is the image
+ * before quantization. Each level halves the previous one until both sides
+ * are at most `HICOLOR_PYRAMID_MIN_SIZE` and is quantized with `dither`.
+ * The file must start at the beginning of `stream`, and the stream must be
+ * positioned at the end of the data.
+ */
+hicolor_result hicolor_write_pyramid(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    const hicolor_rgb* image
+);
+/* Read the pyramid of a file. A file without one has a single level. */
+hicolor_result hicolor_read_pyramid(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_pyramid* pyramid
+);
+/* Return the smallest level at least `width` by `height` pixels large,
+ * or level 0 if there is none.
+ */
+uint8_t hicolor_pyramid_best_level(
+    const hicolor_pyramid* pyramid,
+    uint16_t width,
+    uint16_t height
+);
+hicolor_result hicolor_read_pyramid_level(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_pyramid* pyramid,
+    uint8_t level,
+    hicolor_rgb* image
+);
+
+/* Return the CRC-32C of `size` bytes at `data` continuing from `crc`,
+ * which is 0 for the first part. Uses the CRC instructions of SSE4.2
+ * or ARMv8 when the CPU has them.
+ */
+uint32_t hicolor_crc32c(
+    uint32_t crc,
+    const void* data,
+    size_t size
+);
+/* Write a checksum chunk with the CRC-32C of every byte before it at the
+ * end of the file, replacing the existing one. The file must start at the
+ * beginning of `stream`, which must be open for reading and writing.
+ * Write other chunks first: the checksum chunk must be the last.
+ */
+hicolor_result hicolor_write_checksum(
+    FILE* stream,
+    const hicolor_metadata meta
+);
+/* Check the file against its checksum chunk without decoding it.
+ * `found` tells whether there is a checksum. Return
+ * `HICOLOR_CHECKSUM_MISMATCH` if the file has changed since it was written.
+ */
+hicolor_result hicolor_verify_checksum(
+    FILE* stream,
+    const hicolor_metadata meta,
+    bool* found
+);
+
+/* Convert `rows` rows of values starting at row `y` in place from
+ * `meta.version` to `version` without going through RGB. Only the green
+ * field changes resolution. Converting to version 5 dithers green with
+ * ordered `dither`; Floyd-Steinberg isn't supported.
+ */
+hicolor_result hicolor_convert_value_rows(
+    const hicolor_metadata meta,
+    const hicolor_version version,
+    const hicolor_dither dither,
+    uint16_t y,
+    uint16_t rows,
+    hicolor_value* values
+);
+
+/* Convert a HiColor image file including its pyramid from `in` to `version`
+ * and write it to `out`. Other chunks are copied as they are, except that
+ * a checksum is recomputed, which needs `out` open for reading as well.
+ * If `in` and `out` are the same stream (opened for update), convert
+ * the file in place. A failure partway through then leaves the file
+ * corrupt; convert into a new file and replace the original to avoid it.
+ */
+hicolor_result hicolor_convert_stream(
+    FILE* in,
+    FILE* out,
+    const hicolor_version version,
+    const hicolor_dither dither
+);
+
+/* Resize rows of interleaved 8-bit pixels with `channels` bytes each. */
+hicolor_result hicolor_resizer_init(
+    hicolor_resizer* resizer,
+    uint16_t src_width,
+    uint16_t src_height,
+    uint16_t width,
+    uint16_t height,
+    uint8_t channels
+);
+void hicolor_resizer_free(
+    hicolor_resizer* resizer
+);
+/* Add the next input row. Fails if an output row that needs the row
+ * that would be dropped to make room hasn't been pulled.
+ */
+hicolor_result hicolor_resizer_push_row(
+    hicolor_resizer* resizer,
+    const uint8_t* row
+);
+/* Write the next output row to `row` if its input rows are in.
+ * Return false otherwise.
+ */
+bool hicolor_resizer_pull_row(
+    hicolor_resizer* resizer,
+    uint8_t* row
+);
+
+void hicolor_context_init(
+    hicolor_context* context
+);
+/* Free the memory of every arena. */
+void hicolor_context_free(
+    hicolor_context* context
+);
+/* Return a buffer of at least `size` bytes from arena `arena`.
+ * The buffer stays valid until the next call for the same arena.
+ * Its contents are kept unless the arena has to grow.
+ * Return NULL if `arena` is out of range or memory runs out.
+ */
+void* hicolor_context_buffer(
+    hicolor_context* context,
+    uint8_t arena,
+    size_t size
+);
+
+/* Plan the conversion of an image of `meta` within `max_memory` bytes of
+ * image data (0 for no limit). Prefer the whole image when `jobs` is 0 and
+ * it fits, else use bands with up to `jobs` threads (at least one),
+ * shrinking the thread count and then the bands to fit. `whole_image`
+ * forces the whole image, and `pyramid` counts the original image and
+ * the pyramid levels built from it. `row_overhead` is what the caller
+ * keeps for each row of the image or a band besides its RGB pixels,
+ * like an alpha plane. Return HICOLOR_OUT_OF_MEMORY with the smallest
+ * plan in `plan` if nothing fits.
+ */
+hicolor_result hicolor_plan_conversion(
+    hicolor_metadata meta,
+    hicolor_dither dither,
+    bool whole_image,
+    bool pyramid,
+    int jobs,
+    size_t row_overhead,
+    size_t max_memory,
+    hicolor_plan* plan
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* HICOLOR_H */
+
+/* -------------------------------------------------------------------------- */
+
+#ifdef HICOLOR_IMPLEMENTATION
+
+/* Define all three of these macros before including the implementation
+ * to allocate memory some other way. Like `free`, `HICOLOR_FREE` must
+ * accept NULL.
+ */
+#if !defined(HICOLOR_MALLOC) && !defined(HICOLOR_REALLOC) \
+    && !defined(HICOLOR_FREE)
+#define HICOLOR_MALLOC(size) malloc(size)
+#define HICOLOR_REALLOC(ptr, size) realloc(ptr, size)
+#define HICOLOR_FREE(ptr) free(ptr)
+#elif !defined(HICOLOR_MALLOC) || !defined(HICOLOR_REALLOC) \
+    || !defined(HICOLOR_FREE)
+#error "define all of HICOLOR_MALLOC, HICOLOR_REALLOC, and HICOLOR_FREE or none"
+#endif
+
+/* SSE4.2 is detected at run time. ARMv8 CRC must be enabled at build time
+ * like with `-march=armv8-a+crc`.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) \
+    && (defined(__x86_64__) || defined(__i386__))
+#define HICOLOR_CRC32C_SSE42
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32) && defined(__aarch64__) \
+    && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define HICOLOR_CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+const char* hicolor_error_message(hicolor_result res)
+{
+    switch (res) {
+    case HICOLOR_OK:
+        return "OK";
+    case HICOLOR_IO_ERROR:
+        return "I/O error";
+    case HICOLOR_UNKNOWN_VERSION:
+        return "unknown version";
+    case HICOLOR_INVALID_VALUE:
+        return "invalid value";
+    case HICOLOR_INSUFFICIENT_DATA:
+        return "insufficient data";
+    case HICOLOR_BAD_MAGIC:
+        return "bad magic value";
+    case HICOLOR_OUT_OF_MEMORY:
+        return "out of memory";
+    case HICOLOR_CHECKSUM_MISMATCH:
+        return "checksum mismatch";
+    case HICOLOR_CANCELED:
+        return "canceled";
+    default:
+        return "";
+    }
+}
+
+hicolor_result hicolor_char_to_version(
+    const uint8_t ch,
+    hicolor_version* version
+)
+{
+    switch (ch) {
+    case '5':
+        *version = HICOLOR_VERSION_5;
+        return HICOLOR_OK;
+    case '6':
+        *version = HICOLOR_VERSION_6;
+        return HICOLOR_OK;
+    case 'A':
+        *version = HICOLOR_VERSION_A;
+        return HICOLOR_OK;
+    default:
+        return HICOLOR_UNKNOWN_VERSION;
+    };
+}
+
+
+hicolor_result hicolor_version_to_char(
+    const hicolor_version version,
+    uint8_t* ch
+)
+{
+    switch (version) {
+    case HICOLOR_VERSION_5:
+        *ch = '5';
+        return HICOLOR_OK;
+    case HICOLOR_VERSION_6:
+        *ch = '6';
+        return HICOLOR_OK;
+    case HICOLOR_VERSION_A:
+        *ch = 'A';
+        return HICOLOR_OK;
+    default:
+        return HICOLOR_UNKNOWN_VERSION;
+    };
+}
+
+hicolor_result hicolor_value_to_rgb(
+    const hicolor_version version,
+    const hicolor_value value,
+    hicolor_rgb* rgb
+)
+{
+    switch (version) {
+    case HICOLOR_VERSION_5:
+        if (value & 0x8000) return HICOLOR_INVALID_VALUE;
+        rgb->r = hicolor_32_to_256[value & 0x1f];
+        rgb->g = hicolor_32_to_256[(value & 0x3ff) >> 5];
+        rgb->b = hicolor_32_to_256[(value & 0x7fff) >> 10];
+        return HICOLOR_OK;
+    case HICOLOR_VERSION_6:
+        rgb->r = hicolor_32_to_256[value & 0x1f];
+        rgb->g = hicolor_64_to_256[(value & 0x7ff) >> 5];
+        rgb->b = hicolor_32_to_256[value >> 11];
+        return HICOLOR_OK;
+    case HICOLOR_VERSION_A:
+        rgb->r = hicolor_32_to_256[value & 0x1f];
+        rgb->g = hicolor_32_to_256[(value & 0x3ff) >> 5];
+        rgb->b = hicolor_32_to_256[(value & 0x7fff) >> 10];
+        return HICOLOR_OK;
+    default:
+        return HICOLOR_UNKNOWN_VERSION;
+    };
+}
+
+hicolor_result hicolor_rgb_to_value(
+    const hicolor_version version,
+    const hicolor_rgb rgb,
+    hicolor_value* value
+)
+{
+    switch (version) {
+    case HICOLOR_VERSION_5:
+        *value = hicolor_256_to_32[rgb.r]
+            | hicolor_256_to_32[rgb.g] << 5
+            | hicolor_256_to_32[rgb.b] << 10;
+        return HICOLOR_OK;
+    case HICOLOR_VERSION_6:
+        *value = hicolor_256_to_32[rgb.r]
+            | hicolor_256_to_64[rgb.g] << 5
+            | hicolor_256_to_32[rgb.b] << 11;
+        return HICOLOR_OK;
+    case HICOLOR_VERSION_A:
+        *value = 0x8000
+            | hicolor_256_to_32[rgb.r]
+            | hicolor_256_to_32[rgb.g] << 5
+            | hicolor_256_to_32[rgb.b] << 10;
+        return HICOLOR_OK;
+    default:
+        return HICOLOR_UNKNOWN_VERSION;
+    };
+}
+
+hicolor_result hicolor_value_to_rgba(
+    const hicolor_version version,
+    const hicolor_value value,
+    hicolor_rgb* rgb,
+    uint8_t* alpha
+)
+{
+    *alpha = version == HICOLOR_VERSION_A && !(value & 0x8000) ? 0 : 255;
+
+    return hicolor_value_to_rgb(version, value, rgb);
+}
+
+hicolor_result hicolor_rgba_to_value(
+    const hicolor_version version,
+    const hicolor_rgb rgb,
+    uint8_t alpha,
+    uint8_t threshold,
+    hicolor_value* value
+)
+{
+    if (version == HICOLOR_VERSION_A && alpha < threshold) {
+        *value = 0;
+        return HICOLOR_OK;
+    }
+
+    return hicolor_rgb_to_value(version, rgb, value);
+}
+
+hicolor_result hicolor_read_header(
+    FILE* stream,
+    hicolor_metadata* meta
+)
+{
+    size_t total = 0;
+    hicolor_result res;
+
+    uint8_t magic[7];
+    total += fread(magic, 1, sizeof(magic), stream);
+    if (memcmp(magic, hicolor_magic, sizeof(magic)) != 0) {
+        return HICOLOR_BAD_MAGIC;
+    }
+
+    uint8_t vch;
     total += fread(&vch, 1, sizeof(vch), stream);
     res = hicolor_char_to_version(vch, &meta->version);
     if (res != HICOLOR_OK) {
@@ -306,7 +1464,7 @@ hicolor_result hicolor_read_header(
     total += fread(&b, 1, sizeof(b), stream);
     meta->height = b[0] + (b[1] << 8);
 
-    if (total == 12) return HICOLOR_OK;
+    if (total == HICOLOR_HEADER_SIZE) return HICOLOR_OK;
 
     return HICOLOR_INSUFFICIENT_DATA;
 }
@@ -335,7 +1493,7 @@ hicolor_result hicolor_write_header(
     total += fwrite(&hb1, 1, sizeof(hb1), stream);
     total += fwrite(&hb2, 1, sizeof(hb2), stream);
 
-    if (total == 12) return HICOLOR_OK;
+    if (total == HICOLOR_HEADER_SIZE) return HICOLOR_OK;
 
     return HICOLOR_IO_ERROR;
 }
@@ -371,7 +1529,7 @@ void hicolor_a_dither_rgb(
 )
 {
     double levels = 32.0;
-    double levels_g = version == HICOLOR_VERSION_5 ? levels : 64.0;
+    double levels_g = version == HICOLOR_VERSION_6 ? 64.0 : levels;
 
     output->r = hicolor_a_dither_channel(rgb.r, x, y, levels);
     output->g = hicolor_a_dither_channel(rgb.g, x, y, levels_g);
@@ -405,46 +1563,321 @@ void hicolor_bayerize_rgb(
     double factor = hicolor_bayer[bayer_coord];
 
     double step = 8.0;
-    double step_g = version == HICOLOR_VERSION_5 ? step : 4.0;
+    double step_g = version == HICOLOR_VERSION_6 ? 4.0 : step;
 
     output->r = hicolor_bayerize_channel(rgb.r, factor, step);
     output->g = hicolor_bayerize_channel(rgb.g, factor, step_g);
     output->b = hicolor_bayerize_channel(rgb.b, factor, step);
 }
 
-hicolor_result hicolor_quantize_rgb_image(
-    const hicolor_metadata meta,
-    hicolor_dither dither,
-    hicolor_rgb* image
+/* Blue-noise threshold dithering.
+ * The intensity is rounded up to the next level when its position between
+ * the two nearest levels is above the threshold and down otherwise.
+ * Intensities that are already levels stay the same,
+ * so there is no generation loss.
+ */
+uint8_t hicolor_blue_noise_channel(
+    uint8_t intensity,
+    uint8_t threshold,
+    const uint8_t* from_256,
+    const uint8_t* to_256,
+    uint8_t max_level
 )
 {
-    hicolor_rgb rgb;
-    hicolor_value value;
+    uint8_t level = from_256[intensity];
+    if (to_256[level] > intensity) {
+        level--;
+    }
+
+    uint8_t low = to_256[level];
+    uint8_t high = to_256[level < max_level ? level + 1 : level];
+
+    return (intensity - low) * 256 > threshold * (high - low) ? high : low;
+}
+
+void hicolor_blue_noise_rgb(
+    hicolor_version version,
+    uint16_t x,
+    uint16_t y,
+    const hicolor_rgb rgb,
+    hicolor_rgb* output
+)
+{
+    uint8_t threshold = hicolor_blue_noise[
+        (y % HICOLOR_BLUE_NOISE_SIZE) * HICOLOR_BLUE_NOISE_SIZE
+        + x % HICOLOR_BLUE_NOISE_SIZE
+    ];
+
+    bool v5 = version != HICOLOR_VERSION_6;
+
+    output->r = hicolor_blue_noise_channel(
+        rgb.r,
+        threshold,
+        hicolor_256_to_32,
+        hicolor_32_to_256,
+        31
+    );
+    output->g = hicolor_blue_noise_channel(
+        rgb.g,
+        threshold,
+        v5 ? hicolor_256_to_32 : hicolor_256_to_64,
+        v5 ? hicolor_32_to_256 : hicolor_64_to_256,
+        v5 ? 31 : 63
+    );
+    output->b = hicolor_blue_noise_channel(
+        rgb.b,
+        threshold,
+        hicolor_256_to_32,
+        hicolor_32_to_256,
+        31
+    );
+}
+
+/* An intensity is exact when converting it to a level and back gives
+ * the same intensity. The conversion tables follow the formulas
+ * `to_256[i] = i * 33 / 4` for 32 levels and `to_256[i] = i * 65 / 16`
+ * for 64 levels, so the check needs no table lookups and can be vectorized.
+ * The inner loop checks a whole row without branching;
+ * the function returns false after the first row that isn't exact.
+ */
+bool hicolor_is_exact_rgb_image(
+    const hicolor_metadata meta,
+    const hicolor_rgb* image
+)
+{
+    if (meta.version != HICOLOR_VERSION_5
+        && meta.version != HICOLOR_VERSION_6
+        && meta.version != HICOLOR_VERSION_A) {
+        return false;
+    }
+
+    bool v5 = meta.version != HICOLOR_VERSION_6;
+    int g_shift = v5 ? 3 : 2;
+    int g_mul = v5 ? 33 : 65;
+    int g_div_shift = v5 ? 2 : 4;
 
     for (uint16_t y = 0; y < meta.height; y++) {
+        const hicolor_rgb* row = &image[(size_t) y * meta.width];
+        int inexact = 0;
+
         for (uint16_t x = 0; x < meta.width; x++) {
-            rgb = image[y * meta.width + x];
+            int r = row[x].r;
+            int g = row[x].g;
+            int b = row[x].b;
 
-            hicolor_rgb quant_rgb = rgb;
-            if (dither == HICOLOR_A_DITHER) {
-                hicolor_a_dither_rgb(meta.version, x, y, rgb, &quant_rgb);
-            } else if (dither == HICOLOR_BAYER) {
-                hicolor_bayerize_rgb(meta.version, x, y, rgb, &quant_rgb);
-            }
+            inexact |= ((r >> 3) * 33 >> 2) ^ r;
+            inexact |= ((g >> g_shift) * g_mul >> g_div_shift) ^ g;
+            inexact |= ((b >> 3) * 33 >> 2) ^ b;
+        }
+
+        if (inexact) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+/* Quantize the pixel at (x, y). */
+hicolor_result hicolor_quantize_rgb(
+    hicolor_version version,
+    hicolor_dither dither,
+    uint16_t x,
+    uint16_t y,
+    const hicolor_rgb rgb,
+    hicolor_rgb* output
+)
+{
+    hicolor_value value;
+
+    hicolor_rgb quant_rgb = rgb;
+    if (dither == HICOLOR_A_DITHER) {
+        hicolor_a_dither_rgb(version, x, y, rgb, &quant_rgb);
+    } else if (dither == HICOLOR_BAYER) {
+        hicolor_bayerize_rgb(version, x, y, rgb, &quant_rgb);
+    } else if (dither == HICOLOR_BLUE_NOISE) {
+        hicolor_blue_noise_rgb(version, x, y, rgb, &quant_rgb);
+    }
+
+    hicolor_result res = hicolor_rgb_to_value(
+        version,
+        quant_rgb,
+        &value
+    );
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    return hicolor_value_to_rgb(
+        version,
+        value,
+        output
+    );
+}
+
+/* Return the number of rows in the band that starts at row `y`:
+ * the rest of the image without `progress`.
+ */
+uint16_t hicolor_progress_band(
+    const hicolor_progress* progress,
+    const hicolor_metadata meta,
+    uint32_t y
+)
+{
+    uint32_t rows = meta.height - y;
+
+    if (progress != NULL) {
+        uint16_t band = progress->rows == 0
+            ? HICOLOR_PROGRESS_ROWS
+            : progress->rows;
+        if (rows > band) rows = band;
+    }
+
+    return rows;
+}
+
+/* Record and report that `done` rows are finished. Return false if the
+ * callback asks to stop and rows remain.
+ */
+bool hicolor_progress_report(
+    hicolor_progress* progress,
+    const hicolor_metadata meta,
+    uint32_t done
+)
+{
+    if (progress == NULL) return true;
+
+    progress->done = done;
+    if (progress->callback == NULL) return true;
 
-            hicolor_result res = hicolor_rgb_to_value(
+    return progress->callback(progress->data, done, meta.height)
+        || done == meta.height;
+}
+
+hicolor_result hicolor_quantize_rgb_image(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    hicolor_rgb* image
+)
+{
+    return hicolor_quantize_rgb_image_progress(meta, dither, image, NULL);
+}
+
+hicolor_result hicolor_quantize_rgb_image_progress(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    hicolor_rgb* image,
+    hicolor_progress* progress
+)
+{
+    hicolor_diffuser diffuser;
+    hicolor_result res = HICOLOR_OK;
+
+    if (dither == HICOLOR_FLOYD_STEINBERG) {
+        res = hicolor_diffuser_init(&diffuser, meta);
+        if (res != HICOLOR_OK) {
+            return res;
+        }
+    }
+
+    if (progress != NULL) progress->done = 0;
+
+    for (uint32_t y = 0; y < meta.height;) {
+        uint16_t rows = hicolor_progress_band(progress, meta, y);
+        hicolor_rgb* band = &image[(size_t) y * meta.width];
+
+        res = dither == HICOLOR_FLOYD_STEINBERG
+            ? hicolor_diffuse_rgb_rows(&diffuser, rows, band)
+            : hicolor_quantize_rgb_rows(meta, dither, y, rows, band);
+        if (res != HICOLOR_OK) {
+            break;
+        }
+
+        y += rows;
+        if (!hicolor_progress_report(progress, meta, y)) {
+            res = HICOLOR_CANCELED;
+            break;
+        }
+    }
+
+    if (dither == HICOLOR_FLOYD_STEINBERG) {
+        hicolor_diffuser_free(&diffuser);
+    }
+
+    return res;
+}
+
+hicolor_result hicolor_quantize_rgb_rows(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint16_t rows,
+    hicolor_rgb* image
+)
+{
+    if (dither == HICOLOR_FLOYD_STEINBERG) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    for (uint16_t row = 0; row < rows; row++) {
+        for (uint16_t x = 0; x < meta.width; x++) {
+            size_t i = (size_t) row * meta.width + x;
+
+            hicolor_result res = hicolor_quantize_rgb(
                 meta.version,
-                quant_rgb,
-                &value
+                dither,
+                x,
+                y + row,
+                image[i],
+                &image[i]
             );
             if (res != HICOLOR_OK) {
                 return res;
             }
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+bool hicolor_rect_in_image(
+    const hicolor_metadata meta,
+    uint16_t x,
+    uint16_t y,
+    uint16_t width,
+    uint16_t height
+)
+{
+    return (uint32_t) x + width <= meta.width
+           && (uint32_t) y + height <= meta.height;
+}
+
+hicolor_result hicolor_quantize_rgb_rect(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t x,
+    uint16_t y,
+    uint16_t width,
+    uint16_t height,
+    hicolor_rgb* image
+)
+{
+    if (dither == HICOLOR_FLOYD_STEINBERG
+        || !hicolor_rect_in_image(meta, x, y, width, height)) {
+        return HICOLOR_INVALID_VALUE;
+    }
 
-            res = hicolor_value_to_rgb(
+    for (uint16_t row = 0; row < height; row++) {
+        hicolor_rgb* pixels = &image[(size_t) (y + row) * meta.width + x];
+
+        for (uint16_t col = 0; col < width; col++) {
+            hicolor_result res = hicolor_quantize_rgb(
                 meta.version,
-                value,
-                &image[y * meta.width + x]
+                dither,
+                x + col,
+                y + row,
+                pixels[col],
+                &pixels[col]
             );
             if (res != HICOLOR_OK) {
                 return res;
@@ -453,50 +1886,3054 @@ hicolor_result hicolor_quantize_rgb_image(
     }
 
     return HICOLOR_OK;
-};
+}
 
-hicolor_result hicolor_read_rgb_image(
-    FILE* stream,
+hicolor_result hicolor_quantize_row(
     const hicolor_metadata meta,
-    hicolor_rgb* image
+    hicolor_dither dither,
+    uint16_t y,
+    uint8_t channels,
+    uint8_t* row
 )
 {
-    size_t total = 0;
+    if (channels < 3 || dither == HICOLOR_FLOYD_STEINBERG) {
+        return HICOLOR_INVALID_VALUE;
+    }
 
-    for (int i = 0; i < meta.width * meta.height; i++) {
-        hicolor_value value;
-        total += fread(&value, 1, sizeof(value), stream);
+    for (uint16_t x = 0; x < meta.width; x++) {
+        uint8_t* pixel = &row[(size_t) x * channels];
+        hicolor_rgb rgb = {pixel[0], pixel[1], pixel[2]};
 
         hicolor_result res =
-            hicolor_value_to_rgb(meta.version, value, &image[i]);
-        if (res != HICOLOR_OK) return res;
+            hicolor_quantize_rgb(meta.version, dither, x, y, rgb, &rgb);
+        if (res != HICOLOR_OK) {
+            return res;
+        }
+
+        pixel[0] = rgb.r;
+        pixel[1] = rgb.g;
+        pixel[2] = rgb.b;
     }
 
-    if (total == 2 * meta.width * meta.height) return HICOLOR_OK;
+    return HICOLOR_OK;
+}
 
-    return HICOLOR_INSUFFICIENT_DATA;
+/* Floyd-Steinberg error diffusion with integer arithmetic.
+ * The error is split into 7/16, 3/16, 5/16, and 1/16 with truncation,
+ * and the last part gets the remainder, so no error is lost.
+ */
+uint8_t hicolor_diffuse_channel(
+    uint8_t intensity,
+    int levels,
+    const uint8_t* to_256,
+    int16_t* error,
+    int16_t* next_error
+)
+{
+    int target = intensity * 16 + error[0];
+    if (target < 0) target = 0;
+    if (target > 255 * 16) target = 255 * 16;
+
+    int level = (target * (levels - 1) + 255 * 8) / (255 * 16);
+    uint8_t result = to_256[level];
+
+    int diff = target - result * 16;
+    int right = diff * 7 / 16;
+    int below_left = diff * 3 / 16;
+    int below = diff * 5 / 16;
+
+    error[3] += right;
+    next_error[-3] += below_left;
+    next_error[0] += below;
+    next_error[3] += diff - right - below_left - below;
+
+    return result;
 }
 
-hicolor_result hicolor_write_rgb_image(
-    FILE* stream,
+void hicolor_diffuse_rgb(
+    hicolor_version version,
+    int16_t* errors,
+    int16_t* next_errors,
+    const hicolor_rgb rgb,
+    hicolor_rgb* output
+)
+{
+    int levels_g = version == HICOLOR_VERSION_6 ? 64 : 32;
+    const uint8_t* to_256_g = version == HICOLOR_VERSION_6
+        ? hicolor_64_to_256
+        : hicolor_32_to_256;
+
+    output->r = hicolor_diffuse_channel(
+        rgb.r,
+        32,
+        hicolor_32_to_256,
+        &errors[0],
+        &next_errors[0]
+    );
+    output->g = hicolor_diffuse_channel(
+        rgb.g,
+        levels_g,
+        to_256_g,
+        &errors[1],
+        &next_errors[1]
+    );
+    output->b = hicolor_diffuse_channel(
+        rgb.b,
+        32,
+        hicolor_32_to_256,
+        &errors[2],
+        &next_errors[2]
+    );
+}
+
+hicolor_result hicolor_diffuse_rgb_span(
     const hicolor_metadata meta,
-    const hicolor_rgb* image
+    uint16_t x_start,
+    uint16_t x_end,
+    int16_t* errors,
+    int16_t* next_errors,
+    hicolor_rgb* row
 )
 {
-    size_t total = 0;
+    if (meta.version != HICOLOR_VERSION_5
+        && meta.version != HICOLOR_VERSION_6
+        && meta.version != HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
 
-    for (int i = 0; i < meta.width * meta.height; i++) {
-        hicolor_value value;
-        hicolor_result res =
-            hicolor_rgb_to_value(meta.version, image[i], &value);
-        if (res != HICOLOR_OK) return res;
+    for (uint16_t x = x_start; x < x_end; x++) {
+        size_t i = ((size_t) x + 1) * 3;
+        hicolor_diffuse_rgb(
+            meta.version,
+            &errors[i],
+            &next_errors[i],
+            row[x],
+            &row[x]
+        );
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_diffuser_init(
+    hicolor_diffuser* diffuser,
+    const hicolor_metadata meta
+)
+{
+    size_t size = ((size_t) meta.width + 2) * 3 * sizeof(int16_t);
+
+    diffuser->meta = meta;
+    diffuser->errors = HICOLOR_MALLOC(size);
+    diffuser->next_errors = HICOLOR_MALLOC(size);
 
-        total += fwrite(&value, 1, sizeof(value), stream);
+    if (diffuser->errors == NULL || diffuser->next_errors == NULL) {
+        hicolor_diffuser_free(diffuser);
+        return HICOLOR_OUT_OF_MEMORY;
     }
 
-    if (total == 2 * meta.width * meta.height) return HICOLOR_OK;
+    memset(diffuser->errors, 0, size);
+    memset(diffuser->next_errors, 0, size);
 
-    return HICOLOR_IO_ERROR;
+    return HICOLOR_OK;
+}
+
+void hicolor_diffuser_free(
+    hicolor_diffuser* diffuser
+)
+{
+    HICOLOR_FREE(diffuser->errors);
+    HICOLOR_FREE(diffuser->next_errors);
+    diffuser->errors = NULL;
+    diffuser->next_errors = NULL;
+}
+
+/* Make the error collected for the next row current. */
+void hicolor_diffuser_next_row(
+    hicolor_diffuser* diffuser
+)
+{
+    int16_t* errors = diffuser->errors;
+    diffuser->errors = diffuser->next_errors;
+    diffuser->next_errors = errors;
+
+    memset(
+        diffuser->next_errors,
+        0,
+        ((size_t) diffuser->meta.width + 2) * 3 * sizeof(int16_t)
+    );
+}
+
+hicolor_result hicolor_diffuse_rgb_rows(
+    hicolor_diffuser* diffuser,
+    uint16_t rows,
+    hicolor_rgb* image
+)
+{
+    for (uint16_t row = 0; row < rows; row++) {
+        hicolor_result res = hicolor_diffuse_rgb_span(
+            diffuser->meta,
+            0,
+            diffuser->meta.width,
+            diffuser->errors,
+            diffuser->next_errors,
+            &image[(size_t) row * diffuser->meta.width]
+        );
+        if (res != HICOLOR_OK) {
+            return res;
+        }
+
+        hicolor_diffuser_next_row(diffuser);
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_diffuse_row(
+    hicolor_diffuser* diffuser,
+    uint8_t channels,
+    uint8_t* row
+)
+{
+    if (channels < 3) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    if (diffuser->meta.version != HICOLOR_VERSION_5
+        && diffuser->meta.version != HICOLOR_VERSION_6
+        && diffuser->meta.version != HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    for (uint16_t x = 0; x < diffuser->meta.width; x++) {
+        uint8_t* pixel = &row[(size_t) x * channels];
+        hicolor_rgb rgb = {pixel[0], pixel[1], pixel[2]};
+        size_t i = ((size_t) x + 1) * 3;
+
+        hicolor_diffuse_rgb(
+            diffuser->meta.version,
+            &diffuser->errors[i],
+            &diffuser->next_errors[i],
+            rgb,
+            &rgb
+        );
+
+        pixel[0] = rgb.r;
+        pixel[1] = rgb.g;
+        pixel[2] = rgb.b;
+    }
+
+    hicolor_diffuser_next_row(diffuser);
+
+    return HICOLOR_OK;
+}
+
+/* Return the end of the run of pixels from `x` up to `end` that are all
+ * opaque or all transparent (`opaque` false) under `threshold`.
+ * The alpha values are `stride` bytes apart.
+ */
+uint16_t hicolor_alpha_run(
+    const uint8_t* alpha,
+    size_t stride,
+    uint16_t x,
+    uint16_t end,
+    uint8_t threshold,
+    bool opaque
+)
+{
+    while (x < end && (alpha[(size_t) x * stride] >= threshold) == opaque) {
+        x++;
+    }
+
+    return x;
+}
+
+hicolor_result hicolor_quantize_rgba_image(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    hicolor_rgb* image,
+    uint8_t* alpha,
+    uint8_t threshold
+)
+{
+    if (dither != HICOLOR_FLOYD_STEINBERG) {
+        return hicolor_quantize_rgba_rows(
+            meta,
+            dither,
+            0,
+            meta.height,
+            image,
+            alpha,
+            threshold
+        );
+    }
+
+    hicolor_diffuser diffuser;
+    hicolor_result res = hicolor_diffuser_init(&diffuser, meta);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    for (uint16_t y = 0; y < meta.height && res == HICOLOR_OK; y++) {
+        size_t i = (size_t) y * meta.width;
+
+        res = hicolor_diffuse_rgba_span(
+            meta,
+            0,
+            meta.width,
+            diffuser.errors,
+            diffuser.next_errors,
+            &image[i],
+            &alpha[i],
+            threshold
+        );
+        hicolor_diffuser_next_row(&diffuser);
+    }
+
+    hicolor_diffuser_free(&diffuser);
+
+    return res;
+}
+
+hicolor_result hicolor_quantize_rgba_rows(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint16_t rows,
+    hicolor_rgb* image,
+    uint8_t* alpha,
+    uint8_t threshold
+)
+{
+    if (dither == HICOLOR_FLOYD_STEINBERG) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    for (uint16_t row = 0; row < rows; row++) {
+        hicolor_rgb* pixels = &image[(size_t) row * meta.width];
+        uint8_t* row_alpha = &alpha[(size_t) row * meta.width];
+
+        for (uint16_t x = 0; x < meta.width;) {
+            uint16_t start =
+                hicolor_alpha_run(row_alpha, 1, x, meta.width, threshold, false);
+            memset(&pixels[x], 0, sizeof(hicolor_rgb) * (start - x));
+            memset(&row_alpha[x], 0, start - x);
+
+            uint16_t end =
+                hicolor_alpha_run(row_alpha, 1, start, meta.width, threshold, true);
+            for (x = start; x < end; x++) {
+                hicolor_result res = hicolor_quantize_rgb(
+                    meta.version,
+                    dither,
+                    x,
+                    y + row,
+                    pixels[x],
+                    &pixels[x]
+                );
+                if (res != HICOLOR_OK) {
+                    return res;
+                }
+
+                row_alpha[x] = 255;
+            }
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_quantize_rgba_row(
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    uint16_t y,
+    uint8_t* row,
+    uint8_t threshold
+)
+{
+    if (dither == HICOLOR_FLOYD_STEINBERG) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    for (uint16_t x = 0; x < meta.width;) {
+        uint16_t start =
+            hicolor_alpha_run(&row[3], 4, x, meta.width, threshold, false);
+        memset(&row[(size_t) x * 4], 0, (size_t) (start - x) * 4);
+
+        uint16_t end =
+            hicolor_alpha_run(&row[3], 4, start, meta.width, threshold, true);
+        for (x = start; x < end; x++) {
+            uint8_t* pixel = &row[(size_t) x * 4];
+            hicolor_rgb rgb = {pixel[0], pixel[1], pixel[2]};
+
+            hicolor_result res =
+                hicolor_quantize_rgb(meta.version, dither, x, y, rgb, &rgb);
+            if (res != HICOLOR_OK) {
+                return res;
+            }
+
+            pixel[0] = rgb.r;
+            pixel[1] = rgb.g;
+            pixel[2] = rgb.b;
+            pixel[3] = 255;
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_diffuse_rgba_row(
+    hicolor_diffuser* diffuser,
+    uint8_t* row,
+    uint8_t threshold
+)
+{
+    if (diffuser->meta.version != HICOLOR_VERSION_5
+        && diffuser->meta.version != HICOLOR_VERSION_6
+        && diffuser->meta.version != HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    uint16_t width = diffuser->meta.width;
+
+    for (uint16_t x = 0; x < width;) {
+        uint16_t start =
+            hicolor_alpha_run(&row[3], 4, x, width, threshold, false);
+        memset(&row[(size_t) x * 4], 0, (size_t) (start - x) * 4);
+
+        uint16_t end =
+            hicolor_alpha_run(&row[3], 4, start, width, threshold, true);
+        for (x = start; x < end; x++) {
+            uint8_t* pixel = &row[(size_t) x * 4];
+            hicolor_rgb rgb = {pixel[0], pixel[1], pixel[2]};
+            size_t i = ((size_t) x + 1) * 3;
+
+            hicolor_diffuse_rgb(
+                diffuser->meta.version,
+                &diffuser->errors[i],
+                &diffuser->next_errors[i],
+                rgb,
+                &rgb
+            );
+
+            pixel[0] = rgb.r;
+            pixel[1] = rgb.g;
+            pixel[2] = rgb.b;
+            pixel[3] = 255;
+        }
+    }
+
+    hicolor_diffuser_next_row(diffuser);
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_diffuse_rgba_span(
+    const hicolor_metadata meta,
+    uint16_t x_start,
+    uint16_t x_end,
+    int16_t* errors,
+    int16_t* next_errors,
+    hicolor_rgb* row,
+    uint8_t* alpha,
+    uint8_t threshold
+)
+{
+    for (uint16_t x = x_start; x < x_end;) {
+        uint16_t start = hicolor_alpha_run(alpha, 1, x, x_end, threshold, false);
+        memset(&row[x], 0, sizeof(hicolor_rgb) * (start - x));
+        memset(&alpha[x], 0, start - x);
+
+        uint16_t end = hicolor_alpha_run(alpha, 1, start, x_end, threshold, true);
+        if (start < end) {
+            hicolor_result res = hicolor_diffuse_rgb_span(
+                meta,
+                start,
+                end,
+                errors,
+                next_errors,
+                row
+            );
+            if (res != HICOLOR_OK) {
+                return res;
+            }
+
+            memset(&alpha[start], 255, end - start);
+        }
+
+        x = end;
+    }
+
+    return HICOLOR_OK;
+}
+
+void hicolor_stats_clear(
+    hicolor_stats* stats
+)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+/* Integer luma with weights that add up to 256. */
+uint8_t hicolor_luma(
+    const hicolor_rgb rgb
+)
+{
+    return (rgb.r * 77 + rgb.g * 150 + rgb.b * 29) >> 8;
+}
+
+double hicolor_window_ssim(
+    const hicolor_metadata meta,
+    uint16_t x,
+    uint16_t w,
+    uint16_t h,
+    const hicolor_rgb* a,
+    const hicolor_rgb* b
+)
+{
+    const double c1 = (0.01 * 255) * (0.01 * 255);
+    const double c2 = (0.03 * 255) * (0.03 * 255);
+    uint32_t sum_a = 0, sum_b = 0;
+    uint64_t sum_aa = 0, sum_bb = 0, sum_ab = 0;
+
+    for (uint16_t y = 0; y < h; y++) {
+        const hicolor_rgb* row_a = &a[(size_t) y * meta.width + x];
+        const hicolor_rgb* row_b = &b[(size_t) y * meta.width + x];
+
+        for (uint16_t i = 0; i < w; i++) {
+            uint32_t la = hicolor_luma(row_a[i]);
+            uint32_t lb = hicolor_luma(row_b[i]);
+            sum_a += la;
+            sum_b += lb;
+            sum_aa += la * la;
+            sum_bb += lb * lb;
+            sum_ab += la * lb;
+        }
+    }
+
+    double n = w * h;
+    double mean_a = sum_a / n;
+    double mean_b = sum_b / n;
+    double var_a = sum_aa / n - mean_a * mean_a;
+    double var_b = sum_bb / n - mean_b * mean_b;
+    double cov = sum_ab / n - mean_a * mean_b;
+
+    return ((2 * mean_a * mean_b + c1) * (2 * cov + c2))
+        / ((mean_a * mean_a + mean_b * mean_b + c1) * (var_a + var_b + c2));
+}
+
+/* The per-row loops have no dependencies between pixels
+ * other than the sums, so the compiler can vectorize them.
+ */
+void hicolor_compare_rgb_rows(
+    const hicolor_metadata meta,
+    uint16_t rows,
+    const hicolor_rgb* a,
+    const hicolor_rgb* b,
+    hicolor_stats* stats
+)
+{
+    for (uint16_t y = 0; y < rows; y++) {
+        const hicolor_rgb* row_a = &a[(size_t) y * meta.width];
+        const hicolor_rgb* row_b = &b[(size_t) y * meta.width];
+        uint32_t sum_sq[3] = {0, 0, 0};
+        uint32_t sum_abs[3] = {0, 0, 0};
+        uint8_t max[3] = {0, 0, 0};
+
+        for (uint16_t x = 0; x < meta.width; x++) {
+            int dr = row_a[x].r - row_b[x].r;
+            int dg = row_a[x].g - row_b[x].g;
+            int db = row_a[x].b - row_b[x].b;
+            uint8_t ar = dr < 0 ? -dr : dr;
+            uint8_t ag = dg < 0 ? -dg : dg;
+            uint8_t ab = db < 0 ? -db : db;
+
+            sum_sq[0] += ar * ar;
+            sum_sq[1] += ag * ag;
+            sum_sq[2] += ab * ab;
+            sum_abs[0] += ar;
+            sum_abs[1] += ag;
+            sum_abs[2] += ab;
+            max[0] = ar > max[0] ? ar : max[0];
+            max[1] = ag > max[1] ? ag : max[1];
+            max[2] = ab > max[2] ? ab : max[2];
+        }
+
+        for (int c = 0; c < 3; c++) {
+            stats->squared_error[c] += sum_sq[c];
+            stats->absolute_error[c] += sum_abs[c];
+            if (max[c] > stats->max_error[c]) stats->max_error[c] = max[c];
+        }
+    }
+
+    stats->pixels += (uint64_t) rows * meta.width;
+
+    for (uint16_t y = 0; y < rows; y += HICOLOR_SSIM_WINDOW) {
+        uint16_t h = rows - y < HICOLOR_SSIM_WINDOW
+            ? rows - y
+            : HICOLOR_SSIM_WINDOW;
+
+        for (uint16_t x = 0; x < meta.width; x += HICOLOR_SSIM_WINDOW) {
+            uint16_t w = meta.width - x < HICOLOR_SSIM_WINDOW
+                ? meta.width - x
+                : HICOLOR_SSIM_WINDOW;
+
+            stats->ssim_sum += hicolor_window_ssim(
+                meta,
+                x,
+                w,
+                h,
+                &a[(size_t) y * meta.width],
+                &b[(size_t) y * meta.width]
+            );
+            stats->ssim_windows++;
+        }
+    }
+}
+
+void hicolor_stats_merge(
+    hicolor_stats* stats,
+    const hicolor_stats* other
+)
+{
+    stats->pixels += other->pixels;
+
+    for (int c = 0; c < 3; c++) {
+        stats->squared_error[c] += other->squared_error[c];
+        stats->absolute_error[c] += other->absolute_error[c];
+        if (other->max_error[c] > stats->max_error[c]) {
+            stats->max_error[c] = other->max_error[c];
+        }
+    }
+
+    stats->ssim_sum += other->ssim_sum;
+    stats->ssim_windows += other->ssim_windows;
+}
+
+double hicolor_stats_psnr(
+    const hicolor_stats* stats
+)
+{
+    uint64_t total = stats->squared_error[0]
+        + stats->squared_error[1]
+        + stats->squared_error[2];
+    if (total == 0 || stats->pixels == 0) {
+        return INFINITY;
+    }
+
+    double mse = (double) total / (stats->pixels * 3);
+    return 10 * log10(255.0 * 255.0 / mse);
+}
+
+double hicolor_stats_ssim(
+    const hicolor_stats* stats
+)
+{
+    if (stats->ssim_windows == 0) {
+        return 1;
+    }
+
+    return stats->ssim_sum / stats->ssim_windows;
+}
+
+bool hicolor_diff_value_row(
+    uint16_t width,
+    const hicolor_value* a,
+    const hicolor_value* b,
+    uint16_t* x_start,
+    uint16_t* x_end
+)
+{
+    uint16_t start = 0;
+    while (start < width && a[start] == b[start]) {
+        start++;
+    }
+
+    if (start == width) {
+        return false;
+    }
+
+    uint16_t end = width;
+    while (a[end - 1] == b[end - 1]) {
+        end--;
+    }
+
+    *x_start = start;
+    *x_end = end;
+
+    return true;
+}
+
+/* Read up to `count` little-endian values. Return the number read. */
+size_t hicolor_fread_values(
+    FILE* stream,
+    hicolor_value* values,
+    size_t count
+)
+{
+    uint8_t* bytes = (uint8_t*) values;
+    size_t read = fread(bytes, 2, count, stream);
+
+    for (size_t i = 0; i < read; i++) {
+        uint8_t lo = bytes[i * 2];
+        uint8_t hi = bytes[i * 2 + 1];
+        values[i] = lo | hi << 8;
+    }
+
+    return read;
+}
+
+/* Write `count` values in little-endian order. Return the number written. */
+size_t hicolor_fwrite_values(
+    FILE* stream,
+    const hicolor_value* values,
+    size_t count
+)
+{
+    uint8_t bytes[HICOLOR_IO_CHUNK_SIZE * 2];
+    size_t total = 0;
+
+    while (total < count) {
+        size_t n = count - total;
+        if (n > HICOLOR_IO_CHUNK_SIZE) n = HICOLOR_IO_CHUNK_SIZE;
+
+        for (size_t i = 0; i < n; i++) {
+            bytes[i * 2] = values[total + i] & 0xff;
+            bytes[i * 2 + 1] = values[total + i] >> 8;
+        }
+
+        size_t written = fwrite(bytes, 2, n, stream);
+        total += written;
+        if (written != n) break;
+    }
+
+    return total;
+}
+
+hicolor_result hicolor_read_rgb_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_rgb* image
+)
+{
+    return hicolor_read_rgb_image_progress(stream, meta, image, NULL);
+}
+
+hicolor_result hicolor_read_rgb_image_progress(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_rgb* image,
+    hicolor_progress* progress
+)
+{
+    hicolor_value values[HICOLOR_IO_CHUNK_SIZE];
+
+    if (progress != NULL) progress->done = 0;
+
+    for (uint32_t y = 0; y < meta.height;) {
+        uint16_t rows = hicolor_progress_band(progress, meta, y);
+        hicolor_rgb* band = &image[(size_t) y * meta.width];
+        size_t count = (size_t) meta.width * rows;
+        size_t total = 0;
+
+        while (total < count) {
+            size_t n = count - total;
+            if (n > HICOLOR_IO_CHUNK_SIZE) n = HICOLOR_IO_CHUNK_SIZE;
+
+            size_t read = hicolor_fread_values(stream, values, n);
+
+            for (size_t i = 0; i < read; i++) {
+                hicolor_result res = hicolor_value_to_rgb(
+                    meta.version,
+                    values[i],
+                    &band[total + i]
+                );
+                if (res != HICOLOR_OK) return res;
+            }
+
+            total += read;
+            if (read != n) return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        y += rows;
+        if (!hicolor_progress_report(progress, meta, y)) {
+            return HICOLOR_CANCELED;
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_bytes_to_rgb(
+    const hicolor_version version,
+    const uint8_t* bytes,
+    size_t count,
+    hicolor_rgb* image
+)
+{
+    for (size_t i = 0; i < count; i++) {
+        hicolor_value value = bytes[i * 2] | bytes[i * 2 + 1] << 8;
+
+        hicolor_result res = hicolor_value_to_rgb(version, value, &image[i]);
+        if (res != HICOLOR_OK) return res;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_bytes_to_rgba(
+    const hicolor_version version,
+    const uint8_t* bytes,
+    size_t count,
+    hicolor_rgb* image,
+    uint8_t* alpha
+)
+{
+    for (size_t i = 0; i < count; i++) {
+        hicolor_value value = bytes[i * 2] | bytes[i * 2 + 1] << 8;
+
+        hicolor_result res =
+            hicolor_value_to_rgba(version, value, &image[i], &alpha[i]);
+        if (res != HICOLOR_OK) return res;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_write_rgb_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_rgb* image
+)
+{
+    return hicolor_write_rgb_image_progress(stream, meta, image, NULL);
+}
+
+hicolor_result hicolor_write_rgb_image_progress(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    hicolor_progress* progress
+)
+{
+    hicolor_value values[HICOLOR_IO_CHUNK_SIZE];
+
+    if (progress != NULL) progress->done = 0;
+
+    for (uint32_t y = 0; y < meta.height;) {
+        uint16_t rows = hicolor_progress_band(progress, meta, y);
+        const hicolor_rgb* band = &image[(size_t) y * meta.width];
+        size_t count = (size_t) meta.width * rows;
+        size_t total = 0;
+
+        while (total < count) {
+            size_t n = count - total;
+            if (n > HICOLOR_IO_CHUNK_SIZE) n = HICOLOR_IO_CHUNK_SIZE;
+
+            for (size_t i = 0; i < n; i++) {
+                hicolor_result res = hicolor_rgb_to_value(
+                    meta.version,
+                    band[total + i],
+                    &values[i]
+                );
+                if (res != HICOLOR_OK) return res;
+            }
+
+            size_t written = hicolor_fwrite_values(stream, values, n);
+            total += written;
+            if (written != n) return HICOLOR_IO_ERROR;
+        }
+
+        y += rows;
+        if (!hicolor_progress_report(progress, meta, y)) {
+            return HICOLOR_CANCELED;
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_read_rgba_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_rgb* image,
+    uint8_t* alpha
+)
+{
+    hicolor_value values[HICOLOR_IO_CHUNK_SIZE];
+    size_t count = (size_t) meta.width * meta.height;
+    size_t total = 0;
+
+    while (total < count) {
+        size_t n = count - total;
+        if (n > HICOLOR_IO_CHUNK_SIZE) n = HICOLOR_IO_CHUNK_SIZE;
+
+        size_t read = hicolor_fread_values(stream, values, n);
+
+        for (size_t i = 0; i < read; i++) {
+            hicolor_result res = hicolor_value_to_rgba(
+                meta.version,
+                values[i],
+                &image[total + i],
+                &alpha[total + i]
+            );
+            if (res != HICOLOR_OK) return res;
+        }
+
+        total += read;
+        if (read != n) return HICOLOR_INSUFFICIENT_DATA;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_write_rgba_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    const uint8_t* alpha,
+    uint8_t threshold
+)
+{
+    hicolor_value values[HICOLOR_IO_CHUNK_SIZE];
+    size_t count = (size_t) meta.width * meta.height;
+    size_t total = 0;
+
+    while (total < count) {
+        size_t n = count - total;
+        if (n > HICOLOR_IO_CHUNK_SIZE) n = HICOLOR_IO_CHUNK_SIZE;
+
+        for (size_t i = 0; i < n; i++) {
+            hicolor_result res = hicolor_rgba_to_value(
+                meta.version,
+                image[total + i],
+                alpha[total + i],
+                threshold,
+                &values[i]
+            );
+            if (res != HICOLOR_OK) return res;
+        }
+
+        size_t written = hicolor_fwrite_values(stream, values, n);
+        total += written;
+        if (written != n) return HICOLOR_IO_ERROR;
+    }
+
+    return HICOLOR_OK;
+}
+
+/* Move forward by `count` bytes in steps that fit in a `long`. */
+bool hicolor_skip_bytes(
+    FILE* stream,
+    uint64_t count
+)
+{
+    const uint64_t max_step = 0x20000000;
+
+    while (count > 0) {
+        uint64_t step = count > max_step ? max_step : count;
+        if (fseek(stream, (long) step, SEEK_CUR) != 0) return false;
+        count -= step;
+    }
+
+    return true;
+}
+
+hicolor_result hicolor_read_value_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_value* values
+)
+{
+    if (meta.version != HICOLOR_VERSION_5
+        && meta.version != HICOLOR_VERSION_6
+        && meta.version != HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    size_t count = (size_t) meta.width * meta.height;
+    size_t read = hicolor_fread_values(stream, values, count);
+
+    if (meta.version == HICOLOR_VERSION_5) {
+        for (size_t i = 0; i < read; i++) {
+            if (values[i] & 0x8000) return HICOLOR_INVALID_VALUE;
+        }
+    }
+
+    if (read == count) return HICOLOR_OK;
+
+    return HICOLOR_INSUFFICIENT_DATA;
+}
+
+hicolor_result hicolor_write_value_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_value* values
+)
+{
+    if (meta.version != HICOLOR_VERSION_5
+        && meta.version != HICOLOR_VERSION_6
+        && meta.version != HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    size_t count = (size_t) meta.width * meta.height;
+
+    /* Version 5 values are 15-bit like on reading. */
+    if (meta.version == HICOLOR_VERSION_5) {
+        for (size_t i = 0; i < count; i++) {
+            if (values[i] & 0x8000) return HICOLOR_INVALID_VALUE;
+        }
+    }
+
+    if (hicolor_fwrite_values(stream, values, count) == count) {
+        return HICOLOR_OK;
+    }
+
+    return HICOLOR_IO_ERROR;
+}
+
+/* Each loop only uses shifts and masks on independent words
+ * so that the compiler can vectorize it.
+ */
+hicolor_result hicolor_values_to_pixels(
+    const hicolor_version version,
+    const hicolor_pixel_format format,
+    const hicolor_value* values,
+    uint16_t* pixels,
+    size_t count
+)
+{
+    if (version != HICOLOR_VERSION_5
+        && version != HICOLOR_VERSION_6
+        && version != HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    /* Position and width of the blue and green fields in the input. */
+    int b_shift = version == HICOLOR_VERSION_6 ? 11 : 10;
+    int g_bits = version == HICOLOR_VERSION_6 ? 6 : 5;
+    uint16_t g_mask = (1 << g_bits) - 1;
+
+    switch (format) {
+    case HICOLOR_RGB565:
+    case HICOLOR_BGR565:
+    case HICOLOR_RGB565_SWAPPED:
+    case HICOLOR_BGR565_SWAPPED: {
+        bool rgb = format == HICOLOR_RGB565 || format == HICOLOR_RGB565_SWAPPED;
+        bool swap = format == HICOLOR_RGB565_SWAPPED
+            || format == HICOLOR_BGR565_SWAPPED;
+        int hi_shift = rgb ? 0 : b_shift;
+        int lo_shift = rgb ? b_shift : 0;
+        /* Widen 5-bit green to 6 bits by repeating its top bit. */
+        int g_widen = 6 - g_bits;
+
+        for (size_t i = 0; i < count; i++) {
+            uint16_t v = values[i];
+            uint16_t g = (v >> 5) & g_mask;
+            g = g << g_widen | g >> (g_bits - g_widen);
+            uint16_t p = ((v >> hi_shift) & 0x1f) << 11
+                | g << 5
+                | ((v >> lo_shift) & 0x1f);
+            pixels[i] = swap ? (uint16_t) (p << 8 | p >> 8) : p;
+        }
+
+        return HICOLOR_OK;
+    }
+    case HICOLOR_XRGB1555:
+    case HICOLOR_XBGR1555:
+    case HICOLOR_ARGB1555:
+    case HICOLOR_ABGR1555: {
+        bool rgb = format == HICOLOR_XRGB1555 || format == HICOLOR_ARGB1555;
+        bool alpha = format == HICOLOR_ARGB1555 || format == HICOLOR_ABGR1555;
+        int hi_shift = rgb ? 0 : b_shift;
+        int lo_shift = rgb ? b_shift : 0;
+        /* Narrow 6-bit green to 5 bits. */
+        int g_narrow = g_bits - 5;
+        /* Copy the alpha bit of version A or make the pixel opaque. */
+        uint16_t a_mask = alpha && version == HICOLOR_VERSION_A ? 0x8000 : 0;
+        uint16_t a_set = alpha && version != HICOLOR_VERSION_A ? 0x8000 : 0;
+
+        for (size_t i = 0; i < count; i++) {
+            uint16_t v = values[i];
+            pixels[i] = (v & a_mask) | a_set
+                | ((v >> hi_shift) & 0x1f) << 10
+                | ((v >> 5) & g_mask) >> g_narrow << 5
+                | ((v >> lo_shift) & 0x1f);
+        }
+
+        return HICOLOR_OK;
+    }
+    default:
+        return HICOLOR_INVALID_VALUE;
+    }
+}
+
+/* Write the low `size` bytes of `value` in little-endian order. */
+bool hicolor_fwrite_le(
+    FILE* stream,
+    uint64_t value,
+    int size
+)
+{
+    uint8_t bytes[8];
+
+    for (int i = 0; i < size; i++) {
+        bytes[i] = (value >> (i * 8)) & 0xff;
+    }
+
+    return fwrite(bytes, 1, size, stream) == (size_t) size;
+}
+
+bool hicolor_fread_le(
+    FILE* stream,
+    int size,
+    uint64_t* value
+)
+{
+    uint8_t bytes[8];
+
+    if (fread(bytes, 1, size, stream) != (size_t) size) return false;
+
+    *value = 0;
+    for (int i = 0; i < size; i++) {
+        *value |= (uint64_t) bytes[i] << (i * 8);
+    }
+
+    return true;
+}
+
+hicolor_result hicolor_write_sequence_header(
+    FILE* stream,
+    const hicolor_metadata meta,
+    uint32_t frames,
+    uint64_t index_offset
+)
+{
+    uint8_t vch;
+    hicolor_result res = hicolor_version_to_char(meta.version, &vch);
+    if (res != HICOLOR_OK) return res;
+
+    bool ok = fwrite(hicolor_magic, 1, sizeof(hicolor_magic), stream)
+            == sizeof(hicolor_magic)
+        && fwrite(&hicolor_sequence_char, 1, 1, stream) == 1
+        && fwrite(&vch, 1, 1, stream) == 1
+        && hicolor_fwrite_le(stream, meta.width, 2)
+        && hicolor_fwrite_le(stream, meta.height, 2)
+        && hicolor_fwrite_le(stream, frames, 4)
+        && hicolor_fwrite_le(stream, index_offset, 8);
+
+    return ok ? HICOLOR_OK : HICOLOR_IO_ERROR;
+}
+
+hicolor_result hicolor_sequence_writer_init(
+    hicolor_sequence_writer* writer,
+    FILE* stream,
+    const hicolor_metadata meta,
+    uint32_t keyframe_interval
+)
+{
+    writer->stream = stream;
+    writer->meta = meta;
+    writer->keyframe_interval = keyframe_interval;
+    writer->frames = 0;
+    writer->position = HICOLOR_SEQUENCE_HEADER_SIZE;
+    writer->index = NULL;
+    writer->index_capacity = 0;
+
+    writer->previous = HICOLOR_MALLOC(
+        sizeof(hicolor_value) * meta.width * meta.height
+    );
+    if (writer->previous == NULL) {
+        return HICOLOR_OUT_OF_MEMORY;
+    }
+
+    /* The frame count and the index offset are filled in at the end. */
+    return hicolor_write_sequence_header(stream, meta, 0, 0);
+}
+
+void hicolor_sequence_writer_free(
+    hicolor_sequence_writer* writer
+)
+{
+    HICOLOR_FREE(writer->index);
+    HICOLOR_FREE(writer->previous);
+    writer->index = NULL;
+    writer->previous = NULL;
+}
+
+/* Return the size of `values` as a delta frame against `previous`. */
+uint64_t hicolor_delta_frame_size(
+    const hicolor_metadata meta,
+    const hicolor_value* previous,
+    const hicolor_value* values,
+    uint32_t* spans
+)
+{
+    uint64_t size = 1 + 4;
+    *spans = 0;
+
+    for (uint16_t y = 0; y < meta.height; y++) {
+        size_t offset = (size_t) y * meta.width;
+        uint16_t x_start, x_end;
+
+        if (hicolor_diff_value_row(
+            meta.width,
+            &previous[offset],
+            &values[offset],
+            &x_start,
+            &x_end
+        )) {
+            size += 6 + (uint64_t) (x_end - x_start) * 2;
+            (*spans)++;
+        }
+    }
+
+    return size;
+}
+
+hicolor_result hicolor_write_delta_frame(
+    hicolor_sequence_writer* writer,
+    const hicolor_value* values,
+    uint32_t spans
+)
+{
+    const hicolor_metadata meta = writer->meta;
+    FILE* stream = writer->stream;
+
+    if (fputc(HICOLOR_DELTA_FRAME, stream) == EOF
+        || !hicolor_fwrite_le(stream, spans, 4)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    for (uint16_t y = 0; y < meta.height; y++) {
+        size_t offset = (size_t) y * meta.width;
+        uint16_t x_start, x_end;
+
+        if (!hicolor_diff_value_row(
+            meta.width,
+            &writer->previous[offset],
+            &values[offset],
+            &x_start,
+            &x_end
+        )) {
+            continue;
+        }
+
+        uint16_t length = x_end - x_start;
+        if (!hicolor_fwrite_le(stream, y, 2)
+            || !hicolor_fwrite_le(stream, x_start, 2)
+            || !hicolor_fwrite_le(stream, length, 2)
+            || hicolor_fwrite_values(
+                stream,
+                &values[offset + x_start],
+                length
+            ) != length) {
+            return HICOLOR_IO_ERROR;
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_sequence_write_frame(
+    hicolor_sequence_writer* writer,
+    const hicolor_value* values
+)
+{
+    const hicolor_metadata meta = writer->meta;
+    size_t count = (size_t) meta.width * meta.height;
+    uint64_t keyframe_size = 1 + (uint64_t) count * 2;
+
+    if (writer->frames == UINT32_MAX) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    if (writer->frames == writer->index_capacity) {
+        uint32_t capacity = writer->index_capacity == 0
+            ? 64
+            : writer->index_capacity * 2;
+        hicolor_sequence_entry* index = HICOLOR_REALLOC(
+            writer->index,
+            sizeof(hicolor_sequence_entry) * capacity
+        );
+        if (index == NULL) {
+            return HICOLOR_OUT_OF_MEMORY;
+        }
+
+        writer->index = index;
+        writer->index_capacity = capacity;
+    }
+
+    bool keyframe = writer->frames == 0
+        || (writer->keyframe_interval > 0
+            && writer->frames % writer->keyframe_interval == 0);
+    uint64_t size = keyframe_size;
+    uint32_t spans = 0;
+
+    if (!keyframe) {
+        size = hicolor_delta_frame_size(meta, writer->previous, values, &spans);
+        keyframe = size >= keyframe_size;
+        if (keyframe) size = keyframe_size;
+    }
+
+    hicolor_result res = HICOLOR_OK;
+    if (keyframe) {
+        if (fputc(HICOLOR_KEYFRAME, writer->stream) == EOF) {
+            return HICOLOR_IO_ERROR;
+        }
+        res = hicolor_write_value_image(writer->stream, meta, values);
+    } else {
+        res = hicolor_write_delta_frame(writer, values, spans);
+    }
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    writer->index[writer->frames].offset = writer->position;
+    writer->index[writer->frames].type =
+        keyframe ? HICOLOR_KEYFRAME : HICOLOR_DELTA_FRAME;
+    writer->frames++;
+    writer->position += size;
+
+    memcpy(writer->previous, values, sizeof(hicolor_value) * count);
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_sequence_writer_finish(
+    hicolor_sequence_writer* writer
+)
+{
+    FILE* stream = writer->stream;
+
+    for (uint32_t i = 0; i < writer->frames; i++) {
+        if (!hicolor_fwrite_le(stream, writer->index[i].offset, 8)
+            || fputc(writer->index[i].type, stream) == EOF) {
+            return HICOLOR_IO_ERROR;
+        }
+    }
+
+    if (fseek(stream, 0, SEEK_SET) != 0) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    hicolor_result res = hicolor_write_sequence_header(
+        stream,
+        writer->meta,
+        writer->frames,
+        writer->position
+    );
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    return fflush(stream) == 0 ? HICOLOR_OK : HICOLOR_IO_ERROR;
+}
+
+hicolor_result hicolor_read_sequence_header(
+    FILE* stream,
+    hicolor_sequence_info* info
+)
+{
+    uint8_t magic[7];
+    if (fread(magic, 1, sizeof(magic), stream) != sizeof(magic)) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+    if (memcmp(magic, hicolor_magic, sizeof(magic)) != 0) {
+        return HICOLOR_BAD_MAGIC;
+    }
+
+    uint8_t sch, vch;
+    if (fread(&sch, 1, 1, stream) != 1 || fread(&vch, 1, 1, stream) != 1) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+    if (sch != hicolor_sequence_char) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    hicolor_result res = hicolor_char_to_version(vch, &info->meta.version);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    uint64_t width, height, frames;
+    if (!hicolor_fread_le(stream, 2, &width)
+        || !hicolor_fread_le(stream, 2, &height)
+        || !hicolor_fread_le(stream, 4, &frames)
+        || !hicolor_fread_le(stream, 8, &info->index_offset)) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+
+    info->meta.width = width;
+    info->meta.height = height;
+    info->frames = frames;
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_read_sequence_index(
+    FILE* stream,
+    const hicolor_sequence_info info,
+    hicolor_sequence_entry* entries
+)
+{
+    if (fseek(stream, 0, SEEK_SET) != 0
+        || !hicolor_skip_bytes(stream, info.index_offset)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    for (uint32_t i = 0; i < info.frames; i++) {
+        uint64_t offset, type;
+
+        if (!hicolor_fread_le(stream, 8, &offset)
+            || !hicolor_fread_le(stream, 1, &type)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        if ((type != HICOLOR_KEYFRAME && type != HICOLOR_DELTA_FRAME)
+            || offset < HICOLOR_SEQUENCE_HEADER_SIZE
+            || offset >= info.index_offset) {
+            return HICOLOR_INVALID_VALUE;
+        }
+
+        entries[i].offset = offset;
+        entries[i].type = (hicolor_frame_type) type;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_seek_sequence_frame(
+    FILE* stream,
+    const hicolor_sequence_entry entry
+)
+{
+    if (fseek(stream, 0, SEEK_SET) != 0
+        || !hicolor_skip_bytes(stream, entry.offset)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_read_sequence_frame(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_value* values,
+    hicolor_frame_type* type
+)
+{
+    int ch = fgetc(stream);
+    if (ch == EOF) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+
+    if (ch == HICOLOR_KEYFRAME) {
+        *type = HICOLOR_KEYFRAME;
+        return hicolor_read_value_image(stream, meta, values);
+    }
+
+    if (ch != HICOLOR_DELTA_FRAME) {
+        return HICOLOR_INVALID_VALUE;
+    }
+    *type = HICOLOR_DELTA_FRAME;
+
+    uint64_t spans;
+    if (!hicolor_fread_le(stream, 4, &spans)) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+
+    for (uint64_t i = 0; i < spans; i++) {
+        uint64_t y, x, length;
+
+        if (!hicolor_fread_le(stream, 2, &y)
+            || !hicolor_fread_le(stream, 2, &x)
+            || !hicolor_fread_le(stream, 2, &length)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        if (y >= meta.height || x + length > meta.width) {
+            return HICOLOR_INVALID_VALUE;
+        }
+
+        hicolor_value* span = &values[y * meta.width + x];
+        if (hicolor_fread_values(stream, span, length) != length) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        if (meta.version == HICOLOR_VERSION_5) {
+            for (uint64_t j = 0; j < length; j++) {
+                if (span[j] & 0x8000) return HICOLOR_INVALID_VALUE;
+            }
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+bool hicolor_build_palette(
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    hicolor_palette* palette
+)
+{
+    if (meta.version == HICOLOR_VERSION_A) return false;
+
+    uint32_t seen[65536 / 32] = {0};
+    size_t count = (size_t) meta.width * meta.height;
+    uint32_t colors = 0;
+
+    for (size_t i = 0; i < count; i++) {
+        hicolor_value value;
+        if (hicolor_rgb_to_value(meta.version, image[i], &value)
+            != HICOLOR_OK) {
+            return false;
+        }
+
+        uint32_t bit = (uint32_t) 1 << (value & 31);
+        if (seen[value >> 5] & bit) continue;
+
+        if (++colors > HICOLOR_PALETTE_MAX) return false;
+        seen[value >> 5] |= bit;
+    }
+
+    palette->size = 0;
+    for (uint32_t value = 0; value < 65536; value++) {
+        if (seen[value >> 5] & (uint32_t) 1 << (value & 31)) {
+            palette->values[palette->size++] = value;
+        }
+    }
+
+    return true;
+}
+
+hicolor_result hicolor_read_indexed_header(
+    FILE* stream,
+    hicolor_metadata* meta,
+    hicolor_palette* palette
+)
+{
+    uint8_t magic[7];
+    if (fread(magic, 1, sizeof(magic), stream) != sizeof(magic)) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+    if (memcmp(magic, hicolor_magic, sizeof(magic)) != 0) {
+        return HICOLOR_BAD_MAGIC;
+    }
+
+    uint8_t ich, vch;
+    if (fread(&ich, 1, 1, stream) != 1 || fread(&vch, 1, 1, stream) != 1) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+    if (ich != hicolor_indexed_char) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    hicolor_result res = hicolor_char_to_version(vch, &meta->version);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+    if (meta->version == HICOLOR_VERSION_A) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    uint64_t width, height, size;
+    if (!hicolor_fread_le(stream, 2, &width)
+        || !hicolor_fread_le(stream, 2, &height)
+        || !hicolor_fread_le(stream, 2, &size)) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+    if (size == 0 || size > HICOLOR_PALETTE_MAX) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    meta->width = width;
+    meta->height = height;
+    palette->size = size;
+
+    if (hicolor_fread_values(stream, palette->values, size) != size) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+
+    for (uint16_t i = 0; i < palette->size; i++) {
+        hicolor_rgb rgb;
+        res = hicolor_value_to_rgb(meta->version, palette->values[i], &rgb);
+        if (res != HICOLOR_OK) return res;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_write_indexed_header(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_palette* palette
+)
+{
+    if (meta.version == HICOLOR_VERSION_A) return HICOLOR_UNKNOWN_VERSION;
+
+    uint8_t vch;
+    hicolor_result res = hicolor_version_to_char(meta.version, &vch);
+    if (res != HICOLOR_OK) return res;
+
+    if (palette->size == 0 || palette->size > HICOLOR_PALETTE_MAX) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    bool ok = fwrite(hicolor_magic, 1, sizeof(hicolor_magic), stream)
+            == sizeof(hicolor_magic)
+        && fwrite(&hicolor_indexed_char, 1, 1, stream) == 1
+        && fwrite(&vch, 1, 1, stream) == 1
+        && hicolor_fwrite_le(stream, meta.width, 2)
+        && hicolor_fwrite_le(stream, meta.height, 2)
+        && hicolor_fwrite_le(stream, palette->size, 2)
+        && hicolor_fwrite_values(stream, palette->values, palette->size)
+            == palette->size;
+
+    return ok ? HICOLOR_OK : HICOLOR_IO_ERROR;
+}
+
+/* The number of bytes `count` indices take. Two 12-bit indices share
+ * three bytes, and a last odd one takes two.
+ */
+size_t hicolor_indices_size(
+    const hicolor_palette* palette,
+    size_t count
+)
+{
+    return palette->size > HICOLOR_PALETTE_MAX_8_BIT
+        ? (count * 3 + 1) / 2
+        : count;
+}
+
+hicolor_result hicolor_read_indexed_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_palette* palette,
+    hicolor_rgb* image
+)
+{
+    hicolor_rgb table[HICOLOR_PALETTE_MAX];
+    uint8_t bytes[HICOLOR_IO_CHUNK_SIZE * 3];
+    bool wide = palette->size > HICOLOR_PALETTE_MAX_8_BIT;
+    size_t count = (size_t) meta.width * meta.height;
+    size_t total = 0;
+
+    for (uint16_t i = 0; i < palette->size; i++) {
+        hicolor_result res =
+            hicolor_value_to_rgb(meta.version, palette->values[i], &table[i]);
+        if (res != HICOLOR_OK) return res;
+    }
+
+    while (total < count) {
+        size_t n = count - total;
+        if (n > HICOLOR_IO_CHUNK_SIZE * 2) n = HICOLOR_IO_CHUNK_SIZE * 2;
+
+        size_t size = hicolor_indices_size(palette, n);
+        if (fread(bytes, 1, size, stream) != size) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        for (size_t i = 0; i < n; i++) {
+            const uint8_t* pair = &bytes[i / 2 * 3];
+            uint16_t index;
+            if (!wide) {
+                index = bytes[i];
+            } else if (i % 2 == 0) {
+                index = pair[0] | (pair[1] & 0x0f) << 8;
+            } else {
+                index = pair[1] >> 4 | pair[2] << 4;
+            }
+
+            if (index >= palette->size) return HICOLOR_INVALID_VALUE;
+            image[total + i] = table[index];
+        }
+
+        total += n;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_write_indexed_image(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_palette* palette,
+    const hicolor_rgb* image
+)
+{
+    uint8_t bytes[HICOLOR_IO_CHUNK_SIZE * 3];
+    bool wide = palette->size > HICOLOR_PALETTE_MAX_8_BIT;
+    size_t count = (size_t) meta.width * meta.height;
+    size_t total = 0;
+    hicolor_result res = HICOLOR_OK;
+
+    /* Map every value to its index or 0xffff if it isn't in the palette. */
+    uint16_t* indices = HICOLOR_MALLOC(sizeof(uint16_t) * 65536);
+    if (indices == NULL) return HICOLOR_OUT_OF_MEMORY;
+
+    memset(indices, 0xff, sizeof(uint16_t) * 65536);
+    for (uint16_t i = 0; i < palette->size; i++) {
+        indices[palette->values[i]] = i;
+    }
+
+    while (total < count && res == HICOLOR_OK) {
+        size_t n = count - total;
+        if (n > HICOLOR_IO_CHUNK_SIZE * 2) n = HICOLOR_IO_CHUNK_SIZE * 2;
+
+        for (size_t i = 0; i < n; i++) {
+            hicolor_value value;
+            res = hicolor_rgb_to_value(meta.version, image[total + i], &value);
+            if (res != HICOLOR_OK) break;
+
+            uint16_t index = indices[value];
+            if (index == 0xffff) {
+                res = HICOLOR_INVALID_VALUE;
+                break;
+            }
+
+            uint8_t* pair = &bytes[i / 2 * 3];
+            if (!wide) {
+                bytes[i] = index;
+            } else if (i % 2 == 0) {
+                pair[0] = index & 0xff;
+                pair[1] = index >> 8;
+            } else {
+                pair[1] |= (index & 0x0f) << 4;
+                pair[2] = index >> 4;
+            }
+        }
+
+        size_t size = hicolor_indices_size(palette, n);
+        if (res == HICOLOR_OK && fwrite(bytes, 1, size, stream) != size) {
+            res = HICOLOR_IO_ERROR;
+        }
+
+        total += n;
+    }
+
+    HICOLOR_FREE(indices);
+
+    return res;
+}
+
+hicolor_result hicolor_downsample_rgb_image(
+    const hicolor_metadata meta,
+    const hicolor_rgb* image,
+    hicolor_rgb* half
+)
+{
+    uint16_t half_width = (meta.width + 1) / 2;
+    uint16_t half_height = (meta.height + 1) / 2;
+
+    for (uint16_t y = 0; y < half_height; y++) {
+        uint16_t y0 = y * 2;
+        uint16_t y1 = y0 + 1 < meta.height ? y0 + 1 : y0;
+
+        for (uint16_t x = 0; x < half_width; x++) {
+            uint16_t x0 = x * 2;
+            uint16_t x1 = x0 + 1 < meta.width ? x0 + 1 : x0;
+
+            /* Edge pixels of odd sizes count twice. */
+            const hicolor_rgb* p[4] = {
+                &image[(size_t) y0 * meta.width + x0],
+                &image[(size_t) y0 * meta.width + x1],
+                &image[(size_t) y1 * meta.width + x0],
+                &image[(size_t) y1 * meta.width + x1]
+            };
+            hicolor_rgb* out = &half[(size_t) y * half_width + x];
+
+            out->r = (p[0]->r + p[1]->r + p[2]->r + p[3]->r + 2) / 4;
+            out->g = (p[0]->g + p[1]->g + p[2]->g + p[3]->g + 2) / 4;
+            out->b = (p[0]->b + p[1]->b + p[2]->b + p[3]->b + 2) / 4;
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+/* Fill in the sizes and offsets of the levels after level 0. */
+void hicolor_plan_pyramid(
+    const hicolor_metadata meta,
+    hicolor_pyramid* pyramid,
+    uint64_t data_offset
+)
+{
+    pyramid->level[0].width = meta.width;
+    pyramid->level[0].height = meta.height;
+    pyramid->level[0].offset = HICOLOR_HEADER_SIZE;
+    pyramid->levels = 1;
+
+    while (pyramid->levels < HICOLOR_PYRAMID_MAX_LEVELS) {
+        const hicolor_level* prev = &pyramid->level[pyramid->levels - 1];
+        if (prev->width <= HICOLOR_PYRAMID_MIN_SIZE
+            && prev->height <= HICOLOR_PYRAMID_MIN_SIZE) {
+            break;
+        }
+
+        hicolor_level* level = &pyramid->level[pyramid->levels];
+        level->width = (prev->width + 1) / 2;
+        level->height = (prev->height + 1) / 2;
+        level->offset = pyramid->levels == 1
+            ? data_offset
+            : prev->offset + (uint64_t) prev->width * prev->height * 2;
+        pyramid->levels++;
+    }
+}
+
+/* Find the chunk with `tag` after the image data and move to its payload. */
+hicolor_result hicolor_find_chunk(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const uint8_t tag[4],
+    bool* found,
+    uint64_t* length
+)
+{
+    uint64_t data_end =
+        HICOLOR_HEADER_SIZE + (uint64_t) meta.width * meta.height * 2;
+
+    *found = false;
+
+    if (fseek(stream, 0, SEEK_SET) != 0
+        || !hicolor_skip_bytes(stream, data_end)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    while (true) {
+        uint8_t chunk_tag[4];
+        size_t read = fread(chunk_tag, 1, sizeof(chunk_tag), stream);
+        if (read == 0 && feof(stream)) {
+            return HICOLOR_OK;
+        }
+
+        if (read != sizeof(chunk_tag)
+            || !hicolor_fread_le(stream, 8, length)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        if (memcmp(chunk_tag, tag, sizeof(chunk_tag)) == 0) {
+            *found = true;
+            return HICOLOR_OK;
+        }
+
+        if (!hicolor_skip_bytes(stream, *length)) {
+            return HICOLOR_IO_ERROR;
+        }
+    }
+}
+
+hicolor_result hicolor_write_pyramid(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_dither dither,
+    const hicolor_rgb* image
+)
+{
+    hicolor_pyramid pyramid;
+    uint64_t data_end =
+        HICOLOR_HEADER_SIZE + (uint64_t) meta.width * meta.height * 2;
+
+    /* Plan once to count the levels and again with the real offsets. */
+    hicolor_plan_pyramid(meta, &pyramid, 0);
+    uint64_t table_size = 1 + (uint64_t) (pyramid.levels - 1) * 12;
+    hicolor_plan_pyramid(
+        meta,
+        &pyramid,
+        data_end + HICOLOR_CHUNK_HEADER_SIZE + table_size
+    );
+
+    if (pyramid.levels == 1) {
+        return HICOLOR_OK;
+    }
+
+    const hicolor_level* last = &pyramid.level[pyramid.levels - 1];
+    uint64_t length = last->offset
+        + (uint64_t) last->width * last->height * 2
+        - data_end
+        - HICOLOR_CHUNK_HEADER_SIZE;
+
+    if (fwrite(hicolor_pyramid_tag, 1, 4, stream) != 4
+        || !hicolor_fwrite_le(stream, length, 8)
+        || fputc(pyramid.levels - 1, stream) == EOF) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    for (uint8_t i = 1; i < pyramid.levels; i++) {
+        if (!hicolor_fwrite_le(stream, pyramid.level[i].width, 2)
+            || !hicolor_fwrite_le(stream, pyramid.level[i].height, 2)
+            || !hicolor_fwrite_le(stream, pyramid.level[i].offset, 8)) {
+            return HICOLOR_IO_ERROR;
+        }
+    }
+
+    /* Each level is downsampled from the unquantized previous level. */
+    size_t size = (size_t) pyramid.level[1].width * pyramid.level[1].height;
+    hicolor_rgb* prev = HICOLOR_MALLOC(sizeof(hicolor_rgb) * size);
+    hicolor_rgb* cur = HICOLOR_MALLOC(sizeof(hicolor_rgb) * size);
+    hicolor_rgb* quantized = HICOLOR_MALLOC(sizeof(hicolor_rgb) * size);
+    hicolor_result res = HICOLOR_OK;
+
+    if (prev == NULL || cur == NULL || quantized == NULL) {
+        res = HICOLOR_OUT_OF_MEMORY;
+        goto clean_up;
+    }
+
+    for (uint8_t i = 1; i < pyramid.levels && res == HICOLOR_OK; i++) {
+        const hicolor_level* above = &pyramid.level[i - 1];
+        hicolor_metadata above_meta = {
+            .version = meta.version,
+            .width = above->width,
+            .height = above->height
+        };
+        hicolor_metadata level_meta = {
+            .version = meta.version,
+            .width = pyramid.level[i].width,
+            .height = pyramid.level[i].height
+        };
+
+        hicolor_downsample_rgb_image(above_meta, i == 1 ? image : prev, cur);
+
+        memcpy(
+            quantized,
+            cur,
+            sizeof(hicolor_rgb) * level_meta.width * level_meta.height
+        );
+        res = hicolor_quantize_rgb_image(level_meta, dither, quantized);
+        if (res == HICOLOR_OK) {
+            res = hicolor_write_rgb_image(stream, level_meta, quantized);
+        }
+
+        hicolor_rgb* tmp = prev;
+        prev = cur;
+        cur = tmp;
+    }
+
+clean_up:
+    HICOLOR_FREE(prev);
+    HICOLOR_FREE(cur);
+    HICOLOR_FREE(quantized);
+
+    return res;
+}
+
+hicolor_result hicolor_read_pyramid(
+    FILE* stream,
+    const hicolor_metadata meta,
+    hicolor_pyramid* pyramid
+)
+{
+    bool found;
+    uint64_t length;
+
+    pyramid->level[0].width = meta.width;
+    pyramid->level[0].height = meta.height;
+    pyramid->level[0].offset = HICOLOR_HEADER_SIZE;
+    pyramid->levels = 1;
+
+    hicolor_result res =
+        hicolor_find_chunk(stream, meta, hicolor_pyramid_tag, &found, &length);
+    if (res != HICOLOR_OK || !found) {
+        return res;
+    }
+
+    int levels = fgetc(stream);
+    if (levels == EOF) {
+        return HICOLOR_INSUFFICIENT_DATA;
+    }
+    if (levels >= HICOLOR_PYRAMID_MAX_LEVELS) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    for (int i = 1; i <= levels; i++) {
+        uint64_t width, height, offset;
+
+        if (!hicolor_fread_le(stream, 2, &width)
+            || !hicolor_fread_le(stream, 2, &height)
+            || !hicolor_fread_le(stream, 8, &offset)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        /* Levels must halve the previous one. */
+        const hicolor_level* prev = &pyramid->level[i - 1];
+        if (width != (uint64_t) (prev->width + 1) / 2
+            || height != (uint64_t) (prev->height + 1) / 2) {
+            return HICOLOR_INVALID_VALUE;
+        }
+
+        pyramid->level[i].width = width;
+        pyramid->level[i].height = height;
+        pyramid->level[i].offset = offset;
+    }
+
+    pyramid->levels = levels + 1;
+
+    return HICOLOR_OK;
+}
+
+uint8_t hicolor_pyramid_best_level(
+    const hicolor_pyramid* pyramid,
+    uint16_t width,
+    uint16_t height
+)
+{
+    uint8_t best = 0;
+
+    for (uint8_t i = 1; i < pyramid->levels; i++) {
+        if (pyramid->level[i].width < width
+            || pyramid->level[i].height < height) {
+            break;
+        }
+
+        best = i;
+    }
+
+    return best;
+}
+
+hicolor_result hicolor_read_pyramid_level(
+    FILE* stream,
+    const hicolor_metadata meta,
+    const hicolor_pyramid* pyramid,
+    uint8_t level,
+    hicolor_rgb* image
+)
+{
+    if (level >= pyramid->levels) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    const hicolor_level* l = &pyramid->level[level];
+    hicolor_metadata level_meta = {
+        .version = meta.version,
+        .width = l->width,
+        .height = l->height
+    };
+
+    if (fseek(stream, 0, SEEK_SET) != 0
+        || !hicolor_skip_bytes(stream, l->offset)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    return hicolor_read_rgb_image(stream, level_meta, image);
+}
+
+uint32_t hicolor_crc32c_portable(
+    uint32_t crc,
+    const uint8_t* data,
+    size_t size
+)
+{
+    for (size_t i = 0; i < size; i++) {
+        crc = hicolor_crc32c_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+#ifdef HICOLOR_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+uint32_t hicolor_crc32c_sse42(
+    uint32_t crc,
+    const uint8_t* data,
+    size_t size
+)
+{
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t) crc64;
+#endif
+
+    for (; size >= 4; size -= 4, data += 4) {
+        uint32_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; size > 0; size--, data++) {
+        crc = _mm_crc32_u8(crc, *data);
+    }
+
+    return crc;
+}
+#endif
+
+#ifdef HICOLOR_CRC32C_ARM
+uint32_t hicolor_crc32c_arm(
+    uint32_t crc,
+    const uint8_t* data,
+    size_t size
+)
+{
+    for (; size >= 8; size -= 8, data += 8) {
+        uint64_t word;
+        memcpy(&word, data, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; size--, data++) {
+        crc = __crc32cb(crc, *data);
+    }
+
+    return crc;
+}
+#endif
+
+uint32_t hicolor_crc32c(
+    uint32_t crc,
+    const void* data,
+    size_t size
+)
+{
+    crc = ~crc;
+
+#if defined(HICOLOR_CRC32C_SSE42)
+    crc = __builtin_cpu_supports("sse4.2")
+          ? hicolor_crc32c_sse42(crc, data, size)
+          : hicolor_crc32c_portable(crc, data, size);
+#elif defined(HICOLOR_CRC32C_ARM)
+    crc = hicolor_crc32c_arm(crc, data, size);
+#else
+    crc = hicolor_crc32c_portable(crc, data, size);
+#endif
+
+    return ~crc;
+}
+
+/* Find the checksum chunk. Set `offset` to where it starts or, if there is
+ * none, to the end of the file. The chunk must be the last.
+ */
+hicolor_result hicolor_find_checksum(
+    FILE* stream,
+    const hicolor_metadata meta,
+    bool* found,
+    uint64_t* offset,
+    uint32_t* checksum
+)
+{
+    uint64_t position =
+        HICOLOR_HEADER_SIZE + (uint64_t) meta.width * meta.height * 2;
+
+    *found = false;
+
+    if (fseek(stream, 0, SEEK_SET) != 0
+        || !hicolor_skip_bytes(stream, position)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    while (true) {
+        uint8_t tag[4];
+        uint64_t length;
+
+        size_t read = fread(tag, 1, sizeof(tag), stream);
+        if (read == 0 && feof(stream)) {
+            /* Seeking past the end succeeds, so make sure the data
+             * and the last chunk are all there.
+             */
+            if (fseek(stream, 0, SEEK_SET) != 0
+                || !hicolor_skip_bytes(stream, position - 1)
+                || fgetc(stream) == EOF) {
+                return HICOLOR_INSUFFICIENT_DATA;
+            }
+
+            *offset = position;
+            return HICOLOR_OK;
+        }
+
+        if (read != sizeof(tag) || !hicolor_fread_le(stream, 8, &length)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        if (memcmp(tag, hicolor_checksum_tag, sizeof(tag)) == 0) {
+            uint64_t value;
+            if (length != HICOLOR_CHECKSUM_SIZE) {
+                return HICOLOR_INVALID_VALUE;
+            }
+            if (!hicolor_fread_le(stream, HICOLOR_CHECKSUM_SIZE, &value)) {
+                return HICOLOR_INSUFFICIENT_DATA;
+            }
+            if (fgetc(stream) != EOF) {
+                return HICOLOR_INVALID_VALUE;
+            }
+
+            *found = true;
+            *offset = position;
+            *checksum = (uint32_t) value;
+            return HICOLOR_OK;
+        }
+
+        if (!hicolor_skip_bytes(stream, length)) {
+            return HICOLOR_IO_ERROR;
+        }
+        position += HICOLOR_CHUNK_HEADER_SIZE + length;
+    }
+}
+
+/* Compute the CRC-32C of the first `count` bytes of the file. */
+hicolor_result hicolor_checksum_bytes(
+    FILE* stream,
+    uint64_t count,
+    uint32_t* checksum
+)
+{
+    if (fseek(stream, 0, SEEK_SET) != 0) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    uint8_t* buffer = HICOLOR_MALLOC(HICOLOR_CHECKSUM_BUFFER_SIZE);
+    if (buffer == NULL) {
+        return HICOLOR_OUT_OF_MEMORY;
+    }
+
+    hicolor_result res = HICOLOR_OK;
+    *checksum = 0;
+
+    while (count > 0) {
+        size_t n = count > HICOLOR_CHECKSUM_BUFFER_SIZE
+                   ? HICOLOR_CHECKSUM_BUFFER_SIZE
+                   : count;
+        if (fread(buffer, 1, n, stream) != n) {
+            res = HICOLOR_INSUFFICIENT_DATA;
+            break;
+        }
+
+        *checksum = hicolor_crc32c(*checksum, buffer, n);
+        count -= n;
+    }
+
+    HICOLOR_FREE(buffer);
+
+    return res;
+}
+
+hicolor_result hicolor_write_checksum(
+    FILE* stream,
+    const hicolor_metadata meta
+)
+{
+    bool found;
+    uint64_t offset;
+    uint32_t checksum;
+
+    hicolor_result res =
+        hicolor_find_checksum(stream, meta, &found, &offset, &checksum);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    res = hicolor_checksum_bytes(stream, offset, &checksum);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    /* Switch from reading to writing at the start of the chunk. */
+    if (fseek(stream, 0, SEEK_CUR) != 0
+        || fwrite(hicolor_checksum_tag, 1, 4, stream) != 4
+        || !hicolor_fwrite_le(stream, HICOLOR_CHECKSUM_SIZE, 8)
+        || !hicolor_fwrite_le(stream, checksum, HICOLOR_CHECKSUM_SIZE)) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_verify_checksum(
+    FILE* stream,
+    const hicolor_metadata meta,
+    bool* found
+)
+{
+    uint64_t offset;
+    uint32_t expected;
+
+    hicolor_result res =
+        hicolor_find_checksum(stream, meta, found, &offset, &expected);
+    if (res != HICOLOR_OK || !*found) {
+        return res;
+    }
+
+    uint32_t checksum;
+    res = hicolor_checksum_bytes(stream, offset, &checksum);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    return checksum == expected ? HICOLOR_OK : HICOLOR_CHECKSUM_MISMATCH;
+}
+
+hicolor_result hicolor_write_rgb_rect(
+    FILE* stream,
+    const hicolor_metadata meta,
+    uint16_t x,
+    uint16_t y,
+    uint16_t width,
+    uint16_t height,
+    const hicolor_rgb* image
+)
+{
+    if (!hicolor_rect_in_image(meta, x, y, width, height)
+        || meta.version == HICOLOR_VERSION_A) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    if (height == 0 || width == 0) return HICOLOR_OK;
+
+    hicolor_pyramid pyramid;
+    hicolor_result res = hicolor_read_pyramid(stream, meta, &pyramid);
+    if (res != HICOLOR_OK) return res;
+    if (pyramid.levels > 1) return HICOLOR_INVALID_VALUE;
+
+    bool checksum_found;
+    uint64_t checksum_offset;
+    uint32_t checksum;
+    res = hicolor_find_checksum(
+        stream,
+        meta,
+        &checksum_found,
+        &checksum_offset,
+        &checksum
+    );
+    if (res != HICOLOR_OK) return res;
+
+    hicolor_value values[HICOLOR_IO_CHUNK_SIZE];
+
+    if (fseek(stream, HICOLOR_HEADER_SIZE, SEEK_SET) != 0
+        || !hicolor_skip_bytes(
+            stream,
+            ((uint64_t) y * meta.width + x) * 2
+        )) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    for (uint16_t row = 0; row < height; row++) {
+        const hicolor_rgb* pixels =
+            &image[(size_t) (y + row) * meta.width + x];
+        size_t total = 0;
+
+        while (total < width) {
+            size_t n = width - total;
+            if (n > HICOLOR_IO_CHUNK_SIZE) n = HICOLOR_IO_CHUNK_SIZE;
+
+            for (size_t i = 0; i < n; i++) {
+                res = hicolor_rgb_to_value(
+                    meta.version,
+                    pixels[total + i],
+                    &values[i]
+                );
+                if (res != HICOLOR_OK) return res;
+            }
+
+            if (hicolor_fwrite_values(stream, values, n) != n) {
+                return HICOLOR_IO_ERROR;
+            }
+            total += n;
+        }
+
+        /* Skip to the start of the rectangle in the next row. */
+        if (row + 1 < height
+            && fseek(stream, (long) (meta.width - width) * 2, SEEK_CUR) != 0) {
+            return HICOLOR_IO_ERROR;
+        }
+    }
+
+    if (checksum_found) {
+        return hicolor_write_checksum(stream, meta);
+    }
+
+    return fflush(stream) == 0 ? HICOLOR_OK : HICOLOR_IO_ERROR;
+}
+
+/* The green field is converted through a table with an entry per level:
+ * the nearest lower level in the new version and how far the old level is
+ * toward the next one (0 to 255). A level is rounded up when that fraction
+ * is above the dither threshold at its position. Converting to version A
+ * makes every pixel opaque, and converting from it drops alpha.
+ */
+hicolor_result hicolor_convert_value_rows(
+    const hicolor_metadata meta,
+    const hicolor_version version,
+    const hicolor_dither dither,
+    uint16_t y,
+    uint16_t rows,
+    hicolor_value* values
+)
+{
+    if ((meta.version != HICOLOR_VERSION_5
+         && meta.version != HICOLOR_VERSION_6
+         && meta.version != HICOLOR_VERSION_A)
+        || (version != HICOLOR_VERSION_5
+            && version != HICOLOR_VERSION_6
+            && version != HICOLOR_VERSION_A)) {
+        return HICOLOR_UNKNOWN_VERSION;
+    }
+
+    if (dither == HICOLOR_FLOYD_STEINBERG) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    bool from_v5 = meta.version != HICOLOR_VERSION_6;
+    bool to_v5 = version != HICOLOR_VERSION_6;
+    bool from_alpha = meta.version == HICOLOR_VERSION_A;
+    bool to_alpha = version == HICOLOR_VERSION_A;
+    uint16_t a_mask = from_alpha && to_alpha ? 0x8000 : 0;
+    uint16_t a_set = to_alpha && !from_alpha ? 0x8000 : 0;
+    int from_levels = from_v5 ? 32 : 64;
+    const uint8_t* from_to_256 = from_v5 ? hicolor_32_to_256 : hicolor_64_to_256;
+    const uint8_t* to_from_256 = to_v5 ? hicolor_256_to_32 : hicolor_256_to_64;
+    const uint8_t* to_to_256 = to_v5 ? hicolor_32_to_256 : hicolor_64_to_256;
+    uint8_t to_max = to_v5 ? 31 : 63;
+    int from_b_shift = from_v5 ? 10 : 11;
+    int to_b_shift = to_v5 ? 10 : 11;
+    uint16_t from_g_mask = from_levels - 1;
+
+    uint8_t nearest[64];
+    uint8_t low[64];
+    uint8_t fraction[64];
+
+    for (int g = 0; g < from_levels; g++) {
+        uint8_t intensity = from_to_256[g];
+        uint8_t level = to_from_256[intensity];
+
+        nearest[g] = level;
+
+        if (to_to_256[level] > intensity) {
+            level--;
+        }
+        uint8_t high = level < to_max ? level + 1 : level;
+        int span = to_to_256[high] - to_to_256[level];
+
+        low[g] = level;
+        fraction[g] = span == 0
+            ? 0
+            : (intensity - to_to_256[level]) * 256 / span;
+    }
+
+    /* Adding levels needs no dithering. */
+    bool ordered = to_v5 && !from_v5 && dither != HICOLOR_NO_DITHER;
+
+    for (uint16_t row = 0; row < rows; row++) {
+        hicolor_value* row_values = &values[(size_t) row * meta.width];
+        uint16_t vy = y + row;
+
+        for (uint16_t x = 0; x < meta.width; x++) {
+            hicolor_value v = row_values[x];
+            if (from_v5 && !from_alpha && (v & 0x8000)) {
+                return HICOLOR_INVALID_VALUE;
+            }
+
+            uint16_t g = (v >> 5) & from_g_mask;
+            uint16_t new_g = nearest[g];
+
+            if (ordered) {
+                uint8_t threshold;
+
+                if (dither == HICOLOR_A_DITHER) {
+                    threshold = (x + vy * 237) * 119 & 255;
+                } else if (dither == HICOLOR_BAYER) {
+                    threshold = hicolor_bayer[
+                        (vy % HICOLOR_BAYER_SIZE) * HICOLOR_BAYER_SIZE
+                        + x % HICOLOR_BAYER_SIZE
+                    ] * 256;
+                } else {
+                    threshold = hicolor_blue_noise[
+                        (vy % HICOLOR_BLUE_NOISE_SIZE) * HICOLOR_BLUE_NOISE_SIZE
+                        + x % HICOLOR_BLUE_NOISE_SIZE
+                    ];
+                }
+
+                new_g = low[g] + (fraction[g] > threshold);
+            }
+
+            row_values[x] = (v & a_mask) | a_set
+                | (v & 0x1f)
+                | new_g << 5
+                | ((v >> from_b_shift) & 0x1f) << to_b_shift;
+        }
+    }
+
+    return HICOLOR_OK;
+}
+
+/* Copy `count` bytes from `in` to `out` or skip them when converting
+ * in place.
+ */
+bool hicolor_copy_bytes(
+    FILE* in,
+    FILE* out,
+    uint64_t count
+)
+{
+    uint8_t buffer[HICOLOR_IO_CHUNK_SIZE];
+
+    if (in == out) {
+        return hicolor_skip_bytes(in, count);
+    }
+
+    while (count > 0) {
+        size_t n = count > sizeof(buffer) ? sizeof(buffer) : count;
+
+        if (fread(buffer, 1, n, in) != n
+            || fwrite(buffer, 1, n, out) != n) {
+            return false;
+        }
+
+        count -= n;
+    }
+
+    return true;
+}
+
+/* Convert the values of an image of `meta.width` by `meta.height` values
+ * at the current position of `in` in bands of rows.
+ */
+hicolor_result hicolor_convert_value_image(
+    FILE* in,
+    FILE* out,
+    const hicolor_metadata meta,
+    const hicolor_version version,
+    const hicolor_dither dither
+)
+{
+    uint16_t band_rows = HICOLOR_IO_CHUNK_SIZE * 16 / meta.width;
+    if (band_rows == 0) band_rows = 1;
+
+    hicolor_value* values =
+        HICOLOR_MALLOC(sizeof(hicolor_value) * meta.width * band_rows);
+    if (values == NULL) {
+        return HICOLOR_OUT_OF_MEMORY;
+    }
+
+    hicolor_result res = HICOLOR_OK;
+
+    for (uint16_t y = 0; y < meta.height && res == HICOLOR_OK; y += band_rows) {
+        uint16_t rows = meta.height - y < band_rows ? meta.height - y : band_rows;
+        size_t count = (size_t) meta.width * rows;
+
+        if (hicolor_fread_values(in, values, count) != count) {
+            res = HICOLOR_INSUFFICIENT_DATA;
+            break;
+        }
+
+        res = hicolor_convert_value_rows(meta, version, dither, y, rows, values);
+        if (res != HICOLOR_OK) {
+            break;
+        }
+
+        /* Reads and writes on the same stream must be separated by a seek. */
+        if (in == out
+            && fseek(out, -(long) (count * 2), SEEK_CUR) != 0) {
+            res = HICOLOR_IO_ERROR;
+            break;
+        }
+
+        if (hicolor_fwrite_values(out, values, count) != count
+            || (in == out && fseek(out, 0, SEEK_CUR) != 0)) {
+            res = HICOLOR_IO_ERROR;
+        }
+    }
+
+    HICOLOR_FREE(values);
+
+    return res;
+}
+
+hicolor_result hicolor_convert_stream(
+    FILE* in,
+    FILE* out,
+    const hicolor_version version,
+    const hicolor_dither dither
+)
+{
+    hicolor_metadata meta;
+    hicolor_pyramid pyramid;
+
+    hicolor_result res = hicolor_read_header(in, &meta);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    res = hicolor_read_pyramid(in, meta, &pyramid);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    hicolor_metadata new_meta = meta;
+    new_meta.version = version;
+
+    if (fseek(in, 0, SEEK_SET) != 0) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    res = hicolor_write_header(out, new_meta);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    if (in != out && fseek(in, HICOLOR_HEADER_SIZE, SEEK_SET) != 0) {
+        return HICOLOR_IO_ERROR;
+    }
+    /* The stream was written last. */
+    if (in == out && fseek(in, 0, SEEK_CUR) != 0) {
+        return HICOLOR_IO_ERROR;
+    }
+
+    res = hicolor_convert_value_image(in, out, meta, version, dither);
+    if (res != HICOLOR_OK) {
+        return res;
+    }
+
+    /* Convert the levels of the pyramid and pass other chunks through. */
+    bool checksum = false;
+    while (true) {
+        uint8_t tag[4];
+        uint64_t length;
+
+        size_t read = fread(tag, 1, sizeof(tag), in);
+        if (read == 0 && feof(in)) {
+            break;
+        }
+
+        if (read != sizeof(tag) || !hicolor_fread_le(in, 8, &length)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+
+        if (in != out
+            && (fwrite(tag, 1, sizeof(tag), out) != sizeof(tag)
+                || !hicolor_fwrite_le(out, length, 8))) {
+            return HICOLOR_IO_ERROR;
+        }
+
+        if (memcmp(tag, hicolor_checksum_tag, sizeof(tag)) == 0) {
+            checksum = true;
+        }
+
+        if (memcmp(tag, hicolor_pyramid_tag, sizeof(tag)) != 0
+            || pyramid.levels == 1) {
+            if (!hicolor_copy_bytes(in, out, length)) {
+                return HICOLOR_IO_ERROR;
+            }
+            continue;
+        }
+
+        /* The level count and table stay the same. */
+        uint64_t table_size = 1 + (uint64_t) (pyramid.levels - 1) * 12;
+        long table_start = ftell(in);
+        if (table_start < 0) {
+            return HICOLOR_IO_ERROR;
+        }
+        uint64_t position = (uint64_t) table_start + table_size;
+        if (length < table_size || !hicolor_copy_bytes(in, out, table_size)) {
+            return HICOLOR_INSUFFICIENT_DATA;
+        }
+        length -= table_size;
+
+        for (uint8_t i = 1; i < pyramid.levels; i++) {
+            hicolor_metadata level_meta = {
+                .version = meta.version,
+                .width = pyramid.level[i].width,
+                .height = pyramid.level[i].height
+            };
+            uint64_t size = (uint64_t) level_meta.width * level_meta.height * 2;
+
+            /* The levels must follow the table in order. */
+            if (pyramid.level[i].offset != position || length < size) {
+                return HICOLOR_INVALID_VALUE;
+            }
+
+            res = hicolor_convert_value_image(
+                in,
+                out,
+                level_meta,
+                version,
+                dither
+            );
+            if (res != HICOLOR_OK) {
+                return res;
+            }
+
+            position += size;
+            length -= size;
+        }
+
+        if (!hicolor_copy_bytes(in, out, length)) {
+            return HICOLOR_IO_ERROR;
+        }
+    }
+
+    if (checksum) {
+        return hicolor_write_checksum(out, new_meta);
+    }
+
+    return HICOLOR_OK;
+}
+
+void hicolor_filter_free(
+    hicolor_filter* filter
+)
+{
+    HICOLOR_FREE(filter->start);
+    HICOLOR_FREE(filter->count);
+    HICOLOR_FREE(filter->weights);
+    filter->start = NULL;
+    filter->count = NULL;
+    filter->weights = NULL;
+}
+
+/* Compute the weights of a triangle filter for resizing `src_size` pixels
+ * to `size`. The filter is one input pixel wide on each side when
+ * upscaling and one output pixel when downscaling.
+ */
+hicolor_result hicolor_filter_init(
+    hicolor_filter* filter,
+    uint16_t src_size,
+    uint16_t size
+)
+{
+    double scale = (double) src_size / size;
+    double radius = scale > 1 ? scale : 1;
+
+    filter->max_count = (uint16_t) ceil(radius * 2) + 1;
+    filter->start = HICOLOR_MALLOC(sizeof(uint16_t) * size);
+    filter->count = HICOLOR_MALLOC(sizeof(uint16_t) * size);
+    filter->weights = HICOLOR_MALLOC(sizeof(float) * size * filter->max_count);
+
+    if (filter->start == NULL
+        || filter->count == NULL
+        || filter->weights == NULL) {
+        hicolor_filter_free(filter);
+        return HICOLOR_OUT_OF_MEMORY;
+    }
+
+    for (uint16_t i = 0; i < size; i++) {
+        double center = (i + 0.5) * scale - 0.5;
+        long first = (long) ceil(center - radius);
+        long last = (long) floor(center + radius);
+        if (first < 0) first = 0;
+        if (last > src_size - 1) last = src_size - 1;
+        if (last - first + 1 > filter->max_count) {
+            last = first + filter->max_count - 1;
+        }
+
+        float* weights = &filter->weights[(size_t) i * filter->max_count];
+        double sum = 0;
+
+        for (long j = first; j <= last; j++) {
+            double w = 1 - fabs(j - center) / radius;
+            weights[j - first] = w > 0 ? (float) w : 0;
+            sum += weights[j - first];
+        }
+
+        /* The input pixel nearest the center always has a positive weight. */
+        for (long j = first; j <= last; j++) {
+            weights[j - first] = (float) (weights[j - first] / sum);
+        }
+
+        filter->start[i] = (uint16_t) first;
+        filter->count[i] = (uint16_t) (last - first + 1);
+    }
+
+    return HICOLOR_OK;
+}
+
+hicolor_result hicolor_resizer_init(
+    hicolor_resizer* resizer,
+    uint16_t src_width,
+    uint16_t src_height,
+    uint16_t width,
+    uint16_t height,
+    uint8_t channels
+)
+{
+    resizer->x_filter.start = NULL;
+    resizer->x_filter.count = NULL;
+    resizer->x_filter.weights = NULL;
+    resizer->y_filter = resizer->x_filter;
+    resizer->ring = NULL;
+
+    if (src_width == 0 || src_height == 0 || width == 0 || height == 0
+        || channels == 0) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    resizer->src_width = src_width;
+    resizer->src_height = src_height;
+    resizer->width = width;
+    resizer->height = height;
+    resizer->channels = channels;
+    resizer->rows_in = 0;
+    resizer->rows_out = 0;
+
+    hicolor_result res = hicolor_filter_init(
+        &resizer->x_filter,
+        src_width,
+        width
+    );
+    if (res == HICOLOR_OK) {
+        res = hicolor_filter_init(&resizer->y_filter, src_height, height);
+    }
+    if (res != HICOLOR_OK) {
+        hicolor_resizer_free(resizer);
+        return res;
+    }
+
+    resizer->ring = HICOLOR_MALLOC(
+        sizeof(float) * resizer->y_filter.max_count * width * channels
+    );
+    if (resizer->ring == NULL) {
+        hicolor_resizer_free(resizer);
+        return HICOLOR_OUT_OF_MEMORY;
+    }
+
+    return HICOLOR_OK;
+}
+
+void hicolor_resizer_free(
+    hicolor_resizer* resizer
+)
+{
+    hicolor_filter_free(&resizer->x_filter);
+    hicolor_filter_free(&resizer->y_filter);
+    HICOLOR_FREE(resizer->ring);
+    resizer->ring = NULL;
+}
+
+hicolor_result hicolor_resizer_push_row(
+    hicolor_resizer* resizer,
+    const uint8_t* row
+)
+{
+    const hicolor_filter* xf = &resizer->x_filter;
+    const hicolor_filter* yf = &resizer->y_filter;
+    uint8_t channels = resizer->channels;
+    uint16_t ring_rows = yf->max_count;
+
+    if (resizer->rows_in == resizer->src_height) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    if (resizer->rows_out < resizer->height
+        && resizer->rows_in
+           >= (uint32_t) yf->start[resizer->rows_out] + ring_rows) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    float* out = &resizer->ring[
+        (size_t) (resizer->rows_in % ring_rows) * resizer->width * channels
+    ];
+
+    for (uint16_t x = 0; x < resizer->width; x++) {
+        const float* weights = &xf->weights[(size_t) x * xf->max_count];
+        const uint8_t* in = &row[(size_t) xf->start[x] * channels];
+
+        for (uint8_t c = 0; c < channels; c++) {
+            float sum = 0;
+
+            for (uint16_t k = 0; k < xf->count[x]; k++) {
+                sum += weights[k] * in[k * channels + c];
+            }
+
+            out[(size_t) x * channels + c] = sum;
+        }
+    }
+
+    resizer->rows_in++;
+
+    return HICOLOR_OK;
+}
+
+bool hicolor_resizer_pull_row(
+    hicolor_resizer* resizer,
+    uint8_t* row
+)
+{
+    const hicolor_filter* yf = &resizer->y_filter;
+    uint16_t y = resizer->rows_out;
+
+    if (y == resizer->height
+        || (uint32_t) yf->start[y] + yf->count[y] > resizer->rows_in) {
+        return false;
+    }
+
+    const float* weights = &yf->weights[(size_t) y * yf->max_count];
+    size_t row_size = (size_t) resizer->width * resizer->channels;
+
+    for (size_t i = 0; i < row_size; i++) {
+        float sum = 0;
+
+        for (uint16_t k = 0; k < yf->count[y]; k++) {
+            uint16_t src_y = yf->start[y] + k;
+            sum += weights[k]
+                * resizer->ring[(src_y % yf->max_count) * row_size + i];
+        }
+
+        long value = lroundf(sum);
+        row[i] = value < 0 ? 0 : value > 255 ? 255 : (uint8_t) value;
+    }
+
+    resizer->rows_out++;
+
+    return true;
+}
+
+void hicolor_context_init(
+    hicolor_context* context
+)
+{
+    for (int i = 0; i < HICOLOR_CONTEXT_ARENAS; i++) {
+        context->arenas[i].block = NULL;
+        context->arenas[i].data = NULL;
+        context->arenas[i].capacity = 0;
+    }
+}
+
+void hicolor_context_free(
+    hicolor_context* context
+)
+{
+    for (int i = 0; i < HICOLOR_CONTEXT_ARENAS; i++) {
+        HICOLOR_FREE(context->arenas[i].block);
+    }
+
+    hicolor_context_init(context);
+}
+
+void* hicolor_context_buffer(
+    hicolor_context* context,
+    uint8_t arena,
+    size_t size
+)
+{
+    if (arena >= HICOLOR_CONTEXT_ARENAS) {
+        return NULL;
+    }
+
+    hicolor_arena* a = &context->arenas[arena];
+    if (size <= a->capacity) {
+        return a->data;
+    }
+
+    /* Grow by at least half to make a series of growing requests cheap. */
+    size_t capacity = a->capacity + a->capacity / 2;
+    if (capacity < size) {
+        capacity = size;
+    }
+
+    void* block = HICOLOR_MALLOC(capacity + HICOLOR_ARENA_ALIGNMENT - 1);
+    if (block == NULL) {
+        return NULL;
+    }
+
+    HICOLOR_FREE(a->block);
+    a->block = block;
+    a->data = (uint8_t*) (
+        ((uintptr_t) block + HICOLOR_ARENA_ALIGNMENT - 1)
+        & ~(uintptr_t) (HICOLOR_ARENA_ALIGNMENT - 1)
+    );
+    a->capacity = capacity;
+
+    return a->data;
+}
+
+/* Count the memory of `plan`: the image or its bands with the caller's
+ * `row_overhead`, the error rows of Floyd-Steinberg dithering, and the
+ * largest temporary table of the library. The checksum buffer is larger
+ * than the index table of an indexed image, and they are never allocated
+ * at the same time.
+ */
+size_t hicolor_plan_memory(
+    hicolor_metadata meta,
+    hicolor_dither dither,
+    bool pyramid,
+    size_t row_overhead,
+    const hicolor_plan* plan
+)
+{
+    size_t width = meta.width;
+    size_t row_size = width * sizeof(hicolor_rgb) + row_overhead;
+    size_t error_row_size = (width + 2) * 3 * sizeof(int16_t);
+    size_t memory = HICOLOR_CHECKSUM_BUFFER_SIZE;
+
+    if (plan->whole_image) {
+        size_t pixels = width * meta.height;
+        memory += meta.height * row_size;
+        if (pyramid) {
+            /* The original and three buffers for the first level. */
+            memory += pixels * sizeof(hicolor_rgb)
+                      + (pixels / 4 + width) * 3 * sizeof(hicolor_rgb);
+        }
+        if (dither == HICOLOR_FLOYD_STEINBERG) {
+            memory += error_row_size * 2;
+        }
+    } else {
+        memory += (size_t) plan->slots * plan->band_rows * row_size;
+        if (dither == HICOLOR_FLOYD_STEINBERG) {
+            memory += (size_t) (plan->jobs + 1) * error_row_size;
+        }
+    }
+
+    return memory;
+}
+
+hicolor_result hicolor_plan_conversion(
+    hicolor_metadata meta,
+    hicolor_dither dither,
+    bool whole_image,
+    bool pyramid,
+    int jobs,
+    size_t row_overhead,
+    size_t max_memory,
+    hicolor_plan* plan
+)
+{
+    if (meta.width == 0 || meta.height == 0 || jobs < 0) {
+        return HICOLOR_INVALID_VALUE;
+    }
+
+    if (max_memory == 0) {
+        max_memory = SIZE_MAX;
+    }
+
+    plan->whole_image = true;
+    plan->band_rows = meta.height;
+    plan->jobs = 0;
+    plan->slots = 1;
+    plan->memory =
+        hicolor_plan_memory(meta, dither, pyramid, row_overhead, plan);
+
+    if (whole_image || pyramid) {
+        return plan->memory <= max_memory ? HICOLOR_OK : HICOLOR_OUT_OF_MEMORY;
+    }
+
+    if (jobs == 0 && plan->memory <= max_memory) {
+        return HICOLOR_OK;
+    }
+
+    /* Every thread needs a band to work on while the next band is decoded
+     * and the previous one written.
+     */
+    plan->whole_image = false;
+    plan->band_rows = HICOLOR_PLAN_BAND_ROWS;
+    plan->jobs = jobs > 0 ? jobs : 1;
+
+    while (true) {
+        plan->slots = plan->jobs * 2 + 2;
+        plan->memory =
+            hicolor_plan_memory(meta, dither, false, row_overhead, plan);
+
+        if (plan->memory <= max_memory) {
+            return HICOLOR_OK;
+        }
+
+        if (plan->jobs > 1) {
+            plan->jobs--;
+        } else if (plan->band_rows > 1) {
+            plan->band_rows /= 2;
+        } else {
+            return HICOLOR_OUT_OF_MEMORY;
+        }
+    }
 }
 
 #endif /* HICOLOR_IMPLEMENTATION */
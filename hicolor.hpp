@@ -0,0 +1,437 @@
+/* C++20 interface to the HiColor image file format library.
+ *
+ * Copyright (c) 2021, 2023-2025 D. Bohdan and contributors listed in AUTHORS.
+ * License: MIT.
+ *
+ * This header wraps the C interface in `hicolor.h` with owning image types,
+ * views over rows and tiles, and exceptions. The implementation stays in C:
+ * define `HICOLOR_IMPLEMENTATION` and include `hicolor.h` in a single C source
+ * file of your project.
+ *
+ * Images are never copied. Functions take views, which refer to an image or
+ * a rectangle of one, and work on the pixels in place.
+ */
+
+#ifndef HICOLOR_HPP
+#define HICOLOR_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <new>
+#include <span>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+
+#include "hicolor.h"
+
+namespace hicolor {
+
+using Rgb = hicolor_rgb;
+using Value = hicolor_value;
+using Metadata = hicolor_metadata;
+
+class Error : public std::runtime_error {
+public:
+    explicit Error(hicolor_result result)
+        : std::runtime_error(hicolor_error_message(result)), result_(result)
+    {
+    }
+
+    hicolor_result result() const noexcept
+    {
+        return result_;
+    }
+
+private:
+    hicolor_result result_;
+};
+
+inline void check(hicolor_result result)
+{
+    if (result != HICOLOR_OK) {
+        throw Error(result);
+    }
+}
+
+/* Properties of dithering methods known at compile time. */
+template <hicolor_dither D>
+struct DitherTraits {
+    /* Every pixel can be quantized on its own, so rows and tiles can too. */
+    static constexpr bool independent = D != HICOLOR_FLOYD_STEINBERG;
+};
+
+/* A rectangle of pixels in an image. Rows are contiguous and `stride`
+ * pixels apart. The position of the rectangle in the image is kept
+ * so that dithering lines up with the whole image.
+ */
+template <typename T>
+class BasicView {
+public:
+    constexpr BasicView() noexcept = default;
+
+    constexpr BasicView(
+        T* image,
+        std::uint16_t image_width,
+        std::uint16_t image_height
+    ) noexcept
+        : image_(image),
+          image_width_(image_width),
+          image_height_(image_height),
+          width_(image_width),
+          height_(image_height)
+    {
+    }
+
+    /* Views of mutable pixels convert to views of constant ones. */
+    template <typename U>
+        requires std::is_convertible_v<U (*)[], T (*)[]>
+    constexpr BasicView(const BasicView<U>& other) noexcept
+        : image_(other.image()),
+          image_width_(other.image_width()),
+          image_height_(other.image_height()),
+          x_(other.x()),
+          y_(other.y()),
+          width_(other.width()),
+          height_(other.height())
+    {
+    }
+
+    constexpr std::span<T> row(std::uint16_t y) const noexcept
+    {
+        return {
+            image_ + (static_cast<std::size_t>(y_) + y) * image_width_ + x_,
+            width_
+        };
+    }
+
+    /* A view of the rectangle at (`x`, `y`) relative to this view. */
+    constexpr BasicView tile(
+        std::uint16_t x,
+        std::uint16_t y,
+        std::uint16_t width,
+        std::uint16_t height
+    ) const
+    {
+        if (width == 0
+            || height == 0
+            || x + width > width_
+            || y + height > height_) {
+            throw Error(HICOLOR_INVALID_VALUE);
+        }
+
+        BasicView view = *this;
+        view.x_ = x_ + x;
+        view.y_ = y_ + y;
+        view.width_ = width;
+        view.height_ = height;
+
+        return view;
+    }
+
+    constexpr bool whole() const noexcept
+    {
+        return width_ == image_width_ && height_ == image_height_;
+    }
+
+    /* The first pixel of the whole image. */
+    constexpr T* image() const noexcept { return image_; }
+    constexpr std::uint16_t image_width() const noexcept { return image_width_; }
+    constexpr std::uint16_t image_height() const noexcept { return image_height_; }
+    constexpr std::uint16_t x() const noexcept { return x_; }
+    constexpr std::uint16_t y() const noexcept { return y_; }
+    constexpr std::uint16_t width() const noexcept { return width_; }
+    constexpr std::uint16_t height() const noexcept { return height_; }
+    constexpr std::size_t stride() const noexcept { return image_width_; }
+
+private:
+    T* image_ = nullptr;
+    std::uint16_t image_width_ = 0;
+    std::uint16_t image_height_ = 0;
+    std::uint16_t x_ = 0;
+    std::uint16_t y_ = 0;
+    std::uint16_t width_ = 0;
+    std::uint16_t height_ = 0;
+};
+
+using View = BasicView<Rgb>;
+using ConstView = BasicView<const Rgb>;
+
+/* An RGB image that owns aligned storage. Images can be moved but not
+ * copied. `reshape` reuses the storage when it is large enough,
+ * so one image can serve as a buffer for a series of images.
+ */
+class Image {
+public:
+    static constexpr std::size_t alignment = 64;
+
+    Image() noexcept = default;
+
+    explicit Image(const Metadata& meta)
+    {
+        reshape(meta);
+    }
+
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    /* A moved-from image is empty. */
+    Image(Image&& other) noexcept
+        : meta_(std::exchange(other.meta_, Metadata{HICOLOR_VERSION_6, 0, 0})),
+          pixels_(std::move(other.pixels_)),
+          capacity_(std::exchange(other.capacity_, 0))
+    {
+    }
+
+    Image& operator=(Image&& other) noexcept
+    {
+        meta_ = std::exchange(other.meta_, Metadata{HICOLOR_VERSION_6, 0, 0});
+        pixels_ = std::move(other.pixels_);
+        capacity_ = std::exchange(other.capacity_, 0);
+
+        return *this;
+    }
+
+    void reshape(const Metadata& meta)
+    {
+        std::size_t count = static_cast<std::size_t>(meta.width) * meta.height;
+
+        if (count > capacity_) {
+            pixels_.reset(static_cast<Rgb*>(::operator new[](
+                count * sizeof(Rgb),
+                std::align_val_t(alignment)
+            )));
+            capacity_ = count;
+        }
+
+        meta_ = meta;
+    }
+
+    const Metadata& meta() const noexcept { return meta_; }
+    hicolor_version version() const noexcept { return meta_.version; }
+    std::uint16_t width() const noexcept { return meta_.width; }
+    std::uint16_t height() const noexcept { return meta_.height; }
+
+    std::span<Rgb> pixels() noexcept
+    {
+        return {pixels_.get(), static_cast<std::size_t>(width()) * height()};
+    }
+
+    std::span<const Rgb> pixels() const noexcept
+    {
+        return {pixels_.get(), static_cast<std::size_t>(width()) * height()};
+    }
+
+    View view() noexcept
+    {
+        return {pixels_.get(), width(), height()};
+    }
+
+    ConstView view() const noexcept
+    {
+        return {pixels_.get(), width(), height()};
+    }
+
+private:
+    struct Deleter {
+        void operator()(Rgb* pixels) const noexcept
+        {
+            ::operator delete[](pixels, std::align_val_t(alignment));
+        }
+    };
+
+    Metadata meta_ = {HICOLOR_VERSION_6, 0, 0};
+    std::unique_ptr<Rgb[], Deleter> pixels_;
+    std::size_t capacity_ = 0;
+};
+
+/* Quantize the pixels of `view` in place. Ordered dithering works on any
+ * view; error diffusion needs the whole image.
+ */
+template <hicolor_version V, hicolor_dither D>
+void quantize(View view)
+{
+    Metadata meta = {V, view.image_width(), view.image_height()};
+
+    if constexpr (DitherTraits<D>::independent) {
+        check(hicolor_quantize_rgb_rect(
+            meta,
+            D,
+            view.x(),
+            view.y(),
+            view.width(),
+            view.height(),
+            view.image()
+        ));
+    } else {
+        if (!view.whole()) {
+            throw Error(HICOLOR_INVALID_VALUE);
+        }
+
+        check(hicolor_quantize_rgb_image(meta, D, view.image()));
+    }
+}
+
+/* Pick the instance of `quantize` for values known only at run time. */
+inline void quantize(View view, hicolor_version version, hicolor_dither dither)
+{
+    /* RGB views have no alpha, so version A quantizes like version 5. */
+    bool v5 = version == HICOLOR_VERSION_5 || version == HICOLOR_VERSION_A;
+
+    if (!v5 && version != HICOLOR_VERSION_6) {
+        throw Error(HICOLOR_UNKNOWN_VERSION);
+    }
+
+    switch (dither) {
+    case HICOLOR_A_DITHER:
+        return v5
+            ? quantize<HICOLOR_VERSION_5, HICOLOR_A_DITHER>(view)
+            : quantize<HICOLOR_VERSION_6, HICOLOR_A_DITHER>(view);
+    case HICOLOR_BAYER:
+        return v5
+            ? quantize<HICOLOR_VERSION_5, HICOLOR_BAYER>(view)
+            : quantize<HICOLOR_VERSION_6, HICOLOR_BAYER>(view);
+    case HICOLOR_NO_DITHER:
+        return v5
+            ? quantize<HICOLOR_VERSION_5, HICOLOR_NO_DITHER>(view)
+            : quantize<HICOLOR_VERSION_6, HICOLOR_NO_DITHER>(view);
+    case HICOLOR_FLOYD_STEINBERG:
+        return v5
+            ? quantize<HICOLOR_VERSION_5, HICOLOR_FLOYD_STEINBERG>(view)
+            : quantize<HICOLOR_VERSION_6, HICOLOR_FLOYD_STEINBERG>(view);
+    case HICOLOR_BLUE_NOISE:
+        return v5
+            ? quantize<HICOLOR_VERSION_5, HICOLOR_BLUE_NOISE>(view)
+            : quantize<HICOLOR_VERSION_6, HICOLOR_BLUE_NOISE>(view);
+    default:
+        throw Error(HICOLOR_INVALID_VALUE);
+    }
+}
+
+/* Files close themselves. */
+struct FileCloser {
+    void operator()(std::FILE* stream) const noexcept
+    {
+        std::fclose(stream);
+    }
+};
+
+using File = std::unique_ptr<std::FILE, FileCloser>;
+
+inline File open(const char* path, const char* mode)
+{
+    File file(std::fopen(path, mode));
+    if (!file) {
+        throw Error(HICOLOR_IO_ERROR);
+    }
+
+    return file;
+}
+
+inline Metadata read_header(std::FILE* stream)
+{
+    Metadata meta;
+    check(hicolor_read_header(stream, &meta));
+
+    return meta;
+}
+
+/* Read `view.height()` rows of image data of `version` into `view`. */
+inline void read_rows(std::FILE* stream, hicolor_version version, View view)
+{
+    if (view.width() == view.stride()) {
+        Metadata meta = {version, view.width(), view.height()};
+        check(hicolor_read_rgb_image(stream, meta, view.row(0).data()));
+        return;
+    }
+
+    Metadata row_meta = {version, view.width(), 1};
+    for (std::uint16_t y = 0; y < view.height(); y++) {
+        check(hicolor_read_rgb_image(stream, row_meta, view.row(y).data()));
+    }
+}
+
+/* Read a whole image into `image`, reusing its storage if possible. */
+inline void read_image(std::FILE* stream, Image& image)
+{
+    Metadata meta = read_header(stream);
+    image.reshape(meta);
+    read_rows(stream, meta.version, image.view());
+}
+
+inline Image read_image(std::FILE* stream)
+{
+    Image image;
+    read_image(stream, image);
+
+    return image;
+}
+
+/* Write `view` as an image of its own. */
+inline void write_image(
+    std::FILE* stream,
+    hicolor_version version,
+    ConstView view
+)
+{
+    Metadata meta = {version, view.width(), view.height()};
+    check(hicolor_write_header(stream, meta));
+
+    if (view.width() == view.stride()) {
+        check(hicolor_write_rgb_image(stream, meta, view.row(0).data()));
+        return;
+    }
+
+    Metadata row_meta = {version, view.width(), 1};
+    for (std::uint16_t y = 0; y < view.height(); y++) {
+        check(hicolor_write_rgb_image(stream, row_meta, view.row(y).data()));
+    }
+}
+
+/* Overwrite the rectangle of `view` in an existing file of the whole image.
+ * `stream` must be open for reading and writing.
+ */
+inline void write_tile(
+    std::FILE* stream,
+    hicolor_version version,
+    ConstView view
+)
+{
+    Metadata meta = {version, view.image_width(), view.image_height()};
+
+    check(hicolor_write_rgb_rect(
+        stream,
+        meta,
+        view.x(),
+        view.y(),
+        view.width(),
+        view.height(),
+        view.image()
+    ));
+}
+
+inline void values_to_pixels(
+    hicolor_version version,
+    hicolor_pixel_format format,
+    std::span<const Value> values,
+    std::span<std::uint16_t> pixels
+)
+{
+    if (pixels.size() < values.size()) {
+        throw Error(HICOLOR_INVALID_VALUE);
+    }
+
+    check(hicolor_values_to_pixels(
+        version,
+        format,
+        values.data(),
+        pixels.data(),
+        values.size()
+    ));
+}
+
+} /* namespace hicolor */
+
+#endif /* HICOLOR_HPP */
@@ -0,0 +1,126 @@
+#! /usr/bin/env tclsh
+# Generate a tileable blue-noise threshold matrix
+# with the void-and-cluster method by Robert Ulichney.
+
+set n 64
+set sigma 1.5
+set radius 7
+set initialFraction 0.1
+
+set size [expr { $n * $n }]
+
+# Gaussian filter offsets and weights that wrap around the edges.
+set filter {}
+for {set dy -$radius} {$dy <= $radius} {incr dy} {
+    for {set dx -$radius} {$dx <= $radius} {incr dx} {
+        lappend filter $dx $dy [expr {
+            exp(-($dx * $dx + $dy * $dy) / (2.0 * $sigma * $sigma))
+        }]
+    }
+}
+
+proc update-energy {pos sign} {
+    global energy filter n
+
+    set x [expr { $pos % $n }]
+    set y [expr { $pos / $n }]
+
+    foreach {dx dy weight} $filter {
+        set i [expr { ($y + $dy) % $n * $n + ($x + $dx) % $n }]
+        lset energy $i [expr { [lindex $energy $i] + $sign * $weight }]
+    }
+}
+
+# Return the position of the tightest cluster (`value` 1)
+# or the largest void (`value` 0).
+proc find {value} {
+    global energy pattern size
+
+    set best -1
+    set bestEnergy 0
+
+    for {set i 0} {$i < $size} {incr i} {
+        if {[lindex $pattern $i] != $value} continue
+
+        set e [lindex $energy $i]
+        if {$best == -1
+            || ($value == 1 && $e > $bestEnergy)
+            || ($value == 0 && $e < $bestEnergy)} {
+            set best $i
+            set bestEnergy $e
+        }
+    }
+
+    return $best
+}
+
+proc set-pixel {pos value} {
+    global pattern
+
+    lset pattern $pos $value
+    update-energy $pos [expr { $value ? 1 : -1 }]
+}
+
+# Initial binary pattern: random minority pixels
+# spread out by moving the tightest cluster to the largest void.
+expr { srand(1) }
+set pattern [lrepeat $size 0]
+set energy [lrepeat $size 0.0]
+
+set ones [expr { int($size * $initialFraction) }]
+set placed 0
+while {$placed < $ones} {
+    set pos [expr { int(rand() * $size) }]
+    if {[lindex $pattern $pos]} continue
+
+    set-pixel $pos 1
+    incr placed
+}
+
+while 1 {
+    set cluster [find 1]
+    set-pixel $cluster 0
+    set void [find 0]
+
+    if {$void == $cluster} {
+        set-pixel $cluster 1
+        break
+    }
+
+    set-pixel $void 1
+}
+
+set initialPattern $pattern
+set initialEnergy $energy
+set rank [lrepeat $size 0]
+
+# Phase 1: rank the initial minority pixels by removing clusters.
+for {set r [expr { $ones - 1 }]} {$r >= 0} {incr r -1} {
+    set pos [find 1]
+    set-pixel $pos 0
+    lset rank $pos $r
+}
+
+# Phases 2 and 3: rank the remaining pixels by filling voids.
+# With a wrapping filter the tightest cluster of zeros
+# is the largest void of ones, so one loop covers both phases.
+set pattern $initialPattern
+set energy $initialEnergy
+
+for {set r $ones} {$r < $size} {incr r} {
+    set pos [find 0]
+    set-pixel $pos 1
+    lset rank $pos $r
+}
+
+set levels 256
+set fmt [lmap r $rank {
+    format %3i [expr { $r * $levels / $size }]
+}]
+
+set perLine 16
+for {set i 0} {$i < $size} {incr i $perLine} {
+    lappend lines [join [lrange $fmt $i [expr { $i + $perLine - 1 }]] {, }]
+}
+
+puts "\n    [join $lines ",\n    "]"
@@ -0,0 +1,26 @@
+#! /usr/bin/env tclsh
+# Generate the lookup table for CRC-32C (Castagnoli), reflected,
+# for the portable checksum code.
+
+set poly 0x82F63B78
+
+for {set i 0} {$i < 256} {incr i} {
+    set crc $i
+
+    for {set bit 0} {$bit < 8} {incr bit} {
+        if {$crc & 1} {
+            set crc [expr { ($crc >> 1) ^ $poly }]
+        } else {
+            set crc [expr { $crc >> 1 }]
+        }
+    }
+
+    lappend table [format 0x%08x $crc]
+}
+
+set perLine 6
+for {set i 0} {$i < 256} {incr i $perLine} {
+    lappend lines [join [lrange $table $i [expr { $i + $perLine - 1 }]] {, }]
+}
+
+puts "    [join $lines ",\n    "]"
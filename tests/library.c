@@ -0,0 +1,285 @@
+/* Tests for library functions the command-line program doesn't use. */
+
+#define HICOLOR_IMPLEMENTATION
+#include "../hicolor.h"
+
+#include <stdio.h>
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+void test_values_to_pixels(void)
+{
+    /* Red, full green, and an opaque and a transparent version A value. */
+    const hicolor_value v5[] = {0x001f, 0x03e0};
+    const hicolor_value v6[] = {0x001f, 0x07e0};
+    const hicolor_value va[] = {0x801f, 0x001f};
+    uint16_t pixels[2];
+
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, HICOLOR_RGB565, v5, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0xf800 && pixels[1] == 0x07e0);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, HICOLOR_BGR565, v5, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0x001f && pixels[1] == 0x07e0);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, HICOLOR_RGB565_SWAPPED, v5, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0x00f8 && pixels[1] == 0xe007);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_6, HICOLOR_RGB565, v6, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0xf800 && pixels[1] == 0x07e0);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_6, HICOLOR_XRGB1555, v6, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0x7c00 && pixels[1] == 0x03e0);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, HICOLOR_XBGR1555, v5, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0x001f && pixels[1] == 0x03e0);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, HICOLOR_ARGB1555, v5, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0xfc00 && pixels[1] == 0x83e0);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_A, HICOLOR_ARGB1555, va, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0xfc00 && pixels[1] == 0x7c00);
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_A, HICOLOR_XRGB1555, va, pixels, 2) == HICOLOR_OK);
+    CHECK(pixels[0] == 0x7c00 && pixels[1] == 0x7c00);
+
+    /* Converting in place. */
+    uint16_t values[] = {0x001f, 0x03e0};
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, HICOLOR_RGB565, values, values, 2) == HICOLOR_OK);
+    CHECK(values[0] == 0xf800 && values[1] == 0x07e0);
+
+    CHECK(hicolor_values_to_pixels(HICOLOR_VERSION_5, (hicolor_pixel_format) 99, v5, pixels, 2) == HICOLOR_INVALID_VALUE);
+    CHECK(hicolor_values_to_pixels((hicolor_version) 99, HICOLOR_RGB565, v5, pixels, 2) == HICOLOR_UNKNOWN_VERSION);
+}
+
+void test_read_value_image(void)
+{
+    FILE* stream = tmpfile();
+    CHECK(stream != NULL);
+    if (stream == NULL) return;
+
+    const hicolor_value written[] = {0x001f, 0x7fff, 0x0000, 0x03e0};
+    hicolor_value read[4];
+    hicolor_metadata meta = {HICOLOR_VERSION_5, 2, 2};
+
+    CHECK(hicolor_write_value_image(stream, meta, written) == HICOLOR_OK);
+    rewind(stream);
+    CHECK(hicolor_read_value_image(stream, meta, read) == HICOLOR_OK);
+    CHECK(memcmp(read, written, sizeof(written)) == 0);
+
+    /* A bad version is rejected before any data is read. */
+    rewind(stream);
+    meta.version = (hicolor_version) 99;
+    CHECK(hicolor_read_value_image(stream, meta, read) == HICOLOR_UNKNOWN_VERSION);
+    CHECK(ftell(stream) == 0);
+
+    /* Version 5 values can't have the top bit set. */
+    rewind(stream);
+    hicolor_value bad = 0x8000;
+    meta = (hicolor_metadata) {HICOLOR_VERSION_5, 1, 1};
+    CHECK(hicolor_write_value_image(stream, meta, &bad) == HICOLOR_INVALID_VALUE);
+    CHECK(ftell(stream) == 0);
+    meta.version = (hicolor_version) 99;
+    CHECK(hicolor_write_value_image(stream, meta, written) == HICOLOR_UNKNOWN_VERSION);
+    CHECK(ftell(stream) == 0);
+
+    const uint8_t bad_bytes[] = {0x00, 0x80};
+    CHECK(fwrite(bad_bytes, 1, sizeof(bad_bytes), stream) == sizeof(bad_bytes));
+    rewind(stream);
+    meta.version = HICOLOR_VERSION_5;
+    CHECK(hicolor_read_value_image(stream, meta, read) == HICOLOR_INVALID_VALUE);
+
+    fclose(stream);
+}
+
+/* Write a HiColor file of `meta` with the exact colors in `image`. */
+FILE* write_test_file(
+    const hicolor_metadata meta,
+    hicolor_rgb* image,
+    bool pyramid,
+    bool checksum
+)
+{
+    FILE* stream = tmpfile();
+    if (stream == NULL) return NULL;
+
+    for (size_t i = 0; i < (size_t) meta.width * meta.height; i++) {
+        hicolor_value value = (hicolor_value) (i * 37 % 0x8000);
+        hicolor_value_to_rgb(HICOLOR_VERSION_5, value, &image[i]);
+    }
+
+    if (hicolor_write_header(stream, meta) != HICOLOR_OK
+        || hicolor_write_rgb_image(stream, meta, image) != HICOLOR_OK
+        || (pyramid
+            && hicolor_write_pyramid(stream, meta, HICOLOR_NO_DITHER, image)
+               != HICOLOR_OK)
+        || (checksum && hicolor_write_checksum(stream, meta) != HICOLOR_OK)) {
+        fclose(stream);
+        return NULL;
+    }
+
+    return stream;
+}
+
+void test_write_rgb_rect(void)
+{
+    hicolor_metadata meta = {HICOLOR_VERSION_5, 64, 48};
+    hicolor_rgb image[64 * 48];
+    hicolor_rgb read[64 * 48];
+    bool found;
+
+    FILE* stream = write_test_file(meta, image, false, true);
+    CHECK(stream != NULL);
+    if (stream == NULL) return;
+
+    for (uint16_t y = 10; y < 20; y++) {
+        for (uint16_t x = 5; x < 30; x++) {
+            image[y * meta.width + x] = (hicolor_rgb) {255, 0, 255};
+        }
+    }
+
+    CHECK(hicolor_write_rgb_rect(stream, meta, 5, 10, 25, 10, image) == HICOLOR_OK);
+    CHECK(hicolor_verify_checksum(stream, meta, &found) == HICOLOR_OK && found);
+
+    CHECK(fseek(stream, HICOLOR_HEADER_SIZE, SEEK_SET) == 0);
+    CHECK(hicolor_read_rgb_image(stream, meta, read) == HICOLOR_OK);
+    CHECK(memcmp(read, image, sizeof(image)) == 0);
+
+    CHECK(hicolor_write_rgb_rect(stream, meta, 60, 0, 5, 1, image) == HICOLOR_INVALID_VALUE);
+    fclose(stream);
+
+    /* The pyramid levels would go stale. */
+    stream = write_test_file(meta, image, true, false);
+    CHECK(stream != NULL);
+    if (stream == NULL) return;
+    CHECK(hicolor_write_rgb_rect(stream, meta, 0, 0, 1, 1, image) == HICOLOR_INVALID_VALUE);
+    fclose(stream);
+
+    /* RGB has no alpha for version A. */
+    meta.version = HICOLOR_VERSION_A;
+    stream = write_test_file(meta, image, false, false);
+    CHECK(stream != NULL);
+    if (stream == NULL) return;
+    CHECK(hicolor_write_rgb_rect(stream, meta, 0, 0, 1, 1, image) == HICOLOR_INVALID_VALUE);
+    fclose(stream);
+}
+
+void test_indexed_version_a(void)
+{
+    hicolor_metadata meta = {HICOLOR_VERSION_A, 2, 1};
+    hicolor_rgb image[2] = {{255, 0, 0}, {0, 0, 255}};
+    hicolor_palette palette = {2, {0x801f, 0xfc00}};
+
+    /* Indexed images are only version 5 or 6. */
+    CHECK(!hicolor_build_palette(meta, image, &palette));
+
+    FILE* stream = tmpfile();
+    CHECK(stream != NULL);
+    if (stream == NULL) return;
+
+    CHECK(hicolor_write_indexed_header(stream, meta, &palette) == HICOLOR_UNKNOWN_VERSION);
+    CHECK(ftell(stream) == 0);
+
+    /* The same header with the version byte changed to A. */
+    meta.version = HICOLOR_VERSION_5;
+    palette = (hicolor_palette) {2, {0x001f, 0x7c00}};
+    CHECK(hicolor_write_indexed_header(stream, meta, &palette) == HICOLOR_OK);
+    CHECK(fseek(stream, 8, SEEK_SET) == 0);
+    CHECK(fputc('A', stream) == 'A');
+    rewind(stream);
+    CHECK(hicolor_read_indexed_header(stream, &meta, &palette) == HICOLOR_UNKNOWN_VERSION);
+
+    fclose(stream);
+}
+
+typedef struct progress_log {
+    int calls;
+    uint16_t last_done;
+    uint16_t total;
+    int stop_after;
+} progress_log;
+
+bool log_progress(
+    void* data,
+    uint16_t done,
+    uint16_t total
+)
+{
+    progress_log* log = data;
+
+    log->calls++;
+    log->last_done = done;
+    log->total = total;
+
+    return log->calls != log->stop_after;
+}
+
+void test_progress(void)
+{
+    hicolor_metadata meta = {HICOLOR_VERSION_6, 32, 200};
+    hicolor_rgb original[32 * 200];
+    hicolor_rgb expected[32 * 200];
+    hicolor_rgb image[32 * 200];
+
+    for (size_t i = 0; i < sizeof(original) / sizeof(original[0]); i++) {
+        original[i] = (hicolor_rgb) {i % 251, i % 241, i % 239};
+    }
+    memcpy(expected, original, sizeof(original));
+    CHECK(hicolor_quantize_rgb_image(meta, HICOLOR_FLOYD_STEINBERG, expected) == HICOLOR_OK);
+
+    /* Every band is reported. */
+    progress_log log = {0, 0, 0, 0};
+    hicolor_progress progress = {log_progress, &log, 50, 0};
+    memcpy(image, original, sizeof(original));
+    CHECK(hicolor_quantize_rgb_image_progress(meta, HICOLOR_FLOYD_STEINBERG, image, &progress) == HICOLOR_OK);
+    CHECK(log.calls == 4 && log.last_done == 200 && log.total == 200);
+    CHECK(progress.done == 200);
+    CHECK(memcmp(image, expected, sizeof(image)) == 0);
+
+    /* Returning false stops after the band, which is kept. */
+    log = (progress_log) {0, 0, 0, 1};
+    memcpy(image, original, sizeof(original));
+    CHECK(hicolor_quantize_rgb_image_progress(meta, HICOLOR_FLOYD_STEINBERG, image, &progress) == HICOLOR_CANCELED);
+    CHECK(log.calls == 1 && progress.done == 50);
+    CHECK(memcmp(image, expected, sizeof(hicolor_rgb) * 32 * 50) == 0);
+    CHECK(memcmp(&image[32 * 50], &original[32 * 50], sizeof(hicolor_rgb) * 32 * 150) == 0);
+
+    /* Returning false after the last band doesn't cancel anything. */
+    log = (progress_log) {0, 0, 0, 4};
+    memcpy(image, original, sizeof(original));
+    CHECK(hicolor_quantize_rgb_image_progress(meta, HICOLOR_BAYER, image, &progress) == HICOLOR_OK);
+
+    FILE* stream = tmpfile();
+    CHECK(stream != NULL);
+    if (stream == NULL) return;
+
+    log = (progress_log) {0, 0, 0, 2};
+    CHECK(hicolor_write_rgb_image_progress(stream, meta, expected, &progress) == HICOLOR_CANCELED);
+    CHECK(progress.done == 100 && ftell(stream) == 32 * 100 * 2);
+
+    rewind(stream);
+    log = (progress_log) {0, 0, 0, 0};
+    CHECK(hicolor_write_rgb_image_progress(stream, meta, expected, &progress) == HICOLOR_OK);
+    rewind(stream);
+    progress.callback = NULL;
+    CHECK(hicolor_read_rgb_image_progress(stream, meta, image, &progress) == HICOLOR_OK);
+    CHECK(progress.done == 200);
+    CHECK(memcmp(image, expected, sizeof(image)) == 0);
+
+    fclose(stream);
+}
+
+int main(void)
+{
+    test_values_to_pixels();
+    test_read_value_image();
+    test_write_rgb_rect();
+    test_indexed_version_a();
+    test_progress();
+
+    if (failures > 0) {
+        fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}
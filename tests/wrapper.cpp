@@ -0,0 +1,131 @@
+/* Tests for the C++ interface in hicolor.hpp. */
+
+#include "../hicolor.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+namespace {
+
+int failures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            std::fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+bool same_pixels(const hicolor::Image& a, const hicolor::Image& b)
+{
+    auto pa = a.pixels();
+    auto pb = b.pixels();
+
+    return pa.size() == pb.size()
+        && std::memcmp(pa.data(), pb.data(), pa.size_bytes()) == 0;
+}
+
+void fill(hicolor::Image& image)
+{
+    for (std::uint16_t y = 0; y < image.height(); y++) {
+        auto row = image.view().row(y);
+        for (std::uint16_t x = 0; x < image.width(); x++) {
+            row[x] = {
+                static_cast<std::uint8_t>(x * 4),
+                static_cast<std::uint8_t>(y * 5),
+                static_cast<std::uint8_t>((x + y) * 2)
+            };
+        }
+    }
+}
+
+void test_tiles()
+{
+    hicolor::Metadata meta = {HICOLOR_VERSION_6, 64, 48};
+    hicolor::Image whole(meta);
+    hicolor::Image tiled(meta);
+    fill(whole);
+    fill(tiled);
+
+    /* Quantizing tile by tile gives the same image as quantizing it whole. */
+    hicolor::quantize<HICOLOR_VERSION_6, HICOLOR_BLUE_NOISE>(whole.view());
+    for (std::uint16_t y = 0; y < meta.height; y += 16) {
+        for (std::uint16_t x = 0; x < meta.width; x += 32) {
+            hicolor::quantize(
+                tiled.view().tile(x, y, 32, 16),
+                HICOLOR_VERSION_6,
+                HICOLOR_BLUE_NOISE
+            );
+        }
+    }
+    CHECK(same_pixels(whole, tiled));
+
+    /* Error diffusion needs the whole image. */
+    bool thrown = false;
+    try {
+        hicolor::quantize(
+            tiled.view().tile(0, 0, 8, 8),
+            HICOLOR_VERSION_6,
+            HICOLOR_FLOYD_STEINBERG
+        );
+    } catch (const hicolor::Error& e) {
+        thrown = e.result() == HICOLOR_INVALID_VALUE;
+    }
+    CHECK(thrown);
+}
+
+void test_read_write()
+{
+    hicolor::Image image(hicolor::Metadata{HICOLOR_VERSION_5, 40, 30});
+    fill(image);
+    hicolor::quantize(image.view(), HICOLOR_VERSION_5, HICOLOR_BAYER);
+
+    hicolor::File file(std::tmpfile());
+    CHECK(file != nullptr);
+    if (!file) return;
+
+    hicolor::write_image(file.get(), HICOLOR_VERSION_5, image.view());
+    std::rewind(file.get());
+
+    hicolor::Image read = hicolor::read_image(file.get());
+    CHECK(read.version() == HICOLOR_VERSION_5);
+    CHECK(read.width() == 40 && read.height() == 30);
+    CHECK(same_pixels(image, read));
+
+    /* Reading again reuses the storage. */
+    std::rewind(file.get());
+    const hicolor::Rgb* storage = read.pixels().data();
+    hicolor::read_image(file.get(), read);
+    CHECK(read.pixels().data() == storage);
+}
+
+void test_values_to_pixels()
+{
+    const hicolor::Value values[] = {0x001f, 0x03e0};
+    std::uint16_t pixels[2];
+
+    hicolor::values_to_pixels(HICOLOR_VERSION_5, HICOLOR_RGB565, values, pixels);
+    CHECK(pixels[0] == 0xf800 && pixels[1] == 0x07e0);
+}
+
+} /* namespace */
+
+int main()
+{
+    try {
+        test_tiles();
+        test_read_write();
+        test_values_to_pixels();
+    } catch (const hicolor::Error& e) {
+        std::fprintf(stderr, "unexpected error: %s\n", e.what());
+        failures++;
+    }
+
+    if (failures > 0) {
+        std::fprintf(stderr, "%d check(s) failed\n", failures);
+        return 1;
+    }
+
+    return 0;
+}